@@ -0,0 +1,50 @@
+#include "NGramStorage.h"
+#include "ZipfianCorpus.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+// Builds a storage from the counts of a Zipfian text several times and reports the best time.
+// Usage: run_build_benchmark [text_size] [order] [threads] [repetitions] [pairs|flat]
+
+int main(int argc, char** argv) {
+    size_t text_size = argc > 1 ? size_t(atol(argv[1])) : 3000000;
+    uint8_t order = argc > 2 ? uint8_t(atoi(argv[2])) : 5;
+    uint32_t threads_count = argc > 3 ? uint32_t(atoi(argv[3])) : 1;
+    uint32_t repetitions = argc > 4 ? uint32_t(atoi(argv[4])) : 3;
+    bool flat = argc > 5 && string(argv[5]) == "flat";
+
+    vector<uint32_t> text = generate_text(100000, text_size, 7);
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = count_ngrams(text, order);
+
+    NGramStorage::Options options;
+    options.threads_count = threads_count;
+    double best = 0;
+    size_t model_size = 0;
+    for (uint32_t r = 0; r < repetitions; r++) {
+        vector<pair<vector<uint32_t>, uint32_t>> input;
+        FlatNGrams flat_input;
+        if (flat)
+            flat_input = FlatNGrams(ngrams);
+        else
+            input = ngrams;
+        auto start = chrono::steady_clock::now();
+        NGramStorage storage;
+        if (flat)
+            storage.init(flat_input, options);
+        else
+            storage.init(input, options);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (r == 0 || seconds < best)
+            best = seconds;
+        model_size = storage.dumps().size();
+    }
+
+    printf("%zu %s ngrams, %u threads: %.3f s, %.0f ngrams/s, %.2f bytes/ngram\n",
+           ngrams.size(), flat ? "flat" : "pair", threads_count, best, double(ngrams.size()) / best,
+           double(model_size) / double(ngrams.size()));
+    return 0;
+}
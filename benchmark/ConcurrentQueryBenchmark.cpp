@@ -0,0 +1,63 @@
+#include "NGramStorage.h"
+#include "ZipfianCorpus.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace std;
+
+// Queries one shared storage from 1..N threads and reports total throughput.
+// Usage: run_concurrent_query_benchmark [max_threads] [text_size] [queries_per_thread]
+
+double run(uint32_t threads_count, const vector<uint32_t>& queries, uint8_t order,
+           const NGramStorage& storage, bool use_reader) {
+    vector<uint64_t> found(threads_count, 0);
+    vector<std::thread> threads;
+    auto start = chrono::steady_clock::now();
+    for (uint32_t t = 0; t < threads_count; t++)
+        threads.push_back(std::thread([&, t]() {
+            NGramStorage::Reader reader = storage.get_reader();
+            vector<uint32_t> ngram(order);
+            size_t shift = t * 7919 % (queries.size() - order);
+            for (size_t i = 0; i + order <= queries.size(); i++) {
+                const uint32_t* query = queries.data() + (i + shift) % (queries.size() - order);
+                if (use_reader) {
+                    ngram.assign(query, query + order);
+                    found[t] += reader.get_ngram_count(ngram) > 0;
+                } else {
+                    found[t] += storage.get_ngram_count(query, order) > 0;
+                }
+            }
+        }));
+    for (auto& thread : threads)
+        thread.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return double(threads_count) * double(queries.size() - order + 1) / seconds;
+}
+
+int main(int argc, char** argv) {
+    uint32_t max_threads = argc > 1 ? uint32_t(atoi(argv[1])) : max(1u, std::thread::hardware_concurrency());
+    size_t text_size = argc > 2 ? size_t(atol(argv[2])) : 2000000;
+    size_t queries_count = argc > 3 ? size_t(atol(argv[3])) : 200000;
+    const uint8_t order = 3;
+
+    vector<uint32_t> text = generate_text(50000, text_size, 1);
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = count_ngrams(text, order);
+    const NGramStorage storage(ngrams);
+    vector<uint32_t> queries = generate_text(50000, queries_count, 2);
+
+    vector<uint32_t> threads_counts;
+    for (uint32_t threads_count = 1; threads_count < max_threads; threads_count *= 2)
+        threads_counts.push_back(threads_count);
+    threads_counts.push_back(max_threads);
+
+    printf("%8s %16s %16s\n", "threads", "reader q/s", "pointer q/s");
+    for (uint32_t threads_count : threads_counts) {
+        double reader_throughput = run(threads_count, queries, order, storage, true);
+        double pointer_throughput = run(threads_count, queries, order, storage, false);
+        printf("%8u %16.0f %16.0f\n", threads_count, reader_throughput, pointer_throughput);
+    }
+    return 0;
+}
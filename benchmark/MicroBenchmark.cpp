@@ -0,0 +1,232 @@
+#include "NGramStorage.h"
+#include "ZipfianCorpus.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+// Microbenchmarks of lookups, iteration, build and serialization on the counts of a Zipfian text.
+// Usage: run_micro_benchmark [--vocabulary_size=N] [--order=N] [--text_size=N] [--seed=N] [benchmark flags]
+// Results are printed and, unless --benchmark_out is given, written as JSON to micro_benchmark.json,
+// so that two runs can be compared with tools/compare.py of google-benchmark.
+
+struct Config {
+    Config(): vocabulary_size(50000), order(5), text_size(1000000), seed(1) {}
+
+    uint32_t vocabulary_size;
+    uint32_t order;
+    size_t text_size;
+    uint64_t seed;
+};
+
+struct Corpus {
+    vector<uint32_t> text;
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams;
+    NGramStorage storage;
+    string state;
+};
+
+static const uint32_t queries_count = 1 << 14;
+
+static uint64_t next_random(uint64_t& seed) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return seed >> 33;
+}
+
+// ngram_size words from random positions of the text, which are all stored. Misses get an unknown
+// last word, so that they fail at the last level.
+static vector<uint32_t> make_queries(const Corpus& corpus, const Config& config, uint32_t ngram_size, bool hits) {
+    uint64_t seed = config.seed + ngram_size;
+    vector<uint32_t> queries;
+    for (uint32_t i = 0; i < queries_count; i++) {
+        size_t position = size_t(next_random(seed) % (corpus.text.size() - ngram_size + 1));
+        queries.insert(queries.end(), corpus.text.begin() + position, corpus.text.begin() + position + ngram_size);
+        if (!hits)
+            queries.back() = config.vocabulary_size + i;
+    }
+    return queries;
+}
+
+static void lookup(benchmark::State& state, const Corpus& corpus, const vector<uint32_t>& queries,
+                   uint32_t ngram_size) {
+    uint32_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(corpus.storage.get_value(queries.data() + i * ngram_size, ngram_size));
+        i = (i + 1) % queries_count;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void find(benchmark::State& state, const CompressedArray& array, const vector<Key>& keys) {
+    uint32_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(array.find(keys[i]));
+        i = (i + 1) % keys.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void increment(benchmark::State& state, const CompressedArray& array) {
+    auto it = array.begin();
+    for (auto _ : state) {
+        ++it;
+        if (it == array.end())
+            it = array.begin();
+        benchmark::DoNotOptimize(it->value);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void advance(benchmark::State& state, const CompressedArray& array, const vector<uint32_t>& indices) {
+    uint32_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(array.begin() + indices[i]);
+        i = (i + 1) % indices.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void build(benchmark::State& state, const Corpus& corpus) {
+    for (auto _ : state) {
+        state.PauseTiming();
+        FlatNGrams ngrams(corpus.ngrams);
+        state.ResumeTiming();
+        NGramStorage storage(ngrams);
+        benchmark::DoNotOptimize(storage.get_max_ngram_size());
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(corpus.ngrams.size()));
+}
+
+static void dump(benchmark::State& state, const Corpus& corpus) {
+    for (auto _ : state)
+        benchmark::DoNotOptimize(corpus.storage.dumps());
+    state.SetBytesProcessed(state.iterations() * int64_t(corpus.state.size()));
+}
+
+static void load(benchmark::State& state, const Corpus& corpus) {
+    NGramStorage storage;
+    for (auto _ : state)
+        storage.loads(corpus.state);
+    state.SetBytesProcessed(state.iterations() * int64_t(corpus.state.size()));
+}
+
+static void vocabulary_find(benchmark::State& state, const Config& config) {
+    vector<string> words;
+    for (uint32_t i = 0; i < config.vocabulary_size; i++)
+        words.push_back("word" + to_string(i));
+    Vocabulary<string> vocabulary(words);
+    vector<string> queries;
+    for (uint32_t word_index : generate_text(config.vocabulary_size, queries_count, config.seed))
+        queries.push_back(words[word_index]);
+
+    uint32_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(vocabulary.find(queries[i]));
+        i = (i + 1) % queries_count;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static bool parse_flag(const char* arg, const char* name, uint64_t& value) {
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) != 0 || arg[length] != '=')
+        return false;
+    value = strtoull(arg + length + 1, nullptr, 10);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Config config;
+    vector<char*> args;
+    bool has_out = false;
+    for (int i = 0; i < argc; i++) {
+        uint64_t value;
+        if (parse_flag(argv[i], "--vocabulary_size", value))
+            config.vocabulary_size = uint32_t(value);
+        else if (parse_flag(argv[i], "--order", value))
+            config.order = uint32_t(value);
+        else if (parse_flag(argv[i], "--text_size", value))
+            config.text_size = size_t(value);
+        else if (parse_flag(argv[i], "--seed", value))
+            config.seed = value;
+        else
+            args.push_back(argv[i]);
+        has_out |= strncmp(argv[i], "--benchmark_out=", 16) == 0;
+    }
+    string out_flag = "--benchmark_out=micro_benchmark.json";
+    string format_flag = "--benchmark_out_format=json";
+    if (!has_out) {
+        args.push_back(&out_flag[0]);
+        args.push_back(&format_flag[0]);
+    }
+    int args_count = int(args.size());
+    benchmark::Initialize(&args_count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(args_count, args.data()))
+        return 1;
+
+    Corpus corpus;
+    corpus.text = generate_text(config.vocabulary_size, config.text_size, config.seed);
+    corpus.ngrams = count_ngrams(corpus.text, uint8_t(config.order));
+    corpus.storage.init(corpus.ngrams);
+    corpus.state = corpus.storage.dumps();
+    benchmark::AddCustomContext("vocabulary_size", to_string(config.vocabulary_size));
+    benchmark::AddCustomContext("order", to_string(config.order));
+    benchmark::AddCustomContext("text_size", to_string(config.text_size));
+    benchmark::AddCustomContext("seed", to_string(config.seed));
+    benchmark::AddCustomContext("ngrams_count", to_string(corpus.ngrams.size()));
+
+    uint64_t seed = config.seed;
+    for (uint32_t ngram_size = 1; ngram_size <= config.order; ngram_size++) {
+        const CompressedArray& array = corpus.storage.get_level(uint8_t(ngram_size));
+        vector<uint32_t> indices;
+        vector<Key> keys;
+        for (uint32_t i = 0; i < queries_count; i++) {
+            indices.push_back(uint32_t(next_random(seed) % array.size()));
+            keys.push_back((array.begin() + indices.back())->key);
+        }
+        vector<uint32_t> hits = make_queries(corpus, config, ngram_size, true);
+        vector<uint32_t> misses = make_queries(corpus, config, ngram_size, false);
+        // arguments of RegisterBenchmark are copied, so the storage is captured by reference
+        string suffix = "/" + to_string(ngram_size);
+        benchmark::RegisterBenchmark(("CompressedArray/find" + suffix).c_str(),
+                                     [&array, keys] (benchmark::State& state) {
+            find(state, array, keys);
+        });
+        benchmark::RegisterBenchmark(("CompressedArray/increment" + suffix).c_str(),
+                                     [&array] (benchmark::State& state) {
+            increment(state, array);
+        });
+        benchmark::RegisterBenchmark(("CompressedArray/advance" + suffix).c_str(),
+                                     [&array, indices] (benchmark::State& state) {
+            advance(state, array, indices);
+        });
+        benchmark::RegisterBenchmark(("NGramStorage/hit" + suffix).c_str(),
+                                     [&corpus, hits, ngram_size] (benchmark::State& state) {
+            lookup(state, corpus, hits, ngram_size);
+        });
+        benchmark::RegisterBenchmark(("NGramStorage/miss" + suffix).c_str(),
+                                     [&corpus, misses, ngram_size] (benchmark::State& state) {
+            lookup(state, corpus, misses, ngram_size);
+        });
+    }
+    benchmark::RegisterBenchmark("NGramStorage/build", [&corpus] (benchmark::State& state) {
+        build(state, corpus);
+    })->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark("NGramStorage/dump", [&corpus] (benchmark::State& state) {
+        dump(state, corpus);
+    })->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark("NGramStorage/load", [&corpus] (benchmark::State& state) {
+        load(state, corpus);
+    })->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark("Vocabulary/find", [&config] (benchmark::State& state) {
+        vocabulary_find(state, config);
+    });
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
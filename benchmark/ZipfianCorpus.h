@@ -0,0 +1,64 @@
+#ifndef NGRAMSTORAGE_ZIPFIANCORPUS_H
+#define NGRAMSTORAGE_ZIPFIANCORPUS_H
+
+#include "NGramStorage.h"
+
+#include <cmath>
+#include <unordered_map>
+
+using std::unordered_map;
+
+
+// Reproducible source of word indices with Zipfian frequencies.
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(uint32_t vocabulary_size, double exponent = 1.0, uint64_t seed = 0):
+            cumulative_weights(vocabulary_size), seed(seed) {
+        double sum = 0;
+        for (uint32_t i = 0; i < vocabulary_size; i++) {
+            sum += 1.0 / std::pow(double(i + 1), exponent);
+            cumulative_weights[i] = sum;
+        }
+        for (double& weight : cumulative_weights)
+            weight /= sum;
+    }
+
+    uint32_t operator()() {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        double x = double(seed >> 11) / double(uint64_t(1) << 53);
+        auto it = lower_bound(cumulative_weights.begin(), cumulative_weights.end(), x);
+        if (it == cumulative_weights.end())
+            --it;
+        return uint32_t(it - cumulative_weights.begin());
+    }
+
+private:
+    vector<double> cumulative_weights;
+    uint64_t seed;
+};
+
+
+inline vector<uint32_t> generate_text(uint32_t vocabulary_size, size_t text_size, uint64_t seed = 0) {
+    ZipfianGenerator generator(vocabulary_size, 1.0, seed);
+    vector<uint32_t> text(text_size);
+    for (size_t i = 0; i < text_size; i++)
+        text[i] = generator();
+    return text;
+}
+
+
+// Counts of all ngrams of size 1..max_ngram_size occurring in the text,
+// in the format accepted by NGramStorage.
+inline vector<pair<vector<uint32_t>, uint32_t>> count_ngrams(const vector<uint32_t>& text,
+                                                              uint8_t max_ngram_size) {
+    unordered_map<vector<uint32_t>, uint32_t, IntegerVectorHasher> counts;
+    for (size_t i = 0; i < text.size(); i++)
+        for (size_t j = 1; j <= max_ngram_size && i + j <= text.size(); j++)
+            counts[vector<uint32_t>(text.begin() + i, text.begin() + i + j)]++;
+
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams(counts.begin(), counts.end());
+    return ngrams;
+}
+
+
+#endif //NGRAMSTORAGE_ZIPFIANCORPUS_H
@@ -9,8 +9,8 @@ class LanguageModel:
         self.eps = eps
 
     def get_word_prob(self, word: str, context: Tuple[str, ...] = ()):
-        all_continuations = max(1, self.storage.get_continuations_count(context))
-        unique_continuations = self.storage.get_unique_continuations_count(context)
+        _, all_continuations, unique_continuations = self.storage.get_counts(context)
+        all_continuations = max(1, all_continuations)
 
         if unique_continuations == 0:
             if len(context) > 0:
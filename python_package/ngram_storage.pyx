@@ -4,8 +4,7 @@ from libcpp.pair cimport pair
 from libcpp cimport bool
 from cython.operator cimport dereference, preincrement
 
-import sys
-import tempfile
+import multiprocessing
 
 
 ctypedef unsigned int uint
@@ -19,9 +18,12 @@ cdef extern from "../src/Vocabulary.h":
         Vocabulary()
         Vocabulary(const vector[string]& words) nogil
 
-        void loads(const string& state) nogil
+        void loads(const string& state) nogil except +
         string dumps() nogil const
 
+        void loadf(const string& filename) nogil except +
+        void dumpf(const string& filename) nogil const
+
         uint get_index(const string& word) const
         const string& get_word(uint index) const
         const string& operator [] (uint index) const
@@ -47,24 +49,129 @@ cdef extern from "../src/Vocabulary.h":
         const_iterator find(const string& word) const
 
 
+cdef extern from "../src/Record.h":
+    cdef cppclass Value:
+        uint ngram_count
+        uint continuations_count
+        uint unique_continuations_count
+
+    cdef cppclass LogProbability:
+        float log_prob
+        float backoff
+
+
+cdef extern from "../src/BlockCache.h":
+    cdef cppclass BlockCache:
+        size_t get_capacity() const
+        size_t get_memory_size() const
+        unsigned long long get_hits_count() const
+        unsigned long long get_misses_count() const
+
+
+cdef extern from "../src/CompressedArray.h":
+    cdef cppclass ArrayMemoryReport "CompressedArray::MemoryReport":
+        uint records_count
+        uint blocks_count
+        uint samples_count
+        size_t data_bytes
+        size_t headers_bytes
+        size_t block_keys_bytes
+        size_t block_directory_bytes
+        size_t samples_bytes
+        size_t record_blocks_bytes
+        size_t ngram_count_values_bytes
+        size_t continuations_count_values_bytes
+        size_t unique_continuations_count_values_bytes
+        unsigned long long key_bits
+        unsigned long long value_bits
+        uint word_index_diff_log_radix
+        uint context_index_diff_log_radix
+        uint context_index_log_radix
+        uint ngram_count_index_log_radix
+        uint continuations_count_index_log_radix
+        uint unique_continuations_count_index_log_radix
+
+        size_t total_bytes() const
+        double key_bits_per_record() const
+        double value_bits_per_record() const
+        double bits_per_record() const
+
+
+cdef extern from "../src/Cache.h":
+    cdef cppclass ContextCache:
+        size_t get_capacity() const
+        unsigned long long get_hits_count() const
+        unsigned long long get_misses_count() const
+
+
+cdef extern from "../src/LookupStatistics.h":
+    cdef cppclass LookupStatistics:
+        enum Counter:
+            counters_count
+
+        @staticmethod
+        bool enabled()
+        @staticmethod
+        LookupStatistics collect()
+        @staticmethod
+        void reset()
+
+        unsigned long long get(Counter counter, uint level) const
+
+    cdef uint LookupStatistics_max_levels "LookupStatistics::max_levels"
+    cdef const char** LookupStatistics_counter_names "((const char**)LookupStatistics::counter_names)"
+
+
 cdef extern from "../src/NGramStorage.h":
     cdef cppclass Serializable:
         pass
 
     cdef cppclass NGramStorage(Serializable):
+        cppclass Options:
+            uint skip_interval
+            uint threads_count
+            bool log_probabilities
+            float delta
+            float eps
+            uint probability_bits
+            bool frequency_word_order
+
         NGramStorage()
         NGramStorage(vector[pair[vector[uint], uint]]& ngrams) nogil
         NGramStorage(string filename) nogil
 
-        void loads(const string& state) nogil
+        void loads(const string& state) nogil except +
         string dumps() nogil const
 
+        void load_mapped(const string& filename) nogil except +
+        void dump_mapped(const string& filename) nogil const except +
+
+        cppclass MemoryReport:
+            vector[ArrayMemoryReport] levels
+            vector[size_t] log_probabilities_bytes
+
+            unsigned long long ngrams_count() const
+            size_t total_bytes() const
+            double bytes_per_ngram() const
+
+        Value get_value(const vector[uint]& ngram) const
         uint get_ngram_count(const vector[uint]& ngram) const
         uint get_continuations_count(const vector[uint]& ngram) const
         uint get_unique_continuations_count(const vector[uint]& ngram) const
 
         uchar get_max_ngram_size() const
 
+        void set_block_cache_capacity(size_t capacity)
+        const BlockCache* get_block_cache() const
+        void set_context_cache_capacity(size_t capacity)
+        const ContextCache& get_context_cache() const
+        MemoryReport memory_report() nogil const
+
+        bool has_log_probabilities() const
+        bool get_log_probability(const uint* ngram, uint size, LogProbability& probability) const
+        void compute_log_probabilities(float delta, float eps, uint bits_count) nogil except +
+        float get_word_log_prob(const uint* ngram, uint size) const
+
         cppclass const_iterator:
             const_iterator operator++()
             const_iterator operator++(int)
@@ -76,44 +183,114 @@ cdef extern from "../src/NGramStorage.h":
         const_iterator end(int ngram_size) const;
 
 
+cdef extern from "../src/LanguageModel.h":
+    cdef cppclass LanguageModel:
+        LanguageModel(const NGramStorage& storage, double delta, double eps) except +
+
+        double get_word_prob(const uint* ngram, uint size) nogil const
+        double score_sentence(const uint* sentence, uint size, double* word_log_probs) nogil const
+        vector[double] score_sentences(const vector[vector[uint]]& sentences, uint threads_count) nogil const
+
+
+cdef extern from "../src/Arpa.h":
+    void load_arpa(const string& filename, Vocabulary[string]& vocabulary, NGramStorage& storage,
+                   const NGramStorage.Options& options) nogil except +
+    void dump_arpa(const string& filename, const Vocabulary[string]& vocabulary,
+                   const NGramStorage& storage, uint threads_count) nogil except +
+
+
+cdef extern from "../src/TextCounts.h":
+    void load_text_counts(const string& filename, Vocabulary[string]& vocabulary, NGramStorage& storage,
+                          const NGramStorage.Options& options) nogil except +
+
+
 cdef class CStorage:
     cdef NGramStorage storage
     cdef Vocabulary[string] vocabulary
     cdef object encoding
 
-    def __init__(self, filename):
+    def __init__(self, filename, threads_count=None, log_probabilities=False, delta=0.75, eps=1.0,
+                 probability_bits=0, frequency_word_order=False):
         self.encoding = 'utf-8'
 
-        ngrams_count = 0
-        words = set()
-        with open(filename, 'r') as infile:
-            for line in infile:
-                ngrams_count += 1
-                count, ngram = line.strip().split(' ', 1)
-                for word in ngram.split(' '):
-                    words.add(word.encode(self.encoding))
+        cdef string cfilename = filename.encode(self.encoding)
+        cdef NGramStorage.Options options
+        options.threads_count = threads_count or multiprocessing.cpu_count()
+        options.log_probabilities = log_probabilities
+        options.delta = delta
+        options.eps = eps
+        options.probability_bits = probability_bits
+        options.frequency_word_order = frequency_word_order
+        with nogil:
+            load_text_counts(cfilename, self.vocabulary, self.storage, options)
+
+    def save_mapped(self, filename):
+        cdef string storage_filename = filename.encode(self.encoding)
+        cdef string vocabulary_filename = (filename + '.vocab').encode(self.encoding)
+        with nogil:
+            self.storage.dump_mapped(storage_filename)
+            self.vocabulary.dumpf(vocabulary_filename)
+
+    @staticmethod
+    def load_mapped(filename, encoding='utf-8'):
+        cdef CStorage res = CStorage.__new__(CStorage)
+        res.encoding = encoding
+        cdef string storage_filename = filename.encode(encoding)
+        cdef string vocabulary_filename = (filename + '.vocab').encode(encoding)
+        with nogil:
+            res.storage.load_mapped(storage_filename)
+            res.vocabulary.loadf(vocabulary_filename)
+        return res
+
+    @staticmethod
+    def load_arpa(filename, threads_count=None, encoding='utf-8', frequency_word_order=False):
+        cdef CStorage res = CStorage.__new__(CStorage)
+        res.encoding = encoding
+        cdef string cfilename = filename.encode(encoding)
+        cdef NGramStorage.Options options
+        options.threads_count = threads_count or multiprocessing.cpu_count()
+        options.frequency_word_order = frequency_word_order
+        with nogil:
+            load_arpa(cfilename, res.vocabulary, res.storage, options)
+        return res
 
-        cdef vector[string] cwords = list(words)
+    def save_arpa(self, filename, threads_count=None):
+        cdef string cfilename = filename.encode(self.encoding)
+        cdef uint cthreads_count = threads_count or multiprocessing.cpu_count()
         with nogil:
-            self.vocabulary = Vocabulary[string](cwords)
-
-        cdef string cfilename
-        with tempfile.TemporaryDirectory() as tmpdir:
-            with open(tmpdir + '/encoded_ngrams', 'wb') as outfile:
-                with open(filename, 'r') as infile:
-                    outfile.write(ngrams_count.to_bytes(length=8, byteorder=sys.byteorder))
-                    for line in infile:
-                        count, ngram = line.strip().split(' ', 1)
-                        count = int(count)
-                        ngram = ngram.split(' ')
-                        outfile.write(count.to_bytes(length=4, byteorder=sys.byteorder))
-                        outfile.write(len(ngram).to_bytes(length=1, byteorder=sys.byteorder))
-                        for index in self._encode_ngram(ngram):
-                            outfile.write(index.to_bytes(length=4, byteorder=sys.byteorder))
-
-            cfilename = (tmpdir + '/encoded_ngrams').encode(self.encoding)
-            with nogil:
-                self.storage = NGramStorage(cfilename)
+            dump_arpa(cfilename, self.vocabulary, self.storage, cthreads_count)
+
+    def get_log_probability(self, ngram):
+        cdef LogProbability probability
+        cdef vector[uint] encoded_ngram
+        try:
+            encoded_ngram = self._encode_ngram(ngram)
+        except KeyError:
+            return None
+        if not self.storage.get_log_probability(encoded_ngram.data(), encoded_ngram.size(), probability):
+            return None
+        return probability.log_prob, probability.backoff
+
+    def compute_log_probabilities(self, delta=0.75, eps=1.0, probability_bits=0):
+        cdef float cdelta = delta
+        cdef float ceps = eps
+        cdef uint cbits_count = probability_bits
+        with nogil:
+            self.storage.compute_log_probabilities(cdelta, ceps, cbits_count)
+
+    def get_word_log_prob(self, ngram):
+        if not self.storage.has_log_probabilities():
+            raise ValueError('no log probabilities')
+        cdef vector[uint] encoded_ngram = self._encode_words(ngram)
+        return self.storage.get_word_log_prob(encoded_ngram.data(), encoded_ngram.size())
+
+    def get_counts(self, ngram):
+        cdef Value value
+        try:
+            value = self.storage.get_value(self._encode_ngram(ngram))
+        except KeyError:
+            return 0, 0, 0
+        return value.ngram_count, value.continuations_count, value.unique_continuations_count
 
     def get_ngram_count(self, ngram):
         try:
@@ -133,6 +310,82 @@ cdef class CStorage:
         except KeyError:
             return 0
 
+    def set_block_cache_capacity(self, capacity):
+        self.storage.set_block_cache_capacity(capacity)
+
+    def get_block_cache_statistics(self):
+        cdef const BlockCache* cache = self.storage.get_block_cache()
+        if cache == NULL:
+            return None
+        return {'capacity': cache.get_capacity(),
+                'memory_size': cache.get_memory_size(),
+                'hits': cache.get_hits_count(),
+                'misses': cache.get_misses_count()}
+
+    def set_context_cache_capacity(self, capacity):
+        self.storage.set_context_cache_capacity(capacity)
+
+    def get_context_cache_statistics(self):
+        cdef const ContextCache* cache = &self.storage.get_context_cache()
+        return {'capacity': cache.get_capacity(),
+                'hits': cache.get_hits_count(),
+                'misses': cache.get_misses_count()}
+
+    # Bytes of every level by parts, with bits per record and the parameters of the encoding,
+    # see CompressedArray::MemoryReport.
+    def memory_report(self):
+        cdef NGramStorage.MemoryReport report
+        with nogil:
+            report = self.storage.memory_report()
+        levels = []
+        for level in report.levels:
+            levels.append({'ngram_size': len(levels) + 1,
+                           'records_count': level.records_count,
+                           'blocks_count': level.blocks_count,
+                           'samples_count': level.samples_count,
+                           'data_bytes': level.data_bytes,
+                           'headers_bytes': level.headers_bytes,
+                           'block_keys_bytes': level.block_keys_bytes,
+                           'block_directory_bytes': level.block_directory_bytes,
+                           'samples_bytes': level.samples_bytes,
+                           'record_blocks_bytes': level.record_blocks_bytes,
+                           'ngram_count_values_bytes': level.ngram_count_values_bytes,
+                           'continuations_count_values_bytes': level.continuations_count_values_bytes,
+                           'unique_continuations_count_values_bytes': level.unique_continuations_count_values_bytes,
+                           'key_bits': level.key_bits,
+                           'value_bits': level.value_bits,
+                           'word_index_diff_log_radix': level.word_index_diff_log_radix,
+                           'context_index_diff_log_radix': level.context_index_diff_log_radix,
+                           'context_index_log_radix': level.context_index_log_radix,
+                           'ngram_count_index_log_radix': level.ngram_count_index_log_radix,
+                           'continuations_count_index_log_radix': level.continuations_count_index_log_radix,
+                           'unique_continuations_count_index_log_radix': level.unique_continuations_count_index_log_radix,
+                           'total_bytes': level.total_bytes(),
+                           'key_bits_per_record': level.key_bits_per_record(),
+                           'value_bits_per_record': level.value_bits_per_record(),
+                           'bits_per_record': level.bits_per_record()})
+        for i in range(report.log_probabilities_bytes.size()):
+            levels[i]['log_probabilities_bytes'] = report.log_probabilities_bytes[i]
+        return {'levels': levels,
+                'ngrams_count': report.ngrams_count(),
+                'total_bytes': report.total_bytes(),
+                'bytes_per_ngram': report.bytes_per_ngram()}
+
+    # Counters of the lookup path by ngram size, e.g. {'lookups': [...], ...}, which all storages
+    # of the process share. None unless built with NGRAMSTORAGE_STATISTICS, see setup.py.
+    def get_lookup_statistics(self):
+        cdef LookupStatistics statistics
+        if not LookupStatistics.enabled():
+            return None
+        statistics = LookupStatistics.collect()
+        levels = min(max(self.storage.get_max_ngram_size(), 1), LookupStatistics_max_levels)
+        return {LookupStatistics_counter_names[counter].decode():
+                [statistics.get(<LookupStatistics.Counter>counter, level) for level in range(levels)]
+                for counter in range(<int>LookupStatistics.counters_count)}
+
+    def reset_lookup_statistics(self):
+        LookupStatistics.reset()
+
     def get_max_ngram_size(self):
         return self.storage.get_max_ngram_size()
 
@@ -166,6 +419,14 @@ cdef class CStorage:
             encoded_ngram.append(it - self.vocabulary.begin())
         return encoded_ngram
 
+    cdef vector[uint] _encode_words(self, words):
+        cdef vector[uint] encoded_words
+        for word in words:
+            it = self.vocabulary.find(word.encode(self.encoding))
+            # unknown words get an index that is not stored
+            encoded_words.push_back(it - self.vocabulary.begin() if it != self.vocabulary.end() else 0xFFFFFFFF)
+        return encoded_words
+
     def _decode_ngram(self, ngram):
         decoded_ngram = []
         for index in ngram:
@@ -199,3 +460,42 @@ cdef class CStorage:
         with nogil:
             self.storage.loads(storage_dump)
             self.vocabulary.loads(vocabulary_dump)
+
+
+cdef class CLanguageModel:
+    cdef LanguageModel* model
+    cdef CStorage storage
+
+    def __cinit__(self, CStorage storage, delta=0.75, eps=1.0):
+        self.storage = storage
+        self.model = new LanguageModel(storage.storage, delta, eps)
+
+    def __dealloc__(self):
+        del self.model
+
+    def get_word_prob(self, word, context=()):
+        cdef vector[uint] ngram = self.storage._encode_words(tuple(context) + (word,))
+        cdef double prob
+        with nogil:
+            prob = self.model.get_word_prob(ngram.data(), ngram.size())
+        return prob
+
+    def score_sentence(self, words, return_word_log_probs=False):
+        cdef vector[uint] sentence = self.storage._encode_words(words)
+        cdef vector[double] word_log_probs = vector[double](sentence.size())
+        cdef double log_prob
+        with nogil:
+            log_prob = self.model.score_sentence(sentence.data(), sentence.size(), word_log_probs.data())
+        if return_word_log_probs:
+            return log_prob, list(word_log_probs)
+        return log_prob
+
+    def score_sentences(self, sentences, threads_count=None):
+        cdef vector[vector[uint]] encoded_sentences
+        for words in sentences:
+            encoded_sentences.push_back(self.storage._encode_words(words))
+        cdef uint cthreads_count = threads_count or multiprocessing.cpu_count()
+        cdef vector[double] log_probs
+        with nogil:
+            log_probs = self.model.score_sentences(encoded_sentences, cthreads_count)
+        return list(log_probs)
@@ -1,8 +1,17 @@
+import os
+
 from Cython.Build import cythonize
 from setuptools import setup, Extension
 
-extension = Extension('ngram_storage', sources=['ngram_storage.pyx', '../src/NGramStorage.cpp', '../src/CompressedArray.cpp'],
-                      language='c++', extra_compile_args=['--std=c++11'], extra_link_args=['--std=c++11'])
+extension = Extension('ngram_storage', sources=['ngram_storage.pyx', '../src/NGramStorage.cpp', '../src/CompressedArray.cpp',
+                                                       '../src/FlatNGrams.cpp', '../src/TextCounts.cpp', '../src/Arpa.cpp',
+                                                       '../src/LogProbabilityArray.cpp', '../src/LanguageModel.cpp',
+                                                       '../src/BlockCache.cpp', '../src/Cache.cpp',
+                                                       '../src/LookupStatistics.cpp'],
+                      # NGRAMSTORAGE_STATISTICS=1 python setup.py ... counts lookups, see CStorage.get_lookup_statistics
+                      define_macros=[('NGRAMSTORAGE_STATISTICS', None)] if os.environ.get('NGRAMSTORAGE_STATISTICS') else [],
+                      language='c++', extra_compile_args=['--std=c++11', '-pthread'],
+                      extra_link_args=['--std=c++11', '-pthread'])
 setup(name='ngram_storage', ext_modules=cythonize(extension, language_level="3"))
 
 extension = Extension('vocabulary', sources=['vocabulary.pyx'],
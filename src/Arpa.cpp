@@ -0,0 +1,349 @@
+#include "Arpa.h"
+#include "Parallel.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <unordered_set>
+
+typedef pair<const char*, uint32_t> Token;
+
+// ngrams looked up at once with NGramStorage::find_indices
+static const uint32_t lookup_batch_size = 1024;
+// records formatted by every thread at once in dump_arpa, the lower levels are read
+// closer to sequentially for larger windows
+static const uint32_t dump_window_size = 1 << 18;
+// records of a lower level that dump_arpa passes by increments rather than by a jump,
+// which decodes its block from the beginning
+static const uint32_t max_increments = 32;
+
+// Lines of the ngrams of every size and the numbers of ngrams from the header.
+struct ArpaSections {
+    vector<uint64_t> counts;
+    vector<pair<const char*, const char*>> bodies;
+};
+
+static bool is_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool starts_with(const char* begin, const char* end, const char* prefix) {
+    size_t length = strlen(prefix);
+    return size_t(end - begin) >= length && memcmp(begin, prefix, length) == 0;
+}
+
+static const char* find_line_end(const char* begin, const char* end) {
+    const char* line_end = (const char*)memchr(begin, '\n', size_t(end - begin));
+    return line_end == nullptr ? end : line_end;
+}
+
+static ArpaSections find_sections(const char* begin, const char* end, const string& filename) {
+    ArpaSections sections;
+    bool header = false;
+    uint32_t section = 0;
+    for (const char* line = begin; line < end; ) {
+        const char* line_end = find_line_end(line, end);
+        unsigned int ngram_size;
+        unsigned long long count;
+        char colon;
+        if (starts_with(line, line_end, "\\data\\")) {
+            header = true;
+        } else if (starts_with(line, line_end, "\\end\\")) {
+            if (section > 0)
+                sections.bodies[section - 1].second = line;
+            section = 0;
+            break;
+        } else if (line < line_end && *line == '\\') {
+            string text(line, line_end);
+            if (sscanf(text.c_str(), "\\%u-grams%c", &ngram_size, &colon) != 2 || colon != ':' ||
+                    ngram_size != section + 1 || ngram_size > sections.counts.size())
+                throw std::runtime_error("unexpected section \"" + text + "\" in " + filename);
+            if (section > 0)
+                sections.bodies[section - 1].second = line;
+            section = ngram_size;
+            sections.bodies[section - 1].first = line_end;
+            header = false;
+        } else if (header && starts_with(line, line_end, "ngram ")) {
+            string text(line, line_end);
+            if (sscanf(text.c_str(), "ngram %u=%llu", &ngram_size, &count) != 2 ||
+                    ngram_size != sections.counts.size() + 1)
+                throw std::runtime_error("bad header line \"" + text + "\" in " + filename);
+            sections.counts.push_back(count);
+            sections.bodies.push_back(make_pair(end, end));
+        }
+        line = line_end + 1;
+    }
+    if (section > 0)
+        sections.bodies[section - 1].second = end;
+
+    if (sections.counts.empty() || sections.counts.size() > 255)
+        throw std::runtime_error("bad ngram sizes in " + filename);
+    for (uint32_t i = 0; i < sections.counts.size(); i++)
+        if (sections.bodies[i].first == end && sections.counts[i] > 0)
+            throw std::runtime_error("no " + std::to_string(i + 1) + "-grams in " + filename);
+    return sections;
+}
+
+static float parse_float(const Token& token, const char* line, const char* line_end) {
+    char buffer[64];
+    char* number_end = buffer;
+    if (token.second < sizeof(buffer)) {
+        memcpy(buffer, token.first, token.second);
+        buffer[token.second] = '\0';
+        float value = strtof(buffer, &number_end);
+        if (number_end == buffer + token.second)
+            return value;
+    }
+    throw std::runtime_error("bad number in line \"" + string(line, line_end) + "\"");
+}
+
+// Calls function(words, log_prob, backoff) for every non-empty line of [begin, end),
+// the backoff is 0 when it is missing.
+template <class Function>
+static void parse_ngrams(const char* begin, const char* end, uint32_t ngram_size, Function function) {
+    vector<Token> tokens;
+    for (const char* line = begin; line < end; ) {
+        const char* line_end = find_line_end(line, end);
+        tokens.clear();
+        for (const char* position = line; position < line_end; ) {
+            while (position < line_end && is_separator(*position))
+                position++;
+            const char* token = position;
+            while (position < line_end && !is_separator(*position))
+                position++;
+            if (position > token)
+                tokens.push_back(Token(token, uint32_t(position - token)));
+        }
+
+        if (!tokens.empty()) {
+            if (tokens.size() != ngram_size + 1 && tokens.size() != ngram_size + 2)
+                throw std::runtime_error("bad ngram size in line \"" + string(line, line_end) + "\"");
+            float log_prob = parse_float(tokens[0], line, line_end);
+            float backoff = tokens.size() == ngram_size + 2 ?
+                            parse_float(tokens.back(), line, line_end) : 0.0f;
+            function(tokens.data() + 1, log_prob, backoff);
+        }
+        line = line_end + 1;
+    }
+}
+
+static void encode_ngram(Vocabulary<string>& vocabulary, const Token* ngram, uint32_t ngram_size,
+                         string& word, uint32_t* encoded_ngram) {
+    for (uint32_t i = 0; i < ngram_size; i++) {
+        word.assign(ngram[i].first, ngram[i].second);
+        auto it = vocabulary.find(word);
+        if (it == vocabulary.end())
+            throw std::runtime_error("word \"" + word + "\" is not among the 1-grams");
+        encoded_ngram[i] = uint32_t(it - vocabulary.begin());
+    }
+}
+
+static void append_float(string& out, float value) {
+    // the shortest representation that is read back as the same float,
+    // values with at most 7 digits are found at the first try
+    char buffer[32];
+    for (int precision = 7; precision <= 9; precision++) {
+        snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        if (strtof(buffer, nullptr) == value)
+            break;
+    }
+    out += buffer;
+}
+
+void load_arpa(const string& filename, Vocabulary<string>& vocabulary, NGramStorage& storage,
+               const NGramStorage::Options& options) {
+    MemoryMap file(filename);
+    const char* data = file.data();
+    ArpaSections sections = find_sections(data, data + file.size(), filename);
+    uint32_t max_ngram_size = uint32_t(sections.counts.size());
+
+    vector<string> words;
+    vector<float> log_probs;
+    words.reserve(sections.counts[0]);
+    parse_ngrams(sections.bodies[0].first, sections.bodies[0].second, 1, [&] (const Token* ngram, float log_prob,
+                                                                              float) {
+        words.push_back(string(ngram[0].first, ngram[0].second));
+        log_probs.push_back(log_prob);
+    });
+    if (options.frequency_word_order) {
+        vector<uint32_t> order(words.size());
+        for (uint32_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&] (uint32_t a, uint32_t b) {
+            return log_probs[a] > log_probs[b];
+        });
+        // a repeated 1-gram keeps its most probable place, as the vocabulary needs distinct words
+        vector<string> sorted_words;
+        sorted_words.reserve(words.size());
+        std::unordered_set<string> seen_words;
+        for (uint32_t i = 0; i < order.size(); i++)
+            if (seen_words.insert(words[order[i]]).second)
+                sorted_words.push_back(std::move(words[order[i]]));
+        words.swap(sorted_words);
+    }
+    vector<float>().swap(log_probs);
+    vocabulary = Vocabulary<string>(words, options.frequency_word_order);
+    vector<string>().swap(words);
+
+    string word;
+    uint32_t ngram[256];
+    NGramStorage::Builder builder(options);
+    for (uint32_t ngram_size = 1; ngram_size <= max_ngram_size; ngram_size++)
+        parse_ngrams(sections.bodies[ngram_size - 1].first, sections.bodies[ngram_size - 1].second, ngram_size,
+                     [&] (const Token* tokens, float, float) {
+            encode_ngram(vocabulary, tokens, ngram_size, word, ngram);
+            builder.add(ngram, ngram_size, 1);
+        });
+    builder.build(storage);
+
+    // an unknown word is <unk> if the model has it
+    float unknown_word_log_prob = -std::numeric_limits<float>::infinity();
+    auto unknown = vocabulary.find("<unk>");
+    uint32_t unknown_word = uint32_t(unknown - vocabulary.begin());
+    uint32_t unknown_index = CompressedArray::not_found;
+    if (unknown != vocabulary.end())
+        storage.find_index(&unknown_word, 1, unknown_index);
+
+    // every listed ngram is found in the built storage, parts of a section
+    // split at line ends are looked up in parallel. Only the floats of one level are kept
+    uint32_t threads_count = std::max<uint32_t>(options.threads_count, 1);
+    vector<LogProbability> level;
+    for (uint32_t ngram_size = 1; ngram_size <= max_ngram_size; ngram_size++) {
+        level.assign(storage.get_ngrams_count(uint8_t(ngram_size)), LogProbability(NAN, 0.0f));
+
+        const char* begin = sections.bodies[ngram_size - 1].first;
+        const char* end = sections.bodies[ngram_size - 1].second;
+        vector<const char*> bounds(threads_count + 1, begin);
+        for (uint32_t t = 1; t <= threads_count; t++) {
+            const char* bound = std::max(begin + size_t(end - begin) * t / threads_count, bounds[t - 1]);
+            bounds[t] = bound > begin && bound < end ? find_line_end(bound - 1, end) : bound;
+        }
+        parallel_run(threads_count, [&] (uint32_t t) {
+            string word;
+            vector<uint32_t> ngrams(lookup_batch_size * ngram_size);
+            vector<LogProbability> probabilities(lookup_batch_size);
+            vector<uint32_t> indices(lookup_batch_size);
+            uint32_t count = 0;
+            auto flush = [&] () {
+                storage.find_indices(ngrams.data(), ngram_size, count, indices.data());
+                for (uint32_t i = 0; i < count; i++)
+                    level[indices[i]] = probabilities[i];
+                count = 0;
+            };
+            parse_ngrams(bounds[t], bounds[t + 1], ngram_size, [&] (const Token* tokens, float log_prob, float backoff) {
+                encode_ngram(vocabulary, tokens, ngram_size, word, ngrams.data() + count * ngram_size);
+                probabilities[count++] = LogProbability(log_prob, backoff);
+                if (count == lookup_batch_size)
+                    flush();
+            });
+            flush();
+        });
+
+        if (ngram_size == 1 && unknown_index != CompressedArray::not_found)
+            unknown_word_log_prob = level[unknown_index].log_prob;
+        storage.set_log_probabilities(uint8_t(ngram_size), level, unknown_word_log_prob, options.probability_bits);
+    }
+}
+
+// Words of the ngrams of the keys of a window of a level, ngram_size words per key.
+// Prefixes are read level by level at sorted record indices, so that every thread reads
+// its range of a lower level forward and nothing but the window is kept in memory.
+static void restore_words(const NGramStorage& storage, uint8_t ngram_size, const vector<Key>& window,
+                          uint32_t threads_count, vector<uint32_t>& words) {
+    words.resize(window.size() * ngram_size);
+    vector<pair<uint32_t, uint32_t>> contexts(window.size());
+    for (uint32_t k = 0; k < window.size(); k++) {
+        words[k * ngram_size + ngram_size - 1] = window[k].word_index;
+        contexts[k] = make_pair(window[k].context_index, k);
+    }
+    for (uint32_t i = ngram_size - 1; i > 0; i--) {
+        const CompressedArray& level = storage.get_level(uint8_t(i));
+        parallel_sort(contexts.begin(), contexts.end(), std::less<pair<uint32_t, uint32_t>>(), threads_count);
+        parallel_for(threads_count, contexts.size(), [&] (size_t begin, size_t end, uint32_t) {
+            if (begin == end)
+                return;
+            uint32_t index = contexts[begin].first;
+            auto it = level.begin() + index;
+            for (size_t j = begin; j < end; j++) {
+                uint32_t gap = contexts[j].first - index;
+                index = contexts[j].first;
+                if (gap > max_increments)
+                    it += gap;
+                else
+                    for (; gap > 0; gap--)
+                        ++it;
+                words[contexts[j].second * ngram_size + i - 1] = it->key.word_index;
+                contexts[j].first = it->key.context_index;
+            }
+        });
+    }
+}
+
+void dump_arpa(const string& filename, const Vocabulary<string>& vocabulary, const NGramStorage& storage,
+               uint32_t threads_count) {
+    if (!storage.has_log_probabilities())
+        throw std::runtime_error("storage has no log probabilities");
+    FILE* out = fopen(filename.c_str(), "w");
+    if (out == nullptr)
+        throw std::runtime_error("cannot create " + filename);
+
+    uint8_t max_ngram_size = storage.get_max_ngram_size();
+    fputs("\\data\\\n", out);
+    for (uint8_t ngram_size = 1; ngram_size <= max_ngram_size; ngram_size++) {
+        unsigned long long count = 0;
+        for (uint32_t index = 0; index < storage.get_ngrams_count(ngram_size); index++)
+            if (!std::isnan(storage.get_log_probability(ngram_size, index).log_prob))
+                count++;
+        fprintf(out, "ngram %u=%llu\n", unsigned(ngram_size), count);
+    }
+
+    // Levels are read sequentially in windows, which are formatted in parallel.
+    threads_count = std::max<uint32_t>(threads_count, 1);
+    vector<Key> window;
+    vector<uint32_t> words;
+    vector<string> parts(threads_count);
+    for (uint8_t ngram_size = 1; ngram_size <= max_ngram_size; ngram_size++) {
+        fprintf(out, "\n\\%u-grams:\n", unsigned(ngram_size));
+        const CompressedArray& level = storage.get_level(ngram_size);
+
+        auto it = level.begin();
+        for (uint32_t first = 0; first < level.size(); first += uint32_t(window.size())) {
+            window.clear();
+            for (; it != level.end() && window.size() < dump_window_size * threads_count; ++it)
+                window.push_back(it->key);
+            restore_words(storage, ngram_size, window, threads_count, words);
+
+            parallel_for(threads_count, window.size(), [&] (size_t begin, size_t end, uint32_t t) {
+                string& part = parts[t];
+                part.clear();
+                for (size_t k = begin; k < end; k++) {
+                    LogProbability probability = storage.get_log_probability(ngram_size, uint32_t(first + k));
+                    if (std::isnan(probability.log_prob))
+                        continue;
+
+                    append_float(part, probability.log_prob);
+                    for (uint32_t i = 0; i < ngram_size; i++) {
+                        part += i == 0 ? '\t' : ' ';
+                        part += vocabulary.get_word(words[k * ngram_size + i]);
+                    }
+                    if (ngram_size < max_ngram_size && probability.backoff != 0.0f) {
+                        part += '\t';
+                        append_float(part, probability.backoff);
+                    }
+                    part += '\n';
+                }
+            });
+            for (uint32_t t = 0; t < threads_count; t++) {
+                fwrite(parts[t].data(), 1, parts[t].size(), out);
+                parts[t].clear();
+            }
+        }
+    }
+    fputs("\n\\end\\\n", out);
+
+    bool failed = ferror(out) != 0;
+    if (fclose(out) != 0 || failed)
+        throw std::runtime_error("cannot write " + filename);
+}
@@ -0,0 +1,25 @@
+#ifndef NGRAMSTORAGE_ARPA_H
+#define NGRAMSTORAGE_ARPA_H
+
+#include "NGramStorage.h"
+#include "Vocabulary.h"
+
+
+// Builds vocabulary and storage from an ARPA file and keeps its log probabilities
+// and backoffs, see NGramStorage::get_log_probability. Every listed ngram counts
+// once, so the count of an ngram is the number of listed ngrams starting with it.
+// The file is mapped to memory and read twice: ngrams are added to a
+// NGramStorage::Builder, which keeps about options.memory_budget bytes of them in memory,
+// then log probabilities are looked up level by level by options.threads_count threads.
+// Throws std::runtime_error on a bad line.
+void load_arpa(const string& filename, Vocabulary<string>& vocabulary, NGramStorage& storage,
+               const NGramStorage::Options& options = NGramStorage::Options());
+
+// Writes the ngrams of a storage with log probabilities level by level in windows.
+// Words of the ngrams of a window are restored from the lower levels, which are read
+// at sorted record indices, so memory does not grow with the storage.
+void dump_arpa(const string& filename, const Vocabulary<string>& vocabulary, const NGramStorage& storage,
+               uint32_t threads_count = 1);
+
+
+#endif //NGRAMSTORAGE_ARPA_H
@@ -0,0 +1,128 @@
+#include "BlockCache.h"
+
+#include <algorithm>
+
+const size_t BlockCache::max_candidates_count = 4096;
+
+size_t DecodedBlock::memory_size() const {
+    // the slot and the hash table node are about 64 bytes more
+    return sizeof(DecodedBlock) + 64 + keys.capacity() * sizeof(uint64_t) + values.capacity() * sizeof(Value) +
+           offsets.capacity() * sizeof(uint32_t);
+}
+
+BlockCache::BlockCache(size_t capacity, uint32_t shards_count): capacity(capacity) {
+    shards_count = std::max<uint32_t>(shards_count, 1);
+    shard_capacity = capacity / shards_count;
+    for (uint32_t i = 0; i < shards_count; i++)
+        shards.emplace_back(new Shard());
+}
+
+uint64_t BlockCache::make_key(uint32_t level, uint32_t block_index) {
+    return (uint64_t(level) << 32) | block_index;
+}
+
+BlockCache::Shard& BlockCache::get_shard(uint64_t key) {
+    // blocks of the same level are numbered consecutively, the multiplication spreads them
+    return *shards[((key * 0x9e3779b97f4a7c15ull) >> 32) % shards.size()];
+}
+
+bool BlockCache::admit(uint32_t level, uint32_t block_index) {
+    uint64_t key = make_key(level, block_index);
+    Shard& shard = get_shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.candidates.erase(key) > 0)
+        return true;
+    // the candidates are forgotten all at once, as in the doorkeeper of TinyLFU
+    if (shard.candidates.size() >= max_candidates_count)
+        shard.candidates.clear();
+    shard.candidates.insert(key);
+    return false;
+}
+
+void BlockCache::put(uint32_t level, uint32_t block_index, unique_ptr<DecodedBlock> block) {
+    uint64_t key = make_key(level, block_index);
+    size_t block_size = block->memory_size();
+    if (block_size > shard_capacity)
+        return;
+
+    Shard& shard = get_shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // another thread may have decoded the same block meanwhile
+    if (shard.slot_indices.count(key) > 0)
+        return;
+    while (shard.memory_size + block_size > shard_capacity)
+        evict(shard);
+
+    Slot slot;
+    slot.key = key;
+    slot.block = std::move(block);
+    slot.referenced = false;
+    shard.slot_indices[key] = uint32_t(shard.slots.size());
+    shard.slots.push_back(std::move(slot));
+    shard.memory_size += block_size;
+}
+
+// Moves the hand to the first block that was not read since the last pass and removes it.
+// The last slot takes its place.
+void BlockCache::evict(Shard& shard) {
+    while (true) {
+        if (shard.hand >= shard.slots.size())
+            shard.hand = 0;
+        Slot& slot = shard.slots[shard.hand];
+        if (!slot.referenced)
+            break;
+        slot.referenced = false;
+        shard.hand++;
+    }
+
+    Slot& slot = shard.slots[shard.hand];
+    shard.memory_size -= slot.block->memory_size();
+    shard.slot_indices.erase(slot.key);
+    if (shard.hand + 1 < shard.slots.size()) {
+        slot = std::move(shard.slots.back());
+        shard.slot_indices[slot.key] = shard.hand;
+    }
+    shard.slots.pop_back();
+}
+
+void BlockCache::clear() {
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->slot_indices.clear();
+        shard->slots.clear();
+        shard->candidates.clear();
+        shard->hand = 0;
+        shard->memory_size = 0;
+    }
+}
+
+size_t BlockCache::get_capacity() const {
+    return capacity;
+}
+
+size_t BlockCache::get_memory_size() const {
+    size_t memory_size = 0;
+    for (const auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        memory_size += shard->memory_size;
+    }
+    return memory_size;
+}
+
+uint64_t BlockCache::get_hits_count() const {
+    uint64_t hits_count = 0;
+    for (const auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        hits_count += shard->hits_count;
+    }
+    return hits_count;
+}
+
+uint64_t BlockCache::get_misses_count() const {
+    uint64_t misses_count = 0;
+    for (const auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        misses_count += shard->misses_count;
+    }
+    return misses_count;
+}
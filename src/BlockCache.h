@@ -0,0 +1,104 @@
+#ifndef NGRAMSTORAGE_BLOCKCACHE_H
+#define NGRAMSTORAGE_BLOCKCACHE_H
+
+#include "Record.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using std::vector;
+using std::unique_ptr;
+using std::shared_ptr;
+
+
+// Records of a CompressedArray block: keys packed by CompressedArray::pack_key, values
+// and the bit offsets after the records, where an iterator continues decoding.
+struct DecodedBlock {
+    vector<uint64_t> keys;
+    vector<Value> values;
+    vector<uint32_t> offsets;
+    bool same_word;
+
+    size_t memory_size() const;
+};
+
+
+// Decoded blocks of the levels of a storage, keyed by (level, block_index), that take at most
+// about capacity bytes. The cache is split into shards with a lock each, so that any number of
+// threads may use it. A shard evicts its blocks in the CLOCK order: a block that was read since
+// the hand passed it last time gets a second chance. Decoding a whole block costs more than
+// a lookup in it, so only blocks missed twice within a while are admitted.
+class BlockCache {
+public:
+    BlockCache(size_t capacity, uint32_t shards_count = 16);
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    // Calls function(block) with the lock of the block held and returns true if the block
+    // is cached, blocks are not copied. Otherwise returns false.
+    template <class Function>
+    bool visit(uint32_t level, uint32_t block_index, Function function) {
+        uint64_t key = make_key(level, block_index);
+        Shard& shard = get_shard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.slot_indices.find(key);
+        if (it == shard.slot_indices.end()) {
+            shard.misses_count++;
+            return false;
+        }
+        shard.hits_count++;
+        Slot& slot = shard.slots[it->second];
+        slot.referenced = true;
+        function(*slot.block);
+        return true;
+    }
+
+    // Whether a missing block should be decoded and put: the first miss is remembered, the second one admits it.
+    bool admit(uint32_t level, uint32_t block_index);
+    void put(uint32_t level, uint32_t block_index, unique_ptr<DecodedBlock> block);
+    void clear();
+
+    size_t get_capacity() const;
+    // bytes of the cached blocks
+    size_t get_memory_size() const;
+    uint64_t get_hits_count() const;
+    uint64_t get_misses_count() const;
+
+private:
+    struct Slot {
+        uint64_t key;
+        unique_ptr<DecodedBlock> block;
+        bool referenced;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<uint64_t, uint32_t> slot_indices;
+        vector<Slot> slots;
+        // recently missed blocks
+        std::unordered_set<uint64_t> candidates;
+        uint32_t hand = 0;
+        size_t memory_size = 0;
+        uint64_t hits_count = 0;
+        uint64_t misses_count = 0;
+    };
+
+    size_t capacity;
+    size_t shard_capacity;
+    vector<std::unique_ptr<Shard>> shards;
+
+    static const size_t max_candidates_count;
+
+    static uint64_t make_key(uint32_t level, uint32_t block_index);
+    Shard& get_shard(uint64_t key);
+    void evict(Shard& shard);
+};
+
+
+#endif //NGRAMSTORAGE_BLOCKCACHE_H
@@ -0,0 +1,138 @@
+#include "Cache.h"
+
+#include <cstdlib>
+#include <new>
+
+const uint32_t ContextCache::ways;
+const size_t ContextCache::default_capacity = 128;
+const uint64_t ContextCache::empty_hash;
+
+ContextCache::ContextCache(size_t capacity): sets_count(0), hits_count(0), misses_count(0) {
+    allocate(capacity);
+}
+
+ContextCache::ContextCache(const ContextCache& other): sets_count(0), hits_count(0), misses_count(0) {
+    allocate(other.get_capacity());
+}
+
+ContextCache& ContextCache::operator=(const ContextCache& other) {
+    if (this != &other) {
+        allocate(other.get_capacity());
+        hits_count = 0;
+        misses_count = 0;
+    }
+    return *this;
+}
+
+void ContextCache::SetsDeleter::operator()(Set* sets) const {
+    free(sets);
+}
+
+void ContextCache::allocate(size_t capacity) {
+    sets.reset();
+    sets_count = 0;
+    if (capacity == 0)
+        return;
+    size_t sets_count = 1;
+    while (sets_count * ways < capacity)
+        sets_count *= 2;
+
+    // new does not align sets to cache lines before C++17
+    void* memory = nullptr;
+    if (posix_memalign(&memory, alignof(Set), sets_count * sizeof(Set)) != 0)
+        throw std::bad_alloc();
+    sets.reset(static_cast<Set*>(memory));
+    for (size_t i = 0; i < sets_count; i++)
+        new (&sets[i]) Set();
+    this->sets_count = sets_count;
+    clear();
+}
+
+ContextCache::Set& ContextCache::get_set(uint64_t hash) const {
+    return sets[hash & (sets_count - 1)];
+}
+
+bool ContextCache::get(uint64_t hash, uint32_t& value) const {
+    if (sets_count == 0)
+        return false;
+    Set& set = get_set(hash);
+    uint32_t version = set.version.load(std::memory_order_acquire);
+    if (version % 2 == 0) {
+        for (uint32_t i = 0; i < ways; i++) {
+            if (set.hashes[i].load(std::memory_order_relaxed) != hash)
+                continue;
+            uint32_t found_value = set.values[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (set.version.load(std::memory_order_relaxed) != version)
+                break;
+            if ((set.referenced.load(std::memory_order_relaxed) & (1u << i)) == 0)
+                set.referenced.fetch_or(1u << i, std::memory_order_relaxed);
+            hits_count.fetch_add(1, std::memory_order_relaxed);
+            value = found_value;
+            return true;
+        }
+    }
+    misses_count.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void ContextCache::put(uint64_t hash, uint32_t value) {
+    if (sets_count == 0)
+        return;
+    Set& set = get_set(hash);
+    uint32_t version = set.version.load(std::memory_order_relaxed);
+    if (version % 2 != 0 ||
+        !set.version.compare_exchange_strong(version, version + 1, std::memory_order_acquire))
+        return;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // the entry with the same hash, an empty one or the first one not read since the last pass
+    uint32_t way = ways;
+    for (uint32_t i = 0; i < ways && way == ways; i++) {
+        uint64_t entry_hash = set.hashes[i].load(std::memory_order_relaxed);
+        if (entry_hash == hash || entry_hash == empty_hash)
+            way = i;
+    }
+    if (way == ways) {
+        while (true) {
+            uint32_t bit = 1u << set.hand;
+            if ((set.referenced.fetch_and(~bit, std::memory_order_relaxed) & bit) == 0)
+                break;
+            set.hand = (set.hand + 1) % ways;
+        }
+        way = set.hand;
+        set.hand = (set.hand + 1) % ways;
+    }
+    set.hashes[way].store(hash, std::memory_order_relaxed);
+    set.values[way].store(value, std::memory_order_relaxed);
+    set.referenced.fetch_and(~(1u << way), std::memory_order_relaxed);
+
+    set.version.store(version + 2, std::memory_order_release);
+}
+
+void ContextCache::clear() {
+    for (size_t i = 0; i < sets_count; i++) {
+        Set& set = sets[i];
+        set.version.store(0, std::memory_order_relaxed);
+        set.referenced.store(0, std::memory_order_relaxed);
+        for (uint32_t j = 0; j < ways; j++) {
+            set.hashes[j].store(empty_hash, std::memory_order_relaxed);
+            set.values[j].store(0, std::memory_order_relaxed);
+        }
+        set.hand = 0;
+    }
+    hits_count.store(0, std::memory_order_relaxed);
+    misses_count.store(0, std::memory_order_relaxed);
+}
+
+size_t ContextCache::get_capacity() const {
+    return sets_count * ways;
+}
+
+uint64_t ContextCache::get_hits_count() const {
+    return hits_count.load(std::memory_order_relaxed);
+}
+
+uint64_t ContextCache::get_misses_count() const {
+    return misses_count.load(std::memory_order_relaxed);
+}
@@ -5,48 +5,72 @@
 #ifndef COMPACTNGRAMSTORAGE_CACHE_H
 #define COMPACTNGRAMSTORAGE_CACHE_H
 
-#include <list>
-#include <unordered_map>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 
 using namespace std;
 
-template <class Key, class Value, class Hash=std::hash<Key>> class LRUCache {
+// Record indices of contexts keyed by a 64-bit hash of the context words, see extend_hash.
+// The capacity is fixed: entries are grouped into sets of `ways` entries that fill a cache line,
+// a hash goes to one set and evicts an entry of it in the CLOCK order. Reads take no lock,
+// so any number of threads may share a cache: a set carries a version which is odd while
+// a writer changes it, a read that overlaps a write is a miss. A put that meets another
+// writer is dropped. Hashes are not verified, two contexts collide with probability 2^-64.
+class ContextCache {
 public:
-    LRUCache(size_t cache_size): cache_size(cache_size) {}
-
-    void put(const Key& key, const Value& val) {
-        auto it = item_map.find(key);
-        if (it != item_map.end()) {
-            item_list.erase(it->second);
-            item_map.erase(it);
-        }
-        item_list.push_front(make_pair(key, val));
-        item_map.insert(make_pair(key, item_list.begin()));
-        clean();
-    };
+    static const uint32_t ways = 4;
+    static const size_t default_capacity;
+    // hash of the empty context, which is never cached
+    static const uint64_t empty_hash = 0;
 
-    bool exist(const Key& key) const {
-        return item_map.count(key) > 0;
-    };
+    // capacity is rounded up to a power of two number of sets, 0 turns the cache off
+    explicit ContextCache(size_t capacity = default_capacity);
+    // copies start empty
+    ContextCache(const ContextCache& other);
+    ContextCache& operator=(const ContextCache& other);
 
-    Value get(const Key& key) {
-        auto it = item_map.find(key);
-        item_list.splice(item_list.begin(), item_list, it->second);
-        return it->second->second;
-    };
+    // hash of a context followed by the word, never empty_hash
+    static uint64_t extend_hash(uint64_t hash, uint32_t word_index) {
+        uint64_t h = (hash ^ word_index) * 0x9e3779b97f4a7c15ull + 1;
+        h ^= h >> 31;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 29;
+        return h != empty_hash ? h : 1;
+    }
+
+    bool get(uint64_t hash, uint32_t& value) const;
+    void put(uint64_t hash, uint32_t value);
+    // Drops the entries and the statistics, no other thread may use the cache meanwhile.
+    void clear();
+
+    size_t get_capacity() const;
+    uint64_t get_hits_count() const;
+    uint64_t get_misses_count() const;
 
 private:
-    list<pair<Key, Value>> item_list;
-    unordered_map<Key, decltype(item_list.begin()), Hash> item_map;
-    size_t cache_size;
-
-    void clean() {
-        while (item_map.size() > cache_size) {
-            auto last_it = item_list.end(); last_it --;
-            item_map.erase(last_it->first);
-            item_list.pop_back();
-        }
+    struct alignas(64) Set {
+        std::atomic<uint32_t> version;
+        // bit i is set when the entry i was read since the hand passed it
+        std::atomic<uint32_t> referenced;
+        std::atomic<uint64_t> hashes[ways];
+        std::atomic<uint32_t> values[ways];
+        // changed by writers only
+        uint32_t hand;
     };
+
+    struct SetsDeleter {
+        void operator()(Set* sets) const;
+    };
+
+    std::unique_ptr<Set[], SetsDeleter> sets;
+    size_t sets_count;
+    mutable std::atomic<uint64_t> hits_count;
+    mutable std::atomic<uint64_t> misses_count;
+
+    void allocate(size_t capacity);
+    Set& get_set(uint64_t hash) const;
 };
 
 #endif //COMPACTNGRAMSTORAGE_CACHE_H
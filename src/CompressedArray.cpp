@@ -5,79 +5,232 @@
 #include "CompressedArray.h"
 
 const uint32_t CompressedArray::max_block_size = 1024;
+const uint32_t CompressedArray::batch_group_size = 16;
+const uint32_t CompressedArray::record_sampling_rate = 64;
+const uint32_t CompressedArray::streaming_window_size = 1 << 16;
+const uint32_t CompressedArray::not_found = ~uint32_t(0);
+const uint32_t CompressedArray::format_version = 2;
+const char CompressedArray::stream_magic[8] = {'N', 'G', 'R', 'A', 'M', 'A', 'R', 'R'};
+
+CompressedArray::CompressedArray(): word_index_diff_log_radix(0), context_index_diff_log_radix(0),
+                                   context_index_log_radix(0), ngram_count_index_log_radix(0),
+                                   continuations_count_index_log_radix(0),
+                                   unique_continuations_count_index_log_radix(0), data_size(0),
+                                   directory_shift(0), skip_interval(0), record_count(0), block_cache(nullptr),
+                                   block_cache_level(0) {}
+
+CompressedArray::CompressedArray(vector<Record> sorted_records, uint32_t skip_interval, uint32_t threads_count):
+        data_size(0), skip_interval(skip_interval), block_cache(nullptr), block_cache_level(0) {
+    threads_count = max<uint32_t>(threads_count, 1);
+    store_values(sorted_records, threads_count);
+    record_count = uint32_t(sorted_records.size());
+    find_best_radix_parameters(sorted_records, threads_count);
+
+    // Block boundaries depend only on record sizes, so all blocks are laid out
+    // before encoding and then encoded independently of each other.
+    RecordSizes sizes = calculate_record_sizes(sorted_records, threads_count);
+    vector<bool> same_words;
+    uint64_t offset = 0;
+    uint32_t sample_count = 0;
+    uint32_t record_index = 0;
+    while (record_index < record_count) {
+        BlockHeader header;
+        header.record_index = record_index;
+        header.offset = uint32_t(offset);
+        header.sample_index = sample_count;
+        headers.push_back(header);
+        block_keys.push_back(pack_key(sorted_records[record_index].key));
+
+        bool same_word;
+        uint32_t block_size;
+        uint32_t last_index = layout_block(sorted_records, sizes, record_index, same_word, block_size);
+        assert(block_size <= max_block_size);
+        same_words.push_back(same_word);
+        if (skip_interval > 0)
+            sample_count += (last_index - record_index - 1) / skip_interval;
+        offset += block_size;
+        record_index = last_index;
+    }
+    assert(offset < ~uint32_t(0));
+    data_size = uint32_t(offset);
+    headers.shrink_to_fit();
+    block_keys.shrink_to_fit();
+    samples.resize(sample_count);
+
+    uint32_t block_count = uint32_t(headers.size());
+    vector<BitWriter> writers(min<uint32_t>(threads_count, max<uint32_t>(block_count, 1)));
+    parallel_for(uint32_t(writers.size()), block_count, [&] (size_t begin, size_t end, uint32_t t) {
+        BitWriter& writer = writers[t];
+        writer.first_word = begin < block_count ? headers[begin].offset / 64 : 0;
+        writer.size = begin < block_count ? headers[begin].offset : 0;
+        for (size_t block_index = begin; block_index < end; block_index++) {
+            uint32_t last_index = block_index + 1 < block_count ?
+                                  headers[block_index + 1].record_index : record_count;
+            fill_block(writer, sorted_records, headers[block_index].record_index, last_index,
+                       same_words[block_index], headers[block_index].sample_index);
+            assert(writer.size == (block_index + 1 < block_count ? headers[block_index + 1].offset : data_size));
+        }
+    });
 
-CompressedArray::CompressedArray() {}
+    // one extra zero word lets the decoder always read two adjacent words
+    data.assign((data_size + 63) / 64 + 1, 0);
+    for (const BitWriter& writer : writers)
+        for (size_t i = 0; i < writer.words.size() && writer.first_word + i < data.size(); i++)
+            data[writer.first_word + i] |= writer.words[i];
+
+    build_directory();
+    build_record_blocks();
+}
 
-CompressedArray::CompressedArray(vector<Record> sorted_records) {
+CompressedArray::CompressedArray(TempFile<Record>& sorted_records, uint32_t skip_interval):
+        data_size(0), skip_interval(skip_interval), block_cache(nullptr), block_cache_level(0) {
+    // Records are read three times: for the value dictionaries, for the radix
+    // parameters and for encoding, which keeps a window of them in memory.
     store_values(sorted_records);
     record_count = uint32_t(sorted_records.size());
     find_best_radix_parameters(sorted_records);
 
+    BitWriter writer;
+    writer.first_word = 0;
+    writer.size = 0;
+    vector<Record> window;
+    RecordSizes sizes;
+    size_t window_index = 0;
+    bool exhausted = false;
     uint32_t record_index = 0;
-    while (record_index < record_count) {
+    sorted_records.rewind();
+    while (true) {
+        // a block never has more than max_block_size records
+        if (!exhausted && window.size() - window_index <= max_block_size) {
+            window.erase(window.begin(), window.begin() + window_index);
+            window_index = 0;
+            Record record;
+            while (window.size() < streaming_window_size && sorted_records.next(record))
+                window.push_back(record);
+            exhausted = window.size() < streaming_window_size;
+            sizes = calculate_record_sizes(window, 1);
+        }
+        if (window_index == window.size())
+            break;
+
         BlockHeader header;
-        header.key = sorted_records[record_index].key;
         header.record_index = record_index;
-        header.offset = uint32_t(data.size());
+        header.offset = writer.size;
+        header.sample_index = uint32_t(samples.size());
         headers.push_back(header);
-
-        size_t old_size = data.size();
-        record_index = fill_block(sorted_records, record_index);
-        size_t new_size = data.size();
-        assert(new_size - old_size <= max_block_size);
+        block_keys.push_back(pack_key(window[window_index].key));
+
+        bool same_word;
+        uint32_t block_size;
+        uint32_t last_index = layout_block(window, sizes, uint32_t(window_index), same_word, block_size);
+        if (skip_interval > 0)
+            samples.resize(samples.size() + (last_index - window_index - 1) / skip_interval);
+        fill_block(writer, window, uint32_t(window_index), last_index, same_word, header.sample_index);
+        assert(writer.size - header.offset == block_size);
+        record_index += uint32_t(last_index - window_index);
+        window_index = last_index;
     }
-    vector<BlockHeader>(headers).swap(headers);
-    vector<bool>(data).swap(data);
+    data_size = writer.size;
+    headers.shrink_to_fit();
+    block_keys.shrink_to_fit();
+    samples.shrink_to_fit();
+
+    writer.words.resize((data_size + 63) / 64 + 1, 0);
+    data = MappedArray<uint64_t>(move(writer.words));
+
+    build_directory();
+    build_record_blocks();
+}
+
+void CompressedArray::store_values(const vector<Record>& records, uint32_t threads_count) {
+    vector<Vocabulary<uint32_t>*> vocabularies = {&ngram_count_values,
+                                                  &continuations_count_values,
+                                                  &unique_continuations_count_values};
+    parallel_for(threads_count, vocabularies.size(), [&] (size_t begin, size_t end, uint32_t) {
+        for (size_t k = begin; k < end; k++) {
+            vector<uint32_t> values;
+            values.reserve(records.size());
+            for (const Record &record : records)
+                if (k == 0)
+                    values.push_back(record.value.ngram_count);
+                else if (k == 1)
+                    values.push_back(record.value.continuations_count);
+                else
+                    values.push_back(record.value.unique_continuations_count);
+            *vocabularies[k] = Vocabulary<uint32_t>(values);
+        }
+    });
 }
 
-void CompressedArray::store_values(vector<Record> records) {
-    vector<uint32_t> ngram_counts;
-    vector<uint32_t> continuations_counts;
-    vector<uint32_t> unique_continuations_counts;
-    for (const Record &record : records) {
-        ngram_counts.push_back(record.value.ngram_count);
-        continuations_counts.push_back(record.value.continuations_count);
-        unique_continuations_counts.push_back(record.value.unique_continuations_count);
+void CompressedArray::store_values(TempFile<Record>& records) {
+    // duplicates are removed whenever the number of values doubles
+    vector<vector<uint32_t>> values(3);
+    vector<size_t> unique_sizes(3, 1024);
+    records.rewind();
+    Record record;
+    while (records.next(record)) {
+        values[0].push_back(record.value.ngram_count);
+        values[1].push_back(record.value.continuations_count);
+        values[2].push_back(record.value.unique_continuations_count);
+        for (uint32_t k = 0; k < 3; k++)
+            if (values[k].size() >= 2 * unique_sizes[k]) {
+                sort(values[k].begin(), values[k].end());
+                values[k].erase(unique(values[k].begin(), values[k].end()), values[k].end());
+                unique_sizes[k] = max<size_t>(values[k].size(), 1024);
+            }
     }
-    ngram_count_values = Vocabulary<uint32_t>(ngram_counts);
-    continuations_count_values = Vocabulary<uint32_t>(continuations_counts);
-    unique_continuations_count_values = Vocabulary<uint32_t>(unique_continuations_counts);
+    ngram_count_values = Vocabulary<uint32_t>(values[0]);
+    continuations_count_values = Vocabulary<uint32_t>(values[1]);
+    unique_continuations_count_values = Vocabulary<uint32_t>(values[2]);
 }
 
-uint32_t CompressedArray::fill_block(const vector<Record>& sorted_records, uint32_t record_index) {
-    const Record& firstRecord = sorted_records[record_index];
+CompressedArray::RecordSizes CompressedArray::calculate_record_sizes(const vector<Record>& sorted_records,
+                                                                     uint32_t threads_count) const {
+    RecordSizes sizes;
+    sizes.value_sizes.resize(sorted_records.size());
+    sizes.key_sizes.resize(sorted_records.size());
+    sizes.same_word_key_sizes.resize(sorted_records.size());
+    parallel_for(threads_count, sorted_records.size(), [&] (size_t begin, size_t end, uint32_t) {
+        for (size_t i = begin; i < end; i++) {
+            sizes.value_sizes[i] = calculate_value_size(sorted_records[i].value);
+            if (i > 0) {
+                sizes.key_sizes[i] = calculate_key_size(sorted_records[i].key, sorted_records[i - 1].key, false);
+                sizes.same_word_key_sizes[i] = calculate_key_size(sorted_records[i].key,
+                                                                  sorted_records[i - 1].key, true);
+            }
+        }
+    });
+    return sizes;
+}
 
-    uint32_t block_size = 0;
-    block_size += calculate_value_size(firstRecord.value);
+uint32_t CompressedArray::layout_block(const vector<Record>& sorted_records, const RecordSizes& sizes,
+                                       uint32_t record_index, bool& same_word, uint32_t& block_size) const {
+    block_size = 0;
+    block_size += sizes.value_sizes[record_index];
     block_size += 1;
 
     uint32_t same_word_block_size = block_size;
-    uint32_t first_index = record_index;
     uint32_t last_index = record_index + 1;
-    bool same_word = true;
+    same_word = true;
     while (last_index < sorted_records.size()) {
-        const Record& last_record = sorted_records[last_index];
-        const Record& prev_record = sorted_records[last_index - 1];
-        uint32_t last_record_size = calculate_record_size(last_record, prev_record, false);
-        uint32_t same_word_last_record_size = calculate_record_size(last_record, prev_record, true);
+        uint32_t last_record_size = sizes.key_sizes[last_index] + sizes.value_sizes[last_index];
+        uint32_t same_word_last_record_size = sizes.same_word_key_sizes[last_index] + sizes.value_sizes[last_index];
         if (block_size + last_record_size > max_block_size)
             break;
 
         block_size += last_record_size;
         same_word_block_size += same_word_last_record_size;
 
-        same_word &= prev_record.key.word_index == last_record.key.word_index;
+        same_word &= sorted_records[last_index - 1].key.word_index == sorted_records[last_index].key.word_index;
         last_index++;
     }
 
     if (same_word) {
         block_size = same_word_block_size;
         while (last_index != sorted_records.size()) {
-            const Record& last_record = sorted_records[last_index];
-            const Record& prev_record = sorted_records[last_index - 1];
-            uint32_t last_record_size = calculate_record_size(last_record, prev_record, true);
+            uint32_t last_record_size = sizes.same_word_key_sizes[last_index] + sizes.value_sizes[last_index];
             if (block_size + last_record_size > max_block_size ||
-                prev_record.key.word_index != last_record.key.word_index)
+                sorted_records[last_index - 1].key.word_index != sorted_records[last_index].key.word_index)
                 break;
 
             block_size += last_record_size;
@@ -85,12 +238,24 @@ uint32_t CompressedArray::fill_block(const vector<Record>& sorted_records, uint3
         }
     }
 
-    add_value(firstRecord.value);
-    add_bit(same_word);
-    for (record_index = first_index + 1; record_index < last_index; record_index++)
-        add_record(sorted_records[record_index], sorted_records[record_index - 1], same_word);
+    return last_index;
+}
 
-    return record_index;
+void CompressedArray::fill_block(BitWriter& writer, const vector<Record>& sorted_records, uint32_t first_index,
+                                 uint32_t last_index, bool same_word, uint32_t sample_index) {
+    add_value(writer, sorted_records[first_index].value);
+    add_bit(writer, same_word);
+    for (uint32_t record_index = first_index + 1; record_index < last_index; record_index++) {
+        const Record& record = sorted_records[record_index];
+        add_key(writer, record.key, sorted_records[record_index - 1].key, same_word);
+        if (skip_interval > 0 && (record_index - first_index) % skip_interval == 0) {
+            SkipSample sample;
+            sample.key = record.key;
+            sample.offset = writer.size;
+            samples[sample_index++] = sample;
+        }
+        add_value(writer, record.value);
+    }
 }
 
 uint32_t CompressedArray::size() const {
@@ -110,27 +275,334 @@ CompressedArray::const_iterator CompressedArray::end() const {
 }
 
 CompressedArray::const_iterator CompressedArray::find(Key key) const {
-    BlockHeader header;
-    header.key = key;
-
-    auto it = upper_bound(headers.begin(), headers.end(), header);
-    if (it == headers.begin())
+    uint32_t block_index = find_block(key);
+    if (block_index == headers.size()) {
+        NGRAMSTORAGE_COUNT(lookups, block_cache_level, 1);
+        NGRAMSTORAGE_COUNT(misses, block_cache_level, 1);
         return end();
-    it--;
-    uint32_t block_index = uint32_t(it - headers.begin());
+    }
+    return find_in_block(block_index, key);
+}
+
+uint64_t CompressedArray::pack_key(Key key) {
+    return (uint64_t(key.word_index) << 32) | key.context_index;
+}
+
+Key CompressedArray::unpack_key(uint64_t key) {
+    return Key(uint32_t(key >> 32), uint32_t(key));
+}
 
+void CompressedArray::build_directory() {
+    uint32_t blocks_count = uint32_t(headers.size());
+    uint32_t max_word_index = blocks_count > 0 ? unpack_key(block_keys[blocks_count - 1]).word_index : 0;
+
+    // about one bucket per block, so that a bucket spans a cache line of keys on average
+    uint32_t buckets_bits = 0;
+    while ((uint64_t(1) << buckets_bits) < blocks_count)
+        buckets_bits++;
+    directory_shift = 0;
+    while ((uint64_t(max_word_index) >> directory_shift) >= (uint64_t(1) << buckets_bits))
+        directory_shift++;
+
+    uint32_t buckets_count = (max_word_index >> directory_shift) + 1;
+    vector<uint32_t> directory(buckets_count + 1);
+    uint32_t block_index = 0;
+    for (uint32_t bucket = 0; bucket <= buckets_count; bucket++) {
+        while (block_index < blocks_count &&
+               (unpack_key(block_keys[block_index]).word_index >> directory_shift) < bucket)
+            block_index++;
+        directory[bucket] = block_index;
+    }
+    block_directory = MappedArray<uint32_t>(move(directory));
+}
+
+void CompressedArray::build_record_blocks() {
+    vector<uint32_t> blocks((record_count + record_sampling_rate - 1) / record_sampling_rate);
+    uint32_t block_index = 0;
+    for (uint32_t i = 0; i < blocks.size(); i++) {
+        uint32_t record_index = i * record_sampling_rate;
+        while (block_index + 1 < headers.size() && headers[block_index + 1].record_index <= record_index)
+            block_index++;
+        blocks[i] = block_index;
+    }
+    record_blocks = MappedArray<uint32_t>(move(blocks));
+}
+
+uint32_t CompressedArray::find_record_block(uint32_t record_index) const {
+    uint32_t block_index = record_blocks[record_index / record_sampling_rate];
+    while (block_index + 1 < headers.size() && headers[block_index + 1].record_index <= record_index)
+        block_index++;
+    return block_index;
+}
+
+uint32_t CompressedArray::find_block(Key key) const {
+    uint32_t blocks_count = uint32_t(headers.size());
+    uint32_t bucket = key.word_index >> directory_shift;
+    if (bucket + size_t(1) >= block_directory.size())  // key is greater than any first key
+        return blocks_count == 0 ? blocks_count : blocks_count - 1;
+
+    const uint64_t* first = block_keys.data() + block_directory[bucket];
+    const uint64_t* last = block_keys.data() + block_directory[bucket + 1];
+    const uint64_t* it = upper_bound(first, last, pack_key(key));
+    if (it == block_keys.data())
+        return blocks_count;
+    return uint32_t(it - block_keys.data()) - 1;
+}
+
+CompressedArray::const_iterator CompressedArray::find_in_block(uint32_t block_index, Key key) const {
     CompressedArray::const_iterator res(this);
-    res.switch_to_block(block_index);
-    while (res.block_index == block_index && key != res->key)
-        res++;
+    bool found = false;
+    NGRAMSTORAGE_COUNT(lookups, block_cache_level, 1);
+    if (block_cache != nullptr && visit_decoded_block(block_index, [&] (const DecodedBlock& block) {
+            found = res.find_in_decoded_block(block_index, block, key);
+        })) {
+        NGRAMSTORAGE_COUNT(misses, block_cache_level, !found);
+        return found ? res : end();
+    }
+    NGRAMSTORAGE_COUNT(blocks_switched, block_cache_level, 1);
+
+    res.block_index = block_index;
+    res.record_index = headers[block_index].record_index;
+    res.offset = headers[block_index].offset;
+    res.record.key = unpack_key(block_keys[block_index]);
+
+    // Only keys are decoded while scanning, values are skipped over
+    // until the match. Records are sorted, so a greater key means a miss.
+    found = res.record.key == key;
+    if (found)
+        res.read_value();
+    else
+        res.skip_value();
+    res.same_word = res.read_bit();
+#ifdef NGRAMSTORAGE_STATISTICS
+    // where the decoding continues after the jump to a sample
+    uint32_t scan_index = headers[block_index].record_index;
+    uint32_t scan_offset = headers[block_index].offset;
+#endif
+
+    if (!found) {
+        uint32_t first_sample = headers[block_index].sample_index;
+        uint32_t last_sample = block_index + 1 < headers.size() ? headers[block_index + 1].sample_index :
+                               uint32_t(samples.size());
+        uint32_t sample = first_sample;
+        while (sample < last_sample && !(key < samples[sample].key))
+            sample++;
+        if (sample > first_sample) {
+            NGRAMSTORAGE_COUNT(records_decoded, block_cache_level, 1);
+            NGRAMSTORAGE_COUNT(bits_read, block_cache_level, res.offset - scan_offset);
+            res.record.key = samples[sample - 1].key;
+            res.offset = samples[sample - 1].offset;
+            res.record_index += (sample - first_sample) * skip_interval;
+#ifdef NGRAMSTORAGE_STATISTICS
+            scan_index = res.record_index;
+            scan_offset = res.offset;
+#endif
+            found = res.record.key == key;
+            if (found)
+                res.read_value();
+            else
+                res.skip_value();
+        }
+    }
 
-    if (res.block_index != block_index)
-        return end();
+    uint32_t last_index = block_index + 1 < headers.size() ? headers[block_index + 1].record_index :
+                          record_count;
+    while (!found && res.record_index + 1 < last_index) {
+        res.read_key();
+        res.record_index++;
+        if (res.record.key == key) {
+            res.read_value();
+            found = true;
+        } else if (key < res.record.key) {
+            break;
+        } else {
+            res.skip_value();
+        }
+    }
 
+    NGRAMSTORAGE_COUNT(records_decoded, block_cache_level, res.record_index - scan_index + 1);
+    NGRAMSTORAGE_COUNT(bits_read, block_cache_level, res.offset - scan_offset);
+    NGRAMSTORAGE_COUNT(misses, block_cache_level, !found);
+    if (!found)
+        return end();
     return res;
 }
 
+unique_ptr<DecodedBlock> CompressedArray::decode_block(uint32_t block_index) const {
+    unique_ptr<DecodedBlock> block(new DecodedBlock());
+    uint32_t last_index = block_index + 1 < headers.size() ? headers[block_index + 1].record_index :
+                          record_count;
+    const_iterator it(this);
+    it.switch_to_block(block_index);
+    block->same_word = it.same_word;
+    block->keys.reserve(last_index - it.record_index);
+    block->values.reserve(last_index - it.record_index);
+    block->offsets.reserve(last_index - it.record_index);
+    while (true) {
+        block->keys.push_back(pack_key(it.record.key));
+        block->values.push_back(it.record.value);
+        block->offsets.push_back(it.offset);
+        if (it.record_index + 1 == last_index)
+            break;
+        it.read_record();
+    }
+    return block;
+}
+
+// Calls function with the cached block, or decodes the block and puts it to the cache
+// if the cache admits it. Returns false if neither happens.
+template <class Function>
+bool CompressedArray::visit_decoded_block(uint32_t block_index, Function function) const {
+    if (block_cache->visit(block_cache_level, block_index, function)) {
+        NGRAMSTORAGE_COUNT(block_cache_hits, block_cache_level, 1);
+        return true;
+    }
+    NGRAMSTORAGE_COUNT(block_cache_misses, block_cache_level, 1);
+    if (!block_cache->admit(block_cache_level, block_index))
+        return false;
+    unique_ptr<DecodedBlock> block = decode_block(block_index);
+    function(*block);
+    block_cache->put(block_cache_level, block_index, move(block));
+    return true;
+}
+
+void CompressedArray::set_block_cache(shared_ptr<BlockCache> cache, uint32_t level) {
+    block_cache = move(cache);
+    block_cache_level = level;
+}
+
+CompressedArray::MemoryReport CompressedArray::memory_report() const {
+    MemoryReport report;
+    report.records_count = record_count;
+    report.blocks_count = uint32_t(headers.size());
+    report.samples_count = uint32_t(samples.size());
+    report.data_bytes = data.size() * sizeof(uint64_t);
+    report.headers_bytes = headers.size() * sizeof(BlockHeader);
+    report.block_keys_bytes = block_keys.size() * sizeof(uint64_t);
+    report.block_directory_bytes = block_directory.size() * sizeof(uint32_t);
+    report.samples_bytes = samples.size() * sizeof(SkipSample);
+    report.record_blocks_bytes = record_blocks.size() * sizeof(uint32_t);
+    report.ngram_count_values_bytes = ngram_count_values.memory_size();
+    report.continuations_count_values_bytes = continuations_count_values.memory_size();
+    report.unique_continuations_count_values_bytes = unique_continuations_count_values.memory_size();
+
+    report.key_bits = 0;
+    report.value_bits = 0;
+    Key prev_key(0, 0);
+    for (auto it = begin(); it != end(); ++it) {
+        if (it.record_index == headers[it.block_index].record_index)
+            report.key_bits += 1;
+        else
+            report.key_bits += calculate_key_size(it->key, prev_key, it.same_word);
+        report.value_bits += calculate_value_size(it->value);
+        prev_key = it->key;
+    }
+
+    report.word_index_diff_log_radix = word_index_diff_log_radix;
+    report.context_index_diff_log_radix = context_index_diff_log_radix;
+    report.context_index_log_radix = context_index_log_radix;
+    report.ngram_count_index_log_radix = ngram_count_index_log_radix;
+    report.continuations_count_index_log_radix = continuations_count_index_log_radix;
+    report.unique_continuations_count_index_log_radix = unique_continuations_count_index_log_radix;
+    return report;
+}
+
+size_t CompressedArray::MemoryReport::total_bytes() const {
+    return data_bytes + headers_bytes + block_keys_bytes + block_directory_bytes + samples_bytes +
+           record_blocks_bytes + ngram_count_values_bytes + continuations_count_values_bytes +
+           unique_continuations_count_values_bytes;
+}
+
+double CompressedArray::MemoryReport::key_bits_per_record() const {
+    return records_count > 0 ? double(key_bits) / records_count : 0.0;
+}
+
+double CompressedArray::MemoryReport::value_bits_per_record() const {
+    return records_count > 0 ? double(value_bits) / records_count : 0.0;
+}
+
+double CompressedArray::MemoryReport::bits_per_record() const {
+    return records_count > 0 ? 8.0 * double(total_bytes()) / records_count : 0.0;
+}
+
+void CompressedArray::find_batch(const Key* keys, uint32_t count, uint32_t* indices, Value* values) const {
+    uint32_t blocks[batch_group_size];
+    uint32_t blocks_count = uint32_t(headers.size());
+
+    for (uint32_t first = 0; first < count; first += batch_group_size) {
+        uint32_t size = min(batch_group_size, count - first);
+        const Key* group_keys = keys + first;
+
+        // Every stage issues the loads of the whole group before using any of them:
+        // directory buckets, then bucket keys, then headers and block data.
+        for (uint32_t i = 0; i < size; i++)
+            __builtin_prefetch(&block_directory[min(size_t(group_keys[i].word_index >> directory_shift),
+                                                    block_directory.size() - 1)]);
+        for (uint32_t i = 0; i < size; i++) {
+            uint32_t bucket = group_keys[i].word_index >> directory_shift;
+            if (bucket + size_t(1) < block_directory.size())
+                __builtin_prefetch(&block_keys[block_directory[bucket]]);
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            blocks[i] = find_block(group_keys[i]);
+            if (blocks[i] != blocks_count)
+                __builtin_prefetch(&headers[blocks[i]]);
+        }
+
+        // a block spans up to three cache lines, the last block may end earlier
+        for (uint32_t i = 0; i < size; i++) {
+            if (blocks[i] == blocks_count)
+                continue;
+            size_t block_word = headers[blocks[i]].offset / 64;
+            for (size_t word = block_word; word < block_word + 24 && word < data.size(); word += 8)
+                __builtin_prefetch(data.data() + word);
+        }
+
+        for (uint32_t i = 0; i < size; i++) {
+            if (blocks[i] == blocks_count) {
+                NGRAMSTORAGE_COUNT(lookups, block_cache_level, 1);
+                NGRAMSTORAGE_COUNT(misses, block_cache_level, 1);
+                indices[first + i] = not_found;
+                continue;
+            }
+            const_iterator it = find_in_block(blocks[i], group_keys[i]);
+            if (it.record_index == record_count) {
+                indices[first + i] = not_found;
+            } else {
+                indices[first + i] = it.record_index;
+                if (values != nullptr)
+                    values[first + i] = it->value;
+            }
+        }
+    }
+}
+
 void CompressedArray::dump(ostream& out) const {
+    out.write(stream_magic, sizeof(stream_magic));
+    out.write((char*)(&format_version), sizeof(format_version));
+    dump_body(out);
+}
+
+void CompressedArray::load(istream& in) {
+    // Dumps without the magic start with word_index_diff_log_radix, which is at most 32,
+    // so they cannot be mistaken for the magic.
+    char magic[sizeof(stream_magic)];
+    in.read(magic, sizeof(magic));
+    if (memcmp(magic, stream_magic, sizeof(stream_magic)) == 0) {
+        uint32_t version = 0;
+        in.read((char*)(&version), sizeof(version));
+        if (version > format_version)
+            throw std::runtime_error("unsupported compressed array version");
+        load_body(in, version);
+    } else {
+        memcpy(&word_index_diff_log_radix, magic, sizeof(word_index_diff_log_radix));
+        memcpy(&context_index_diff_log_radix, magic + sizeof(word_index_diff_log_radix),
+               sizeof(context_index_diff_log_radix));
+        load_body(in, 1, true);
+    }
+}
+
+void CompressedArray::dump_body(ostream& out) const {
     out.write((char*)(&word_index_diff_log_radix), sizeof(word_index_diff_log_radix));
     out.write((char*)(&context_index_diff_log_radix), sizeof(context_index_diff_log_radix));
     out.write((char*)(&context_index_log_radix), sizeof(context_index_log_radix));
@@ -149,32 +621,40 @@ void CompressedArray::dump(ostream& out) const {
     uint32_t blocks_count = uint32_t(headers.size());
     out.write((char*)(&blocks_count), sizeof(blocks_count));
     for (uint32_t i = 0; i < blocks_count; i++) {
-        out.write((char*)(&headers[i].key.word_index), sizeof(headers[i].key.word_index));
-        out.write((char*)(&headers[i].key.context_index), sizeof(headers[i].key.context_index));
+        Key key = unpack_key(block_keys[i]);
+        out.write((char*)(&key.word_index), sizeof(key.word_index));
+        out.write((char*)(&key.context_index), sizeof(key.context_index));
         out.write((char*)(&headers[i].offset), sizeof(headers[i].offset));
         out.write((char*)(&headers[i].record_index), sizeof(headers[i].record_index));
     }
 
-    uint8_t buffer = 0;
-    uint8_t idx = 0;
-    uint32_t size = uint32_t(data.size());
-    out.write((char*)(&size), sizeof(size));
-    for (uint32_t i = 0; i < data.size(); i++) {
-        buffer |= data[i] << idx;
-        idx++;
-        if (idx == 8) {
-            out.write((char*)(&buffer), sizeof(buffer));
-            idx = 0;
-            buffer = 0;
-        }
-    }
-    if (idx > 0)
+    out.write((char*)(&data_size), sizeof(data_size));
+    uint32_t nbytes = (data_size + 7) / 8;
+    for (uint32_t i = 0; i < nbytes; i++) {
+        uint8_t buffer = uint8_t(data[i / 8] >> (i % 8 * 8));
         out.write((char*)(&buffer), sizeof(buffer));
+    }
+
+    out.write((char*)(&skip_interval), sizeof(skip_interval));
+    uint32_t samples_count = uint32_t(samples.size());
+    out.write((char*)(&samples_count), sizeof(samples_count));
+    for (uint32_t i = 0; i < samples_count; i++) {
+        out.write((char*)(&samples[i].key.word_index), sizeof(samples[i].key.word_index));
+        out.write((char*)(&samples[i].key.context_index), sizeof(samples[i].key.context_index));
+        out.write((char*)(&samples[i].offset), sizeof(samples[i].offset));
+    }
+}
+
+void CompressedArray::load_body(istream &in, uint32_t version) {
+    load_body(in, version, false);
 }
 
-void CompressedArray::load(istream &in) {
-    in.read((char*)(&word_index_diff_log_radix), sizeof(word_index_diff_log_radix));
-    in.read((char*)(&context_index_diff_log_radix), sizeof(context_index_diff_log_radix));
+void CompressedArray::load_body(istream &in, uint32_t version, bool diff_radices_read) {
+    block_cache = nullptr;
+    if (!diff_radices_read) {
+        in.read((char*)(&word_index_diff_log_radix), sizeof(word_index_diff_log_radix));
+        in.read((char*)(&context_index_diff_log_radix), sizeof(context_index_diff_log_radix));
+    }
     in.read((char*)(&context_index_log_radix), sizeof(context_index_log_radix));
     in.read((char*)(&ngram_count_index_log_radix), sizeof(ngram_count_index_log_radix));
     in.read((char*)(&continuations_count_index_log_radix),
@@ -191,26 +671,108 @@ void CompressedArray::load(istream &in) {
     uint32_t nblocks;
     in.read((char*)(&nblocks), sizeof(nblocks));
     headers.resize(nblocks);
+    block_keys.resize(nblocks);
     for (uint32_t i = 0; i < nblocks; i++) {
-        in.read((char*)(&headers[i].key.word_index), sizeof(headers[i].key.word_index));
-        in.read((char*)(&headers[i].key.context_index), sizeof(headers[i].key.context_index));
+        Key key;
+        in.read((char*)(&key.word_index), sizeof(key.word_index));
+        in.read((char*)(&key.context_index), sizeof(key.context_index));
         in.read((char*)(&headers[i].offset), sizeof(headers[i].offset));
         in.read((char*)(&headers[i].record_index), sizeof(headers[i].record_index));
+        block_keys[i] = pack_key(key);
+    }
+    build_directory();
+    build_record_blocks();
+
+    in.read((char*)(&data_size), sizeof(data_size));
+    data.assign((data_size + 63) / 64 + 1, 0);
+    uint32_t nbytes = (data_size + 7) / 8;
+    for (uint32_t i = 0; i < nbytes; i++) {
+        uint8_t buffer;
+        in.read((char*)(&buffer), sizeof(buffer));
+        data[i / 8] |= uint64_t(buffer) << (i % 8 * 8);
     }
 
-    uint32_t size;
-    in.read((char*)(&size), sizeof(size));
-    data.resize(size);
-    uint8_t buffer = 0;
-    uint8_t idx = 8;
-    for (uint32_t i = 0; i < size; i++) {
-        if (idx == 8) {
-            in.read((char*)(&buffer), sizeof(buffer));
-            idx = 0;
+    skip_interval = 0;
+    samples = MappedArray<SkipSample>();
+    if (version >= 2) {
+        in.read((char*)(&skip_interval), sizeof(skip_interval));
+        uint32_t samples_count;
+        in.read((char*)(&samples_count), sizeof(samples_count));
+        samples.resize(samples_count);
+        for (uint32_t i = 0; i < samples_count; i++) {
+            in.read((char*)(&samples[i].key.word_index), sizeof(samples[i].key.word_index));
+            in.read((char*)(&samples[i].key.context_index), sizeof(samples[i].key.context_index));
+            in.read((char*)(&samples[i].offset), sizeof(samples[i].offset));
         }
-        data[i] = bool(buffer & (1 << idx));
-        idx++;
     }
+    build_sample_indices();
+}
+
+void CompressedArray::build_sample_indices() {
+    uint32_t sample_index = 0;
+    for (uint32_t i = 0; i < headers.size(); i++) {
+        headers[i].sample_index = sample_index;
+        if (skip_interval > 0) {
+            uint32_t last_index = i + 1 < headers.size() ? headers[i + 1].record_index : record_count;
+            sample_index += (last_index - headers[i].record_index - 1) / skip_interval;
+        }
+    }
+    assert(sample_index == samples.size());
+}
+
+void CompressedArray::dump_mapped(ostream& out) const {
+    write_mapped_value(out, word_index_diff_log_radix);
+    write_mapped_value(out, context_index_diff_log_radix);
+    write_mapped_value(out, context_index_log_radix);
+    write_mapped_value(out, ngram_count_index_log_radix);
+    write_mapped_value(out, continuations_count_index_log_radix);
+    write_mapped_value(out, unique_continuations_count_index_log_radix);
+
+    write_mapped_value(out, record_count);
+    write_mapped_value(out, data_size);
+
+    ngram_count_values.dump_mapped(out);
+    continuations_count_values.dump_mapped(out);
+    unique_continuations_count_values.dump_mapped(out);
+
+    write_mapped_array(out, headers.data(), headers.size());
+    write_mapped_array(out, block_keys.data(), block_keys.size());
+    write_mapped_value(out, directory_shift);
+    write_mapped_array(out, block_directory.data(), block_directory.size());
+    write_mapped_value(out, skip_interval);
+    write_mapped_array(out, samples.data(), samples.size());
+    write_mapped_array(out, record_blocks.data(), record_blocks.size());
+    write_mapped_array(out, data.data(), data.size());
+}
+
+void CompressedArray::load_mapped(MappedReader& in) {
+    block_cache = nullptr;
+    word_index_diff_log_radix = in.read_value<uint32_t>();
+    context_index_diff_log_radix = in.read_value<uint32_t>();
+    context_index_log_radix = in.read_value<uint32_t>();
+    ngram_count_index_log_radix = in.read_value<uint32_t>();
+    continuations_count_index_log_radix = in.read_value<uint32_t>();
+    unique_continuations_count_index_log_radix = in.read_value<uint32_t>();
+
+    record_count = in.read_value<uint32_t>();
+    data_size = in.read_value<uint32_t>();
+
+    ngram_count_values.load_mapped(in);
+    continuations_count_values.load_mapped(in);
+    unique_continuations_count_values.load_mapped(in);
+
+    headers = in.read_array<BlockHeader>();
+    block_keys = in.read_array<uint64_t>();
+    directory_shift = in.read_value<uint32_t>();
+    block_directory = in.read_array<uint32_t>();
+    skip_interval = in.read_value<uint32_t>();
+    samples = in.read_array<SkipSample>();
+    record_blocks = in.read_array<uint32_t>();
+    data = in.read_array<uint64_t>();
+    if (data.size() < (data_size + 63) / 64 + 1 || block_keys.size() != headers.size() ||
+        block_directory.size() == 0 ||
+        record_blocks.size() != (record_count + record_sampling_rate - 1) / record_sampling_rate)
+        throw std::runtime_error("mapped file is corrupted");
 }
 
 uint32_t CompressedArray::calculate_number_size(uint32_t number, uint32_t log_radix) const {
@@ -249,75 +811,107 @@ uint32_t CompressedArray::calculate_record_size(Record record, Record prev_recor
             calculate_value_size(record.value));
 }
 
-void CompressedArray::add_bit(bool bit) {
-    data.push_back(bit);
+void CompressedArray::BitWriter::add_bits(uint64_t bits, uint32_t count) {
+    assert(count <= 64 && (count == 64 || (bits >> count) == 0));
+    uint32_t word = size / 64 - first_word;
+    uint32_t shift = size % 64;
+    if (words.size() < word + 2)
+        words.resize(word + 2, 0);
+    words[word] |= bits << shift;
+    if (shift > 0)
+        words[word + 1] |= bits >> (64 - shift);
+    size += count;
 }
 
-void CompressedArray::add_number(uint32_t number, uint32_t log_radix) {
+void CompressedArray::add_bit(BitWriter& writer, bool bit) const {
+    writer.add_bits(uint64_t(bit), 1);
+}
+
+void CompressedArray::add_number(BitWriter& writer, uint32_t number, uint32_t log_radix) const {
     uint32_t len = 0;
     while (number >= (uint64_t(1) << len * log_radix))
         len++;
 
-    for (uint32_t i = 0; i < len;  i++)
-        data.push_back(1);
-    data.push_back(0);
-
-    for (uint32_t i = 0; i < len * log_radix; i++) {
-        data.push_back(bool(number & 1));
-        number >>= 1;
-    }
+    writer.add_bits((uint64_t(1) << len) - 1, len + 1);
+    writer.add_bits(number, len * log_radix);
 }
 
-void CompressedArray::add_key(Key key, Key prev_key, bool same_word) {
+void CompressedArray::add_key(BitWriter& writer, Key key, Key prev_key, bool same_word) const {
     if (!same_word)
-        add_number(key.word_index - prev_key.word_index, word_index_diff_log_radix);
+        add_number(writer, key.word_index - prev_key.word_index, word_index_diff_log_radix);
     if (key.word_index != prev_key.word_index)
-        add_number(key.context_index, context_index_log_radix);
+        add_number(writer, key.context_index, context_index_log_radix);
     else
-        add_number(key.context_index - prev_key.context_index, context_index_diff_log_radix);
+        add_number(writer, key.context_index - prev_key.context_index, context_index_diff_log_radix);
 }
 
-void CompressedArray::add_value(Value value) {
+void CompressedArray::add_value(BitWriter& writer, Value value) const {
     uint32_t index = ngram_count_values.get_index(value.ngram_count);
-    add_number(index, ngram_count_index_log_radix);
+    add_number(writer, index, ngram_count_index_log_radix);
     index = continuations_count_values.get_index(value.continuations_count);
-    add_number(index, continuations_count_index_log_radix);
+    add_number(writer, index, continuations_count_index_log_radix);
     index = unique_continuations_count_values.get_index(value.unique_continuations_count);
-    add_number(index, unique_continuations_count_index_log_radix);
+    add_number(writer, index, unique_continuations_count_index_log_radix);
 }
 
-void CompressedArray::add_record(Record record, Record prev_record, bool same_word) {
-    add_key(record.key, prev_record.key, same_word);
-    add_value(record.value);
+void CompressedArray::add_record(BitWriter& writer, Record record, Record prev_record, bool same_word) const {
+    add_key(writer, record.key, prev_record.key, same_word);
+    add_value(writer, record.value);
 }
 
-void CompressedArray::find_best_radix_parameters(const vector<Record>& records) {
-    vector<uint64_t> context_index_diff_size(8, 0);
-    vector<uint64_t> context_index_size(8, 0);
-    vector<uint64_t> ngram_count_index_size(8, 0);
-    vector<uint64_t> continuations_count_index_size(8, 0);
-    vector<uint64_t> unique_continuations_count_index_size(8, 0);
-
-    for (size_t i = 1; i < records.size(); i++) {
-        const Record& record = records[i];
-        const Record& prev_record = records[i - 1];
+void CompressedArray::find_best_radix_parameters(const vector<Record>& records, uint32_t threads_count) {
+    // every thread sums sizes over its part of the records
+    vector<vector<vector<uint64_t>>> sizes(threads_count, vector<vector<uint64_t>>(5, vector<uint64_t>(8, 0)));
+    parallel_for(threads_count, records.size(), [&] (size_t begin, size_t end, uint32_t t) {
+        for (size_t i = max<size_t>(begin, 1); i < end; i++)
+            add_radix_statistics(records[i], records[i - 1], sizes[t]);
+    });
+    for (uint32_t t = 1; t < sizes.size(); t++)
+        for (uint32_t k = 0; k < 5; k++)
+            for (uint32_t j = 0; j < 8; j++)
+                sizes[0][k][j] += sizes[t][k][j];
+    choose_radix_parameters(sizes[0]);
+}
 
-        for (uint32_t j = 0; j < 8; j++) {
-            if (prev_record.key.word_index == record.key.word_index) {
-                uint32_t diff = record.key.context_index - prev_record.key.context_index;
-                context_index_diff_size[j] += calculate_number_size(diff, j + 1);
-            } else {
-                context_index_size[j] += calculate_number_size(record.key.context_index, j + 1);
-            }
+void CompressedArray::find_best_radix_parameters(TempFile<Record>& records) {
+    vector<vector<uint64_t>> sizes(5, vector<uint64_t>(8, 0));
+    records.rewind();
+    Record prev_record, record;
+    if (records.next(prev_record))
+        while (records.next(record)) {
+            add_radix_statistics(record, prev_record, sizes);
+            prev_record = record;
+        }
+    choose_radix_parameters(sizes);
+}
 
-            uint32_t index = ngram_count_values.get_index(record.value.ngram_count);
-            ngram_count_index_size[j] += calculate_number_size(index, j + 1);
-            index = continuations_count_values.get_index(record.value.continuations_count);
-            continuations_count_index_size[j] += calculate_number_size(index, j + 1);
-            index = unique_continuations_count_values.get_index(record.value.unique_continuations_count);
-            unique_continuations_count_index_size[j] += calculate_number_size(index, j + 1);
+// sizes[k][j] is the total size of the k-th number of the records for radix 2^(j + 1),
+// numbers are the context index diff, the context index and the three value indices
+void CompressedArray::add_radix_statistics(const Record& record, const Record& prev_record,
+                                           vector<vector<uint64_t>>& sizes) const {
+    for (uint32_t j = 0; j < 8; j++) {
+        if (prev_record.key.word_index == record.key.word_index) {
+            uint32_t diff = record.key.context_index - prev_record.key.context_index;
+            sizes[0][j] += calculate_number_size(diff, j + 1);
+        } else {
+            sizes[1][j] += calculate_number_size(record.key.context_index, j + 1);
         }
+
+        uint32_t index = ngram_count_values.get_index(record.value.ngram_count);
+        sizes[2][j] += calculate_number_size(index, j + 1);
+        index = continuations_count_values.get_index(record.value.continuations_count);
+        sizes[3][j] += calculate_number_size(index, j + 1);
+        index = unique_continuations_count_values.get_index(record.value.unique_continuations_count);
+        sizes[4][j] += calculate_number_size(index, j + 1);
     }
+}
+
+void CompressedArray::choose_radix_parameters(const vector<vector<uint64_t>>& sizes) {
+    const vector<uint64_t>& context_index_diff_size = sizes[0];
+    const vector<uint64_t>& context_index_size = sizes[1];
+    const vector<uint64_t>& ngram_count_index_size = sizes[2];
+    const vector<uint64_t>& continuations_count_index_size = sizes[3];
+    const vector<uint64_t>& unique_continuations_count_index_size = sizes[4];
 
     word_index_diff_log_radix = 2;
     context_index_diff_log_radix = 1;
@@ -344,10 +938,6 @@ void CompressedArray::find_best_radix_parameters(const vector<Record>& records)
     }
 }
 
-bool CompressedArray::BlockHeader::operator<(const CompressedArray::BlockHeader &other) const {
-    return key < other.key;
-}
-
 CompressedArray::const_iterator::const_iterator(const CompressedArray* array): array(array) {}
 
 CompressedArray::const_iterator CompressedArray::const_iterator::operator++(int) {
@@ -431,25 +1021,42 @@ bool CompressedArray::const_iterator::operator<=(const const_iterator& other) co
     return record_index <= other.record_index;
 }
 
+uint64_t CompressedArray::const_iterator::peek_bits(uint32_t offset) const {
+    const uint64_t* word = array->data.data() + offset / 64;
+    uint32_t shift = offset % 64;
+    // (x << 1) << (63 - shift) is zero for shift == 0, unlike x << 64
+    return (word[0] >> shift) | ((word[1] << 1) << (63 - shift));
+}
+
+uint32_t CompressedArray::const_iterator::index() const {
+    return record_index;
+}
+
 bool CompressedArray::const_iterator::read_bit() {
-    return array->data[offset++];
+    bool bit = bool((array->data[offset / 64] >> (offset % 64)) & 1);
+    offset++;
+    return bit;
 }
 
 uint32_t CompressedArray::const_iterator::read_number(uint32_t log_radix) {
-    uint32_t len = 0;
-    while (array->data[offset]) {
-        len++;
-        offset++;
-    }
-    offset++;
+    uint64_t bits = peek_bits(offset);
+    uint32_t len = uint32_t(__builtin_ctzll(~bits));
+    uint32_t number_size = len * log_radix;
+    uint64_t mask = (uint64_t(1) << number_size) - 1;
+
+    uint64_t number;
+    if (len + 1 + number_size <= 64)
+        number = (bits >> (len + 1)) & mask;
+    else
+        number = peek_bits(offset + len + 1) & mask;
+    offset += len + 1 + number_size;
 
-    uint32_t number = 0;
-    for (uint32_t i = 0; i < len * log_radix; i++) {
-        number |= (array->data[offset] << i);
-        offset++;
-    }
+    return uint32_t(number);
+}
 
-    return number;
+void CompressedArray::const_iterator::skip_number(uint32_t log_radix) {
+    uint32_t len = uint32_t(__builtin_ctzll(~peek_bits(offset)));
+    offset += len + 1 + len * log_radix;
 }
 
 void CompressedArray::const_iterator::read_key() {
@@ -475,6 +1082,12 @@ void CompressedArray::const_iterator::read_value() {
     record.value.unique_continuations_count = array->unique_continuations_count_values[index];
 }
 
+void CompressedArray::const_iterator::skip_value() {
+    skip_number(array->ngram_count_index_log_radix);
+    skip_number(array->continuations_count_index_log_radix);
+    skip_number(array->unique_continuations_count_index_log_radix);
+}
+
 void CompressedArray::const_iterator::read_record() {
     read_key();
     read_value();
@@ -485,13 +1098,14 @@ void CompressedArray::const_iterator::switch_to_block(uint32_t block_index) {
     if (block_index >= array->headers.size()) {
         this->block_index = uint32_t(array->headers.size());
         record_index = array->record_count;
-        offset = uint32_t(array->data.size());
+        offset = array->data_size;
     } else {
+        NGRAMSTORAGE_COUNT(blocks_switched, array->block_cache_level, 1);
         this->block_index = block_index;
         record_index = array->headers[block_index].record_index;
         offset = array->headers[block_index].offset;
 
-        record.key = array->headers[block_index].key;
+        record.key = unpack_key(array->block_keys[block_index]);
         read_value();
 
         same_word = read_bit();
@@ -499,19 +1113,60 @@ void CompressedArray::const_iterator::switch_to_block(uint32_t block_index) {
 }
 
 void CompressedArray::const_iterator::switch_to_record(uint32_t record_index) {
-    if (record_index > array->record_count)
-        record_index = array->record_count;
+    if (record_index >= array->record_count) {
+        switch_to_block(uint32_t(array->headers.size()));
+        return;
+    }
 
-    BlockHeader header;
-    header.record_index = record_index;
-    auto it = upper_bound(array->headers.begin(), array->headers.end(), header,
-                          [](const BlockHeader& first, const BlockHeader& second) {
-                              return first.record_index < second.record_index;
-                          });
-    --it;
+    uint32_t block_index = array->find_record_block(record_index);
+    if (array->block_cache != nullptr && array->visit_decoded_block(block_index, [&] (const DecodedBlock& block) {
+            switch_to_decoded_record(block_index, block, record_index - array->headers[block_index].record_index);
+        }))
+        return;
 
-    uint32_t block_index = uint32_t(it - array->headers.begin());
     switch_to_block(block_index);
-    while (this->block_index == block_index && this->record_index < record_index)
-        (*this)++;
-}
\ No newline at end of file
+    if (this->record_index == record_index)
+        return;
+
+    uint32_t skip_interval = array->skip_interval;
+    uint32_t first_index = this->record_index;
+    if (skip_interval > 0 && record_index - first_index >= skip_interval) {
+        const SkipSample& sample = array->samples[array->headers[block_index].sample_index +
+                                                  (record_index - first_index) / skip_interval - 1];
+        this->record_index = first_index + (record_index - first_index) / skip_interval * skip_interval;
+        record.key = sample.key;
+        offset = sample.offset;
+        if (this->record_index == record_index) {
+            read_value();
+            return;
+        }
+        skip_value();
+    }
+
+    while (this->record_index + 1 < record_index) {
+        read_key();
+        skip_value();
+        this->record_index++;
+    }
+    read_record();
+}
+
+// The state after decoding the record at position in the block.
+void CompressedArray::const_iterator::switch_to_decoded_record(uint32_t block_index, const DecodedBlock& block,
+                                                               uint32_t position) {
+    this->block_index = block_index;
+    record_index = array->headers[block_index].record_index + position;
+    offset = block.offsets[position];
+    same_word = block.same_word;
+    record = Record(unpack_key(block.keys[position]), block.values[position]);
+}
+
+bool CompressedArray::const_iterator::find_in_decoded_block(uint32_t block_index, const DecodedBlock& block,
+                                                            Key key) {
+    uint64_t packed_key = pack_key(key);
+    auto it = std::lower_bound(block.keys.begin(), block.keys.end(), packed_key);
+    if (it == block.keys.end() || *it != packed_key)
+        return false;
+    switch_to_decoded_record(block_index, block, uint32_t(it - block.keys.begin()));
+    return true;
+}
@@ -8,6 +8,10 @@
 #include "Record.h"
 #include "Vocabulary.h"
 #include "Serializable.h"
+#include "Parallel.h"
+#include "ExternalSort.h"
+#include "BlockCache.h"
+#include "LookupStatistics.h"
 
 #include <vector>
 #include <string>
@@ -16,6 +20,7 @@
 
 using std::vector;
 using std::unique;
+using std::upper_bound;
 using std::max;
 using std::min;
 using std::cout;
@@ -26,12 +31,27 @@ using std::move;
 class CompressedArray: public Serializable {
 public:
     CompressedArray();
-    CompressedArray(vector<Record> sorted_records);
+    // Every skip_interval-th record of a block is sampled (key and bit offset),
+    // so find() can start decoding close to the key. 0 disables sampling.
+    // The array is built by threads_count threads, the result does not depend on it.
+    CompressedArray(vector<Record> sorted_records, uint32_t skip_interval = 0,
+                    uint32_t threads_count = 1);
+    // Same array built from records in a file without loading all of them.
+    CompressedArray(TempFile<Record>& sorted_records, uint32_t skip_interval = 0);
 
     uint32_t size() const;
 
+    static const uint32_t format_version;
+
+    // magic, format_version and the body. Arrays dumped without them are read as version 1
     void dump(ostream& out) const override;
     void load(istream& in) override;
+    // without the magic and the version, for containers that write their own
+    void dump_body(ostream& out) const;
+    void load_body(istream& in, uint32_t version);
+
+    void dump_mapped(ostream& out) const;
+    void load_mapped(MappedReader& in);
 
     class const_iterator;
 
@@ -40,6 +60,59 @@ public:
 
     const_iterator find(Key key) const;
 
+    static const uint32_t not_found;
+
+    // Looks up many keys at once, interleaving their searches so that memory
+    // accesses of different keys overlap. indices[i] is the record index of
+    // keys[i] or not_found, values may be nullptr.
+    void find_batch(const Key* keys, uint32_t count, uint32_t* indices, Value* values) const;
+
+    // Lookups and jumps to a record take decoded blocks from cache, where they are
+    // keyed by level, and put the missing ones there. nullptr decodes every time.
+    // The array shares the ownership of the cache, copies of the array share the cache too.
+    // Loading the array resets it to nullptr. The level also labels the lookup statistics.
+    void set_block_cache(shared_ptr<BlockCache> cache, uint32_t level);
+
+    // Where the bytes of the array go. Bytes are those of the arrays, either owned or mapped.
+    struct MemoryReport {
+        uint32_t records_count;
+        uint32_t blocks_count;
+        uint32_t samples_count;
+
+        // encoded records
+        size_t data_bytes;
+        size_t headers_bytes;
+        size_t block_keys_bytes;
+        size_t block_directory_bytes;
+        size_t samples_bytes;
+        size_t record_blocks_bytes;
+        // distinct values of the counts, records keep their indices
+        size_t ngram_count_values_bytes;
+        size_t continuations_count_values_bytes;
+        size_t unique_continuations_count_values_bytes;
+
+        // Bits of the encoded keys, including the same word bit of every block,
+        // and of the encoded values. The first key of a block is in block_keys.
+        uint64_t key_bits;
+        uint64_t value_bits;
+
+        uint32_t word_index_diff_log_radix;
+        uint32_t context_index_diff_log_radix;
+        uint32_t context_index_log_radix;
+        uint32_t ngram_count_index_log_radix;
+        uint32_t continuations_count_index_log_radix;
+        uint32_t unique_continuations_count_index_log_radix;
+
+        size_t total_bytes() const;
+        double key_bits_per_record() const;
+        double value_bits_per_record() const;
+        // all bytes per record
+        double bits_per_record() const;
+    };
+
+    // Decodes all records to split their bits into keys and values.
+    MemoryReport memory_report() const;
+
     class const_iterator {
     public:
         const_iterator(const CompressedArray* array);
@@ -59,6 +132,7 @@ public:
         bool operator>=(const const_iterator& other) const;
         bool operator<(const const_iterator& other) const;
         bool operator<=(const const_iterator& other) const;
+        uint32_t index() const;
 
         friend class CompressedArray;
 
@@ -70,26 +144,54 @@ public:
         bool same_word;
         Record record;
 
+        uint64_t peek_bits(uint32_t offset) const;
         bool read_bit();
         uint32_t read_number(uint32_t log_radix);
+        void skip_number(uint32_t log_radix);
         void read_key();
         void read_value();
+        void skip_value();
         void read_record();
 
         void switch_to_block(uint32_t block_index);
         void switch_to_record(uint32_t record_index);
+        void switch_to_decoded_record(uint32_t block_index, const DecodedBlock& block, uint32_t position);
+        bool find_in_decoded_block(uint32_t block_index, const DecodedBlock& block, Key key);
     };
 
 private:
     struct BlockHeader {
-        Key key;
         uint32_t record_index;
         uint32_t offset;
+        uint32_t sample_index;
+    };
 
-        bool operator < (const BlockHeader& other) const;
+    struct SkipSample {
+        Key key;
+        uint32_t offset;
+    };
+
+    // Sizes in bits of the parts of every record, see layout_block
+    struct RecordSizes {
+        vector<uint32_t> value_sizes;
+        vector<uint32_t> key_sizes;
+        vector<uint32_t> same_word_key_sizes;
+    };
+
+    // Encodes a range of blocks. Bit positions are counted from the beginning
+    // of data, words[0] corresponds to data[first_word].
+    struct BitWriter {
+        uint32_t first_word;
+        uint32_t size;
+        vector<uint64_t> words;
+
+        void add_bits(uint64_t bits, uint32_t count);
     };
 
     static const uint32_t max_block_size;
+    static const uint32_t batch_group_size;
+    static const uint32_t record_sampling_rate;
+    static const uint32_t streaming_window_size;
 
     uint32_t word_index_diff_log_radix;
     uint32_t context_index_diff_log_radix;
@@ -98,27 +200,68 @@ private:
     uint32_t continuations_count_index_log_radix;
     uint32_t unique_continuations_count_index_log_radix;
 
-    vector<bool> data;
-    vector<BlockHeader> headers;
+    MappedArray<uint64_t> data;
+    uint32_t data_size;
+    MappedArray<BlockHeader> headers;
+    // First keys of the blocks packed by pack_key, so they compare as integers.
+    MappedArray<uint64_t> block_keys;
+    // Blocks whose first word_index >> directory_shift equals b are
+    // block_directory[b]..block_directory[b + 1] - 1.
+    MappedArray<uint32_t> block_directory;
+    uint32_t directory_shift;
+    uint32_t skip_interval;
+    MappedArray<SkipSample> samples;
+    // record_blocks[i] is the block containing record i * record_sampling_rate
+    MappedArray<uint32_t> record_blocks;
     Vocabulary<uint32_t> ngram_count_values;
     Vocabulary<uint32_t> continuations_count_values;
     Vocabulary<uint32_t> unique_continuations_count_values;
     uint32_t record_count;
+    shared_ptr<BlockCache> block_cache;
+    uint32_t block_cache_level;
+
+    static const char stream_magic[8];
+
+    // an untagged dump starts with the diff radices, load reads them while it looks for the magic
+    void load_body(istream& in, uint32_t version, bool diff_radices_read);
+
+    static uint64_t pack_key(Key key);
+    static Key unpack_key(uint64_t key);
+
+    void build_directory();
+    uint32_t find_block(Key key) const;
+
+    void build_record_blocks();
+    uint32_t find_record_block(uint32_t record_index) const;
+    const_iterator find_in_block(uint32_t block_index, Key key) const;
+    unique_ptr<DecodedBlock> decode_block(uint32_t block_index) const;
+    template <class Function>
+    bool visit_decoded_block(uint32_t block_index, Function function) const;
 
-    uint32_t fill_block(const vector<Record>& sorted_records, uint32_t record_index);
-    void find_best_radix_parameters(const vector<Record>& records);
-    void store_values(vector<Record> records);
+    RecordSizes calculate_record_sizes(const vector<Record>& sorted_records, uint32_t threads_count) const;
+    uint32_t layout_block(const vector<Record>& sorted_records, const RecordSizes& sizes,
+                          uint32_t record_index, bool& same_word, uint32_t& block_size) const;
+    void fill_block(BitWriter& writer, const vector<Record>& sorted_records, uint32_t first_index,
+                    uint32_t last_index, bool same_word, uint32_t sample_index);
+    void find_best_radix_parameters(const vector<Record>& records, uint32_t threads_count);
+    void find_best_radix_parameters(TempFile<Record>& records);
+    void add_radix_statistics(const Record& record, const Record& prev_record,
+                              vector<vector<uint64_t>>& sizes) const;
+    void choose_radix_parameters(const vector<vector<uint64_t>>& sizes);
+    void store_values(const vector<Record>& records, uint32_t threads_count);
+    void store_values(TempFile<Record>& records);
 
     uint32_t calculate_number_size(uint32_t number, uint32_t log_radix) const;
     uint32_t calculate_key_size(Key key, Key prev_key, bool same_word) const;
     uint32_t calculate_value_size(Value value) const;
     uint32_t calculate_record_size(Record record, Record prev_record, bool same_word) const;
 
-    void add_bit(bool bit);
-    void add_number(uint32_t number, uint32_t log_radix);
-    void add_key(Key key, Key prev_key, bool same_word);
-    void add_value(Value value);
-    void add_record(Record record, Record prev_record, bool same_word);
+    void add_bit(BitWriter& writer, bool bit) const;
+    void add_number(BitWriter& writer, uint32_t number, uint32_t log_radix) const;
+    void add_key(BitWriter& writer, Key key, Key prev_key, bool same_word) const;
+    void add_value(BitWriter& writer, Value value) const;
+    void add_record(BitWriter& writer, Record record, Record prev_record, bool same_word) const;
+    void build_sample_indices();
 };
 
 
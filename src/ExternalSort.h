@@ -0,0 +1,205 @@
+#ifndef NGRAMSTORAGE_EXTERNALSORT_H
+#define NGRAMSTORAGE_EXTERNALSORT_H
+
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+using std::vector;
+using std::string;
+using std::unique_ptr;
+
+
+inline string temp_filename(const string& directory) {
+    static std::atomic<uint64_t> counter(0);
+    return (directory + "/ngram_storage." + std::to_string(getpid()) + "." +
+            std::to_string(counter++) + ".tmp");
+}
+
+
+// Sequence of trivially copyable values in a temporary file. Values are
+// appended with push_back, then read any number of times with rewind and next.
+// The file is removed together with the object.
+template <class T>
+class TempFile {
+public:
+    TempFile(const string& directory, size_t buffer_size):
+            filename(temp_filename(directory)), position(0), length(0), count(0), writing(true) {
+        file = fopen(filename.c_str(), "w+b");
+        if (file == nullptr)
+            throw std::runtime_error("cannot create " + filename);
+        set_buffer_size(buffer_size);
+    }
+
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+
+    ~TempFile() {
+        fclose(file);
+        remove(filename.c_str());
+    }
+
+    void push_back(const T& value) {
+        buffer[position++] = value;
+        count++;
+        if (position == buffer.size())
+            flush();
+    }
+
+    // Finishes writing on the first call, moves to the first value.
+    void rewind() {
+        if (writing) {
+            flush();
+            writing = false;
+        }
+        fseek(file, 0, SEEK_SET);
+        position = 0;
+        length = 0;
+    }
+
+    bool next(T& value) {
+        if (position == length) {
+            length = fread(buffer.data(), sizeof(T), buffer.size(), file);
+            position = 0;
+            if (length == 0)
+                return false;
+        }
+        value = buffer[position++];
+        return true;
+    }
+
+    // Not in the middle of reading.
+    void set_buffer_size(size_t buffer_size) {
+        if (writing && position > 0)
+            flush();
+        vector<T>(std::max<size_t>(buffer_size / sizeof(T), 1)).swap(buffer);
+        position = 0;
+        length = 0;
+    }
+
+    uint64_t size() const {
+        return count;
+    }
+
+private:
+    string filename;
+    FILE* file;
+    vector<T> buffer;
+    size_t position;
+    size_t length;
+    uint64_t count;
+    bool writing;
+
+    void flush() {
+        if (fwrite(buffer.data(), sizeof(T), position, file) != position)
+            throw std::runtime_error("cannot write " + filename);
+        position = 0;
+    }
+};
+
+
+// Sorts trivially copyable values keeping at most about memory_budget bytes
+// of them in memory. Sorted runs of that size are written to temporary files
+// in directory and merged while the values are read back.
+template <class T, class Compare>
+class ExternalSorter {
+public:
+    ExternalSorter(const string& directory, size_t memory_budget, Compare compare = Compare()):
+            directory(directory), memory_budget(memory_budget), compare(compare), position(0) {
+        chunk_size = std::max<size_t>(memory_budget / sizeof(T), 1);
+        chunk.reserve(chunk_size);
+    }
+
+    void push_back(const T& value) {
+        chunk.push_back(value);
+        if (chunk.size() >= chunk_size)
+            write_run();
+    }
+
+    // Finishes writing, next then returns the values in sorted order.
+    void sort() {
+        if (runs.empty()) {
+            std::sort(chunk.begin(), chunk.end(), compare);
+            position = 0;
+            return;
+        }
+        if (!chunk.empty())
+            write_run();
+        vector<T>().swap(chunk);
+
+        heads.resize(runs.size());
+        heap.clear();
+        size_t buffer_size = std::max<size_t>(memory_budget / runs.size(), 4096);
+        for (uint32_t i = 0; i < runs.size(); i++) {
+            runs[i]->set_buffer_size(buffer_size);
+            runs[i]->rewind();
+            if (runs[i]->next(heads[i]))
+                push_head(i);
+        }
+    }
+
+    bool next(T& value) {
+        if (runs.empty()) {
+            if (position == chunk.size())
+                return false;
+            value = chunk[position++];
+            return true;
+        }
+        if (heap.empty())
+            return false;
+
+        std::pop_heap(heap.begin(), heap.end(), HeadComparator(this));
+        uint32_t run = heap.back();
+        heap.pop_back();
+        value = heads[run];
+        if (runs[run]->next(heads[run]))
+            push_head(run);
+        return true;
+    }
+
+private:
+    class HeadComparator {
+    public:
+        HeadComparator(const ExternalSorter* sorter): sorter(sorter) {}
+
+        bool operator()(uint32_t run1, uint32_t run2) const {
+            return sorter->compare(sorter->heads[run2], sorter->heads[run1]);
+        }
+
+    private:
+        const ExternalSorter* sorter;
+    };
+
+    string directory;
+    size_t memory_budget;
+    Compare compare;
+    size_t chunk_size;
+    vector<T> chunk;
+    size_t position;
+    vector<unique_ptr<TempFile<T>>> runs;
+    vector<T> heads;
+    vector<uint32_t> heap;
+
+    void write_run() {
+        std::sort(chunk.begin(), chunk.end(), compare);
+        runs.emplace_back(new TempFile<T>(directory, 1 << 16));
+        for (const T& value : chunk)
+            runs.back()->push_back(value);
+        chunk.clear();
+    }
+
+    void push_head(uint32_t run) {
+        heap.push_back(run);
+        std::push_heap(heap.begin(), heap.end(), HeadComparator(this));
+    }
+};
+
+
+#endif //NGRAMSTORAGE_EXTERNALSORT_H
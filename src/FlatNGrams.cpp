@@ -0,0 +1,149 @@
+#include "FlatNGrams.h"
+#include "Parallel.h"
+
+#include <assert.h>
+
+FlatNGrams::FlatNGrams(const vector<pair<vector<uint32_t>, uint32_t>>& ngrams) {
+    for (const auto& ngram : ngrams)
+        add(ngram.first.data(), uint32_t(ngram.first.size()), ngram.second);
+}
+
+void FlatNGrams::add(const uint32_t* ngram, uint32_t ngram_size, uint32_t count) {
+    assert(ngram_size > 0);
+    resize_tables(ngram_size);
+    word_tables[ngram_size - 1].insert(word_tables[ngram_size - 1].end(), ngram, ngram + ngram_size);
+    count_tables[ngram_size - 1].push_back(count);
+}
+
+uint32_t FlatNGrams::max_ngram_size() const {
+    uint32_t max_ngram_size = uint32_t(count_tables.size());
+    while (max_ngram_size > 0 && count_tables[max_ngram_size - 1].empty())
+        max_ngram_size--;
+    return max_ngram_size;
+}
+
+size_t FlatNGrams::size() const {
+    size_t size = 0;
+    for (const vector<uint32_t>& counts : count_tables)
+        size += counts.size();
+    return size;
+}
+
+size_t FlatNGrams::size(uint32_t ngram_size) const {
+    return ngram_size <= count_tables.size() ? count_tables[ngram_size - 1].size() : 0;
+}
+
+vector<uint32_t>& FlatNGrams::words(uint32_t ngram_size) {
+    resize_tables(ngram_size);
+    return word_tables[ngram_size - 1];
+}
+
+const vector<uint32_t>& FlatNGrams::words(uint32_t ngram_size) const {
+    return word_tables[ngram_size - 1];
+}
+
+vector<uint32_t>& FlatNGrams::counts(uint32_t ngram_size) {
+    resize_tables(ngram_size);
+    return count_tables[ngram_size - 1];
+}
+
+const vector<uint32_t>& FlatNGrams::counts(uint32_t ngram_size) const {
+    return count_tables[ngram_size - 1];
+}
+
+void FlatNGrams::resize_tables(uint32_t max_ngram_size) {
+    if (word_tables.size() < max_ngram_size) {
+        word_tables.resize(max_ngram_size);
+        count_tables.resize(max_ngram_size);
+    }
+}
+
+void FlatNGrams::sort(uint32_t threads_count) {
+    parallel_for(threads_count, count_tables.size(), [this] (size_t begin, size_t end, uint32_t) {
+        for (size_t i = begin; i < end; i++)
+            sort_table(uint32_t(i + 1));
+    });
+}
+
+void FlatNGrams::sort_table(uint32_t ngram_size) {
+    vector<uint32_t>& words = word_tables[ngram_size - 1];
+    vector<uint32_t>& counts = count_tables[ngram_size - 1];
+    assert(words.size() == counts.size() * ngram_size);
+    size_t rows = counts.size();
+
+    uint32_t max_word = 0;
+    for (uint32_t word : words)
+        max_word = std::max(max_word, word);
+    uint32_t bits = 0;
+    while (bits < 32 && (max_word >> bits) > 0)
+        bits++;
+    if (bits == 0 || rows < 2)
+        return;
+
+    // words are split into digits of at most 16 bits, sorted from the last
+    // digit of the last word to the first digit of the first word
+    uint32_t passes = (bits + 15) / 16;
+    uint32_t digit_bits = (bits + passes - 1) / passes;
+    uint32_t digit_mask = (uint32_t(1) << digit_bits) - 1;
+    vector<uint32_t> sorted_words(words.size());
+    vector<uint32_t> sorted_counts(rows);
+    vector<size_t> offsets(size_t(1) << digit_bits);
+    for (uint32_t column = ngram_size; column-- > 0; ) {
+        for (uint32_t pass = 0; pass < passes; pass++) {
+            uint32_t shift = pass * digit_bits;
+            std::fill(offsets.begin(), offsets.end(), 0);
+            for (size_t row = 0; row < rows; row++)
+                offsets[(words[row * ngram_size + column] >> shift) & digit_mask]++;
+            if (*std::max_element(offsets.begin(), offsets.end()) == rows)
+                continue;
+
+            size_t offset = 0;
+            for (size_t& bucket : offsets) {
+                size_t bucket_size = bucket;
+                bucket = offset;
+                offset += bucket_size;
+            }
+            for (size_t row = 0; row < rows; row++) {
+                const uint32_t* ngram = words.data() + row * ngram_size;
+                size_t sorted_row = offsets[(ngram[column] >> shift) & digit_mask]++;
+                std::copy(ngram, ngram + ngram_size, sorted_words.data() + sorted_row * ngram_size);
+                sorted_counts[sorted_row] = counts[row];
+            }
+            words.swap(sorted_words);
+            counts.swap(sorted_counts);
+        }
+    }
+}
+
+vector<uint64_t> FlatNGrams::merge() const {
+    uint32_t max_size = max_ngram_size();
+    vector<size_t> heads(max_size, 0);
+    vector<uint64_t> positions;
+    positions.reserve(size());
+    while (true) {
+        // the least head is searched among all sizes, there are only a few of them
+        uint32_t best_size = 0;
+        const uint32_t* best_ngram = nullptr;
+        for (uint32_t ngram_size = 1; ngram_size <= max_size; ngram_size++) {
+            if (heads[ngram_size - 1] == count_tables[ngram_size - 1].size())
+                continue;
+            const uint32_t* ngram = word_tables[ngram_size - 1].data() + heads[ngram_size - 1] * ngram_size;
+            bool less = best_ngram == nullptr;
+            if (!less) {
+                uint32_t common = std::min(ngram_size, best_size);
+                uint32_t i = 0;
+                while (i < common && ngram[i] == best_ngram[i])
+                    i++;
+                less = i < common ? ngram[i] < best_ngram[i] : ngram_size < best_size;
+            }
+            if (less) {
+                best_size = ngram_size;
+                best_ngram = ngram;
+            }
+        }
+        if (best_ngram == nullptr)
+            break;
+        positions.push_back(position(best_size, heads[best_size - 1]++));
+    }
+    return positions;
+}
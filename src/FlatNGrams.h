@@ -0,0 +1,66 @@
+#ifndef NGRAMSTORAGE_FLATNGRAMS_H
+#define NGRAMSTORAGE_FLATNGRAMS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+using std::vector;
+using std::pair;
+
+
+// Ngrams grouped by size in flat arrays. The k-th ngram of size n consists of
+// words(n)[k * n] .. words(n)[k * n + n - 1] and occurs counts(n)[k] times.
+class FlatNGrams {
+public:
+    FlatNGrams() {}
+    FlatNGrams(const vector<pair<vector<uint32_t>, uint32_t>>& ngrams);
+
+    void add(const uint32_t* ngram, uint32_t ngram_size, uint32_t count);
+
+    uint32_t max_ngram_size() const;
+    size_t size() const;
+    size_t size(uint32_t ngram_size) const;
+
+    vector<uint32_t>& words(uint32_t ngram_size);
+    const vector<uint32_t>& words(uint32_t ngram_size) const;
+    vector<uint32_t>& counts(uint32_t ngram_size);
+    const vector<uint32_t>& counts(uint32_t ngram_size) const;
+
+    // Sorts ngrams of every size lexicographically by an LSD radix sort on word ids.
+    void sort(uint32_t threads_count = 1);
+
+    // Positions of all ngrams of sorted arrays in lexicographic order, where
+    // an ngram goes before the longer ngrams it is a prefix of.
+    vector<uint64_t> merge() const;
+
+    static uint64_t position(uint32_t ngram_size, size_t index) {
+        return (uint64_t(ngram_size) << 56) | index;
+    }
+
+    static uint32_t position_size(uint64_t position) {
+        return uint32_t(position >> 56);
+    }
+
+    const uint32_t* ngram(uint64_t position) const {
+        uint32_t ngram_size = position_size(position);
+        return word_tables[ngram_size - 1].data() + (position & position_mask) * ngram_size;
+    }
+
+    uint32_t count(uint64_t position) const {
+        return count_tables[position_size(position) - 1][position & position_mask];
+    }
+
+private:
+    static const uint64_t position_mask = (uint64_t(1) << 56) - 1;
+
+    vector<vector<uint32_t>> word_tables;
+    vector<vector<uint32_t>> count_tables;
+
+    void resize_tables(uint32_t max_ngram_size);
+    void sort_table(uint32_t ngram_size);
+};
+
+
+#endif //NGRAMSTORAGE_FLATNGRAMS_H
@@ -0,0 +1,84 @@
+#include "LanguageModel.h"
+#include "Parallel.h"
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+LanguageModel::LanguageModel(const NGramStorage& storage, double delta, double eps):
+        storage(&storage), delta(delta), eps(eps) {
+    uint32_t max_ngram_size = storage.get_max_ngram_size();
+    if (max_ngram_size > State::max_size)
+        throw std::runtime_error("ngrams longer than " + std::to_string(State::max_size) + " words");
+    max_context_size = max_ngram_size > 0 ? max_ngram_size - 1 : 0;
+    empty_context_value = storage.get_value(nullptr, 0);
+}
+
+LanguageModel::State LanguageModel::get_empty_state() const {
+    return storage->get_empty_state();
+}
+
+LanguageModel::State LanguageModel::get_state(const uint32_t* context, uint32_t size) const {
+    State state = get_empty_state();
+    for (uint32_t i = 0; i < size; i++) {
+        State next_state;
+        storage->advance(state, context[i], next_state);
+        state = next_state;
+    }
+    return state;
+}
+
+// Contexts go from the empty one to the longest, next_state.values[k] is the ngram
+// of the context of k words and the word, which gives count(c w).
+double LanguageModel::get_word_prob(const State& state, uint32_t word_index, State& next_state) const {
+    storage->advance(state, word_index, next_state);
+    uint32_t contexts_count = std::min<uint32_t>(state.size, max_context_size) + 1;
+    double prob = 1.0;
+    for (uint32_t k = 0; k < contexts_count; k++) {
+        const Value& context = k == 0 ? empty_context_value : state.values[k - 1];
+        uint32_t ngram_count = k < next_state.size ? next_state.values[k].ngram_count : 0;
+
+        if (context.unique_continuations_count == 0)
+            continue;
+        double all_continuations = std::max<uint32_t>(1, context.continuations_count);
+        if (all_continuations < min_continuations_count && k > 0)
+            continue;
+        double lower_prob = k == 0 ? eps / context.unique_continuations_count : prob;
+        prob = std::max(0.0, ngram_count - delta) / all_continuations +
+               delta * context.unique_continuations_count / all_continuations * lower_prob;
+    }
+    return prob;
+}
+
+double LanguageModel::get_word_prob(const uint32_t* ngram, uint32_t size) const {
+    if (size == 0)
+        return 1.0;
+    // words beyond the longest context do not change the probability
+    uint32_t skipped = size - 1 > max_context_size ? size - 1 - max_context_size : 0;
+    State state = get_state(ngram + skipped, size - 1 - skipped);
+    State next_state;
+    return get_word_prob(state, ngram[size - 1], next_state);
+}
+
+double LanguageModel::score_sentence(const uint32_t* sentence, uint32_t size, double* word_log_probs) const {
+    State states[2];
+    states[0] = get_empty_state();
+    double log_prob = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        double word_log_prob = log10(get_word_prob(states[i % 2], sentence[i], states[(i + 1) % 2]));
+        if (word_log_probs != nullptr)
+            word_log_probs[i] = word_log_prob;
+        log_prob += word_log_prob;
+    }
+    return log_prob;
+}
+
+vector<double> LanguageModel::score_sentences(const vector<vector<uint32_t>>& sentences,
+                                              uint32_t threads_count) const {
+    vector<double> log_probs(sentences.size());
+    parallel_for(threads_count, sentences.size(), [&] (size_t begin, size_t end, uint32_t) {
+        for (size_t i = begin; i < end; i++)
+            log_probs[i] = score_sentence(sentences[i].data(), uint32_t(sentences[i].size()));
+    });
+    return log_probs;
+}
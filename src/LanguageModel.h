@@ -0,0 +1,48 @@
+#ifndef NGRAMSTORAGE_LANGUAGEMODEL_H
+#define NGRAMSTORAGE_LANGUAGEMODEL_H
+
+#include "NGramStorage.h"
+
+#include <cstdint>
+#include <vector>
+
+using std::vector;
+
+
+// Interpolated Kneser-Ney model of language_model.py over the counts of a storage:
+// P(w | c) = max(0, count(c w) - delta) / C(c) + delta * U(c) / C(c) * P(w | c[1:]),
+// where C and U are the continuation counts, contexts with U(c) = 0 or with
+// C(c) < min_continuations_count are skipped and P(w | ()) ends with eps / U(()).
+// Words missing from the storage, e.g. ~0, are unknown words.
+class LanguageModel {
+public:
+    static const uint32_t min_continuations_count = 10;
+
+    // Stored suffixes of the words seen so far, see NGramStorage::State.
+    typedef NGramStorage::State State;
+
+    LanguageModel(const NGramStorage& storage, double delta = 0.75, double eps = 1.0);
+
+    State get_empty_state() const;
+    State get_state(const uint32_t* context, uint32_t size) const;
+
+    // Probability of word after the words of state, next_state then follows the word.
+    double get_word_prob(const State& state, uint32_t word_index, State& next_state) const;
+    // Probability of the last word of an ngram after the other words.
+    double get_word_prob(const uint32_t* ngram, uint32_t size) const;
+
+    // Sum of log10 probabilities of the words of a sentence, each after the previous ones.
+    // The probabilities of single words are written to word_log_probs unless it is nullptr.
+    double score_sentence(const uint32_t* sentence, uint32_t size, double* word_log_probs = nullptr) const;
+    vector<double> score_sentences(const vector<vector<uint32_t>>& sentences, uint32_t threads_count = 1) const;
+
+private:
+    const NGramStorage* storage;
+    double delta;
+    double eps;
+    uint32_t max_context_size;
+    Value empty_context_value;
+};
+
+
+#endif //NGRAMSTORAGE_LANGUAGEMODEL_H
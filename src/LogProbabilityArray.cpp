@@ -0,0 +1,179 @@
+#include "LogProbabilityArray.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <assert.h>
+
+template <class T>
+static void write_array(ostream& out, const MappedArray<T>& array) {
+    uint64_t size = array.size();
+    out.write((char*)(&size), sizeof(size));
+    out.write((char*)array.data(), size * sizeof(T));
+}
+
+template <class T>
+static MappedArray<T> read_array(istream& in) {
+    uint64_t size;
+    in.read((char*)(&size), sizeof(size));
+    vector<T> array(size);
+    in.read((char*)array.data(), size * sizeof(T));
+    return MappedArray<T>(std::move(array));
+}
+
+LogProbabilityArray::LogProbabilityArray(const vector<LogProbability>& values, uint32_t bits_count):
+        bits_count(bits_count), count(uint32_t(values.size())) {
+    assert(bits_count <= max_bits_count);
+    if (bits_count == 0) {
+        this->values = MappedArray<LogProbability>(values);
+        return;
+    }
+
+    vector<float> log_probs(count);
+    vector<float> backoffs(count);
+    for (uint32_t i = 0; i < count; i++) {
+        log_probs[i] = values[i].log_prob;
+        backoffs[i] = values[i].backoff;
+    }
+    vector<float> log_prob_bins = make_bins(log_probs, uint32_t(1) << bits_count);
+    vector<float> backoff_bins = make_bins(backoffs, uint32_t(1) << bits_count);
+
+    vector<uint64_t> codes((uint64_t(count) * 2 * bits_count + 63) / 64 + 1, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t code = find_bin(log_prob_bins, log_probs[i]) |
+                        (uint64_t(find_bin(backoff_bins, backoffs[i])) << bits_count);
+        uint64_t position = uint64_t(i) * 2 * bits_count;
+        codes[position / 64] |= code << (position % 64);
+        if (position % 64 + 2 * bits_count > 64)
+            codes[position / 64 + 1] |= code >> (64 - position % 64);
+    }
+
+    this->log_prob_bins = MappedArray<float>(move(log_prob_bins));
+    this->backoff_bins = MappedArray<float>(move(backoff_bins));
+    this->codes = MappedArray<uint64_t>(move(codes));
+}
+
+vector<float> LogProbabilityArray::make_bins(vector<float> values, uint32_t bins_count) {
+    // NaN and infinities get bins of their own
+    vector<float> special_values;
+    for (float value : values)
+        if (!std::isfinite(value) &&
+            std::find_if(special_values.begin(), special_values.end(), [value] (float special_value) {
+                return special_value == value || (std::isnan(special_value) && std::isnan(value));
+            }) == special_values.end())
+            special_values.push_back(value);
+    values.erase(std::remove_if(values.begin(), values.end(), [] (float value) { return !std::isfinite(value); }),
+                 values.end());
+    std::sort(values.begin(), values.end());
+    if (bins_count < special_values.size() + (values.empty() ? 0 : 1))
+        throw std::invalid_argument("too few bits for the special values and one bin of finite values");
+    uint32_t value_bins_count = bins_count - uint32_t(special_values.size());
+
+    vector<float> bins(values);
+    bins.erase(std::unique(bins.begin(), bins.end()), bins.end());
+    if (bins.size() > value_bins_count) {
+        // bins of about the same size are refined by Lloyd's iterations, which move
+        // every bin value to the mean of the values closer to it than to the others
+        size_t size = values.size();
+        vector<double> sums(size + 1, 0.0);
+        for (size_t i = 0; i < size; i++)
+            sums[i + 1] = sums[i] + values[i];
+        vector<size_t> bounds(value_bins_count + 1, size);
+        for (uint32_t bin = 0; bin < value_bins_count; bin++)
+            bounds[bin] = size * bin / value_bins_count;
+
+        vector<double> means(value_bins_count);
+        for (uint32_t iteration = 0; iteration < lloyd_iterations; iteration++) {
+            for (uint32_t bin = 0; bin < value_bins_count; bin++)
+                if (bounds[bin + 1] > bounds[bin])
+                    means[bin] = (sums[bounds[bin + 1]] - sums[bounds[bin]]) / double(bounds[bin + 1] - bounds[bin]);
+                else
+                    means[bin] = bin > 0 ? means[bin - 1] : values[0];
+            for (uint32_t bin = 1; bin < value_bins_count; bin++) {
+                float middle = float((means[bin - 1] + means[bin]) / 2);
+                bounds[bin] = size_t(std::lower_bound(values.begin(), values.end(), middle) - values.begin());
+            }
+        }
+
+        bins.clear();
+        for (uint32_t bin = 0; bin < value_bins_count; bin++)
+            if (bounds[bin + 1] > bounds[bin])
+                bins.push_back(float((sums[bounds[bin + 1]] - sums[bounds[bin]]) / double(bounds[bin + 1] - bounds[bin])));
+        bins.erase(std::unique(bins.begin(), bins.end()), bins.end());
+    }
+
+    // NaN goes last, infinities at the ends of the sorted values
+    for (float value : special_values)
+        if (!std::isnan(value))
+            bins.insert(value < 0 ? bins.begin() : bins.end(), value);
+    for (float value : special_values)
+        if (std::isnan(value))
+            bins.push_back(value);
+    return bins;
+}
+
+uint32_t LogProbabilityArray::find_bin(const vector<float>& bins, float value) {
+    uint32_t value_bins_count = uint32_t(bins.size());
+    if (!bins.empty() && std::isnan(bins.back()))
+        value_bins_count--;
+    if (std::isnan(value))
+        return value_bins_count;
+
+    // the nearest bin value
+    uint32_t bin = uint32_t(std::lower_bound(bins.begin(), bins.begin() + value_bins_count, value) - bins.begin());
+    if (bin == value_bins_count)
+        return bin - 1;
+    if (bin == 0 || bins[bin] == value)
+        return bin;
+    return value - bins[bin - 1] < bins[bin] - value ? bin - 1 : bin;
+}
+
+void LogProbabilityArray::dump(ostream& out) const {
+    out.write((char*)(&bits_count), sizeof(bits_count));
+    out.write((char*)(&count), sizeof(count));
+    if (bits_count == 0) {
+        write_array(out, values);
+    } else {
+        write_array(out, log_prob_bins);
+        write_array(out, backoff_bins);
+        write_array(out, codes);
+    }
+}
+
+void LogProbabilityArray::load(istream& in) {
+    in.read((char*)(&bits_count), sizeof(bits_count));
+    in.read((char*)(&count), sizeof(count));
+    values = MappedArray<LogProbability>();
+    log_prob_bins = MappedArray<float>();
+    backoff_bins = MappedArray<float>();
+    codes = MappedArray<uint64_t>();
+    if (bits_count == 0) {
+        values = read_array<LogProbability>(in);
+    } else {
+        log_prob_bins = read_array<float>(in);
+        backoff_bins = read_array<float>(in);
+        codes = read_array<uint64_t>(in);
+    }
+}
+
+void LogProbabilityArray::dump_mapped(ostream& out) const {
+    write_mapped_value(out, bits_count);
+    write_mapped_value(out, count);
+    write_mapped_array(out, values.data(), values.size());
+    write_mapped_array(out, log_prob_bins.data(), log_prob_bins.size());
+    write_mapped_array(out, backoff_bins.data(), backoff_bins.size());
+    write_mapped_array(out, codes.data(), codes.size());
+}
+
+void LogProbabilityArray::load_mapped(MappedReader& in) {
+    bits_count = in.read_value<uint32_t>();
+    count = in.read_value<uint32_t>();
+    values = in.read_array<LogProbability>();
+    log_prob_bins = in.read_array<float>();
+    backoff_bins = in.read_array<float>();
+    codes = in.read_array<uint64_t>();
+    if (bits_count > max_bits_count ||
+        (bits_count == 0 ? values.size() != count :
+         codes.size() < (uint64_t(count) * 2 * bits_count + 63) / 64 + 1))
+        throw std::runtime_error("mapped file is corrupted");
+}
@@ -0,0 +1,81 @@
+#ifndef NGRAMSTORAGE_LOGPROBABILITYARRAY_H
+#define NGRAMSTORAGE_LOGPROBABILITYARRAY_H
+
+#include "Record.h"
+#include "Serializable.h"
+#include "MemoryMap.h"
+
+#include <vector>
+
+using std::vector;
+
+
+// Log probabilities and backoffs of the records of a level, either as floats or
+// quantized to bits_count bits each. A quantized value is the number of the nearest
+// value in a sorted table of bin values. The table starts from bins of about the same
+// number of values represented by their means and is refined by Lloyd's algorithm.
+// When there are fewer distinct values than bins, the table holds them exactly.
+// NaN and infinities keep bins of their own, std::invalid_argument is thrown when
+// there are not enough bins for them and one bin of finite values.
+class LogProbabilityArray: public Serializable {
+public:
+    LogProbabilityArray(): bits_count(0), count(0) {}
+    LogProbabilityArray(const vector<LogProbability>& values, uint32_t bits_count = 0);
+
+    static const uint32_t max_bits_count = 16;
+    static const uint32_t lloyd_iterations = 20;
+
+    uint32_t size() const {
+        return count;
+    }
+
+    uint32_t get_bits_count() const {
+        return bits_count;
+    }
+
+    size_t memory_size() const {
+        return values.size() * sizeof(LogProbability) + (log_prob_bins.size() + backoff_bins.size()) * sizeof(float) +
+               codes.size() * sizeof(uint64_t);
+    }
+
+    LogProbability operator[](uint32_t index) const {
+        if (bits_count == 0)
+            return values[index];
+        uint64_t code = read_bits(uint64_t(index) * 2 * bits_count, 2 * bits_count);
+        return LogProbability(log_prob_bins[code & bins_mask()], backoff_bins[code >> bits_count]);
+    }
+
+    void dump(ostream& out) const override;
+    void load(istream& in) override;
+
+    void dump_mapped(ostream& out) const;
+    void load_mapped(MappedReader& in);
+
+private:
+    uint32_t bits_count;
+    uint32_t count;
+    MappedArray<LogProbability> values;
+    MappedArray<float> log_prob_bins;
+    MappedArray<float> backoff_bins;
+    // codes of log_prob and backoff of every record, 2 * bits_count bits per record
+    MappedArray<uint64_t> codes;
+
+    uint64_t bins_mask() const {
+        return (uint64_t(1) << bits_count) - 1;
+    }
+
+    uint64_t read_bits(uint64_t position, uint32_t length) const {
+        uint64_t word = position / 64;
+        uint32_t shift = uint32_t(position % 64);
+        uint64_t bits = codes[word] >> shift;
+        if (shift + length > 64)
+            bits |= codes[word + 1] << (64 - shift);
+        return bits & ((uint64_t(1) << length) - 1);
+    }
+
+    static vector<float> make_bins(vector<float> values, uint32_t bins_count);
+    static uint32_t find_bin(const vector<float>& bins, float value);
+};
+
+
+#endif //NGRAMSTORAGE_LOGPROBABILITYARRAY_H
@@ -0,0 +1,92 @@
+#include "LookupStatistics.h"
+
+#include <mutex>
+
+const uint32_t LookupStatistics::max_levels;
+const char* const LookupStatistics::counter_names[counters_count] = {
+        "lookups", "misses", "blocks_switched", "records_decoded", "bits_read",
+        "block_cache_hits", "block_cache_misses", "context_cache_hits", "context_cache_misses"};
+
+struct LookupStatistics::Registry {
+    std::mutex mutex;
+    ThreadCounters* threads = nullptr;
+    uint64_t finished[max_levels][counters_count] = {};
+};
+
+LookupStatistics::Registry& LookupStatistics::get_registry() {
+    static Registry registry;
+    return registry;
+}
+
+LookupStatistics::ThreadCounters::ThreadCounters(): prev(nullptr) {
+    for (auto& level : values)
+        for (auto& value : level)
+            value.store(0, std::memory_order_relaxed);
+    Registry& registry = get_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    next = registry.threads;
+    if (next != nullptr)
+        next->prev = this;
+    registry.threads = this;
+}
+
+LookupStatistics::ThreadCounters::~ThreadCounters() {
+    Registry& registry = get_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (uint32_t i = 0; i < max_levels; i++)
+        for (uint32_t j = 0; j < counters_count; j++)
+            registry.finished[i][j] += values[i][j].load(std::memory_order_relaxed);
+    if (prev != nullptr)
+        prev->next = next;
+    else
+        registry.threads = next;
+    if (next != nullptr)
+        next->prev = prev;
+}
+
+bool LookupStatistics::enabled() {
+#ifdef NGRAMSTORAGE_STATISTICS
+    return true;
+#else
+    return false;
+#endif
+}
+
+LookupStatistics LookupStatistics::collect() {
+    LookupStatistics statistics;
+    Registry& registry = get_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (uint32_t i = 0; i < max_levels; i++)
+        for (uint32_t j = 0; j < counters_count; j++)
+            statistics.values[i][j] = registry.finished[i][j];
+    for (ThreadCounters* counters = registry.threads; counters != nullptr;
+         counters = counters->next)
+        for (uint32_t i = 0; i < max_levels; i++)
+            for (uint32_t j = 0; j < counters_count; j++)
+                statistics.values[i][j] += counters->values[i][j].load(std::memory_order_relaxed);
+    return statistics;
+}
+
+void LookupStatistics::reset() {
+    Registry& registry = get_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (uint32_t i = 0; i < max_levels; i++)
+        for (uint32_t j = 0; j < counters_count; j++)
+            registry.finished[i][j] = 0;
+    for (ThreadCounters* counters = registry.threads; counters != nullptr;
+         counters = counters->next)
+        for (uint32_t i = 0; i < max_levels; i++)
+            for (uint32_t j = 0; j < counters_count; j++)
+                counters->values[i][j].store(0, std::memory_order_relaxed);
+}
+
+uint64_t LookupStatistics::get(Counter counter, uint32_t level) const {
+    return level < max_levels ? values[level][counter] : 0;
+}
+
+uint64_t LookupStatistics::get(Counter counter) const {
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < max_levels; i++)
+        sum += values[i][counter];
+    return sum;
+}
@@ -0,0 +1,75 @@
+#ifndef NGRAMSTORAGE_LOOKUPSTATISTICS_H
+#define NGRAMSTORAGE_LOOKUPSTATISTICS_H
+
+#include <atomic>
+#include <cstdint>
+
+// Counters of the lookup path by level, i.e. ngram size - 1. They are compiled in only with
+// NGRAMSTORAGE_STATISTICS defined (cmake -DNGRAMSTORAGE_STATISTICS=ON), otherwise
+// NGRAMSTORAGE_COUNT does nothing and collect() gives zeros. Every thread adds to its own
+// counters, collect() sums the counters of all threads, the finished ones included.
+// The counters are shared by all storages of a process.
+class LookupStatistics {
+public:
+    enum Counter {
+        lookups,               // keys looked up by CompressedArray::find and find_batch
+        misses,                // lookups of keys that are not stored
+        blocks_switched,       // blocks that lookups and iterators started to decode
+        records_decoded,       // records whose keys lookups decoded
+        bits_read,             // bits that lookups decoded
+        block_cache_hits,
+        block_cache_misses,
+        context_cache_hits,    // the level of a context is its size - 1
+        context_cache_misses,
+        counters_count
+    };
+
+    // deeper levels are counted in the last one
+    static const uint32_t max_levels = 16;
+    static const char* const counter_names[counters_count];
+
+    uint64_t values[max_levels][counters_count];
+
+    static bool enabled();
+    static LookupStatistics collect();
+    // Counts that threads add meanwhile may be lost.
+    static void reset();
+
+    uint64_t get(Counter counter, uint32_t level) const;
+    // sum over the levels
+    uint64_t get(Counter counter) const;
+
+    static void add(Counter counter, uint32_t level, uint64_t count) {
+        std::atomic<uint64_t>& value = local().values[level < max_levels ? level : max_levels - 1][counter];
+        // only this thread writes the counter, so there is no need for a locked add
+        value.store(value.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
+
+private:
+    struct ThreadCounters {
+        ThreadCounters();
+        ~ThreadCounters();
+
+        std::atomic<uint64_t> values[max_levels][counters_count];
+        ThreadCounters* next;
+        ThreadCounters* prev;
+    };
+
+    // counters of the running threads and the sums of the finished ones
+    struct Registry;
+    static Registry& get_registry();
+
+    static ThreadCounters& local() {
+        static thread_local ThreadCounters counters;
+        return counters;
+    }
+};
+
+#ifdef NGRAMSTORAGE_STATISTICS
+#define NGRAMSTORAGE_COUNT(counter, level, count) \
+    LookupStatistics::add(LookupStatistics::counter, uint32_t(level), uint64_t(count))
+#else
+#define NGRAMSTORAGE_COUNT(counter, level, count) ((void)0)
+#endif
+
+#endif //NGRAMSTORAGE_LOOKUPSTATISTICS_H
@@ -0,0 +1,246 @@
+#ifndef NGRAMSTORAGE_MEMORYMAP_H
+#define NGRAMSTORAGE_MEMORYMAP_H
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <assert.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::vector;
+using std::string;
+using std::shared_ptr;
+using std::ostream;
+
+
+class MemoryMap {
+public:
+    MemoryMap(const string& filename): address(nullptr), length(0) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("cannot open " + filename);
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            throw std::runtime_error("cannot stat " + filename);
+        }
+        length = size_t(st.st_size);
+        if (length > 0) {
+            address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("cannot map " + filename);
+            }
+        }
+        close(fd);
+    }
+
+    MemoryMap(const MemoryMap&) = delete;
+    MemoryMap& operator=(const MemoryMap&) = delete;
+
+    ~MemoryMap() {
+        if (address != nullptr)
+            munmap(address, length);
+    }
+
+    const char* data() const {
+        return (const char*)address;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+private:
+    void* address;
+    size_t length;
+};
+
+
+// Read-only array that either owns its elements or points into a MemoryMap
+// which it keeps alive. Only owned arrays may be modified.
+template <class T>
+class MappedArray {
+public:
+    MappedArray(): ptr(nullptr), length(0) {}
+
+    MappedArray(vector<T> values): owned(std::move(values)) {
+        sync();
+    }
+
+    MappedArray(const T* ptr, size_t length, shared_ptr<const MemoryMap> mapping):
+            ptr(ptr), length(length), mapping(mapping) {}
+
+    MappedArray(const MappedArray& other): owned(other.owned), mapping(other.mapping) {
+        if (mapping) {
+            ptr = other.ptr;
+            length = other.length;
+        } else {
+            sync();
+        }
+    }
+
+    MappedArray(MappedArray&& other): owned(std::move(other.owned)), mapping(std::move(other.mapping)) {
+        if (mapping) {
+            ptr = other.ptr;
+            length = other.length;
+        } else {
+            sync();
+        }
+        other.sync();
+    }
+
+    MappedArray& operator=(MappedArray other) {
+        owned.swap(other.owned);
+        mapping.swap(other.mapping);
+        std::swap(ptr, other.ptr);
+        std::swap(length, other.length);
+        if (!mapping)
+            sync();
+        return *this;
+    }
+
+    const T* data() const { return ptr; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    bool is_mapped() const { return bool(mapping); }
+
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + length; }
+
+    const T& operator[](size_t index) const { return ptr[index]; }
+
+    T& operator[](size_t index) {
+        assert(!mapping);
+        return owned[index];
+    }
+
+    void push_back(const T& value) {
+        detach();
+        owned.push_back(value);
+        sync();
+    }
+
+    void resize(size_t size, const T& value = T()) {
+        detach();
+        owned.resize(size, value);
+        sync();
+    }
+
+    void assign(size_t size, const T& value) {
+        detach();
+        owned.assign(size, value);
+        sync();
+    }
+
+    void shrink_to_fit() {
+        if (!mapping) {
+            vector<T>(owned).swap(owned);
+            sync();
+        }
+    }
+
+private:
+    vector<T> owned;
+    const T* ptr;
+    size_t length;
+    shared_ptr<const MemoryMap> mapping;
+
+    void sync() {
+        ptr = owned.data();
+        length = owned.size();
+    }
+
+    void detach() {
+        if (mapping) {
+            owned.assign(ptr, ptr + length);
+            mapping.reset();
+        }
+    }
+};
+
+
+// Sections of a mapped file are aligned relative to the beginning of the file,
+// so that arrays can be used in place once the file is mapped at a page boundary.
+const size_t mapped_page_size = 4096;
+const size_t mapped_array_alignment = 64;
+
+inline void write_padding(ostream& out, size_t alignment) {
+    size_t position = size_t(out.tellp());
+    static const char zeros[mapped_page_size] = {};
+    size_t padding = (alignment - position % alignment) % alignment;
+    out.write(zeros, padding);
+}
+
+template <class T>
+void write_mapped_value(ostream& out, const T& value) {
+    out.write((const char*)(&value), sizeof(value));
+}
+
+template <class T>
+void write_mapped_array(ostream& out, const T* data, size_t size) {
+    uint64_t count = size;
+    write_mapped_value(out, count);
+    write_padding(out, mapped_array_alignment);
+    out.write((const char*)data, size * sizeof(T));
+}
+
+
+class MappedReader {
+public:
+    MappedReader(shared_ptr<const MemoryMap> mapping): mapping(mapping), position(0) {}
+
+    template <class T>
+    T read_value() {
+        check(sizeof(T));
+        T value;
+        memcpy(&value, mapping->data() + position, sizeof(T));
+        position += sizeof(T);
+        return value;
+    }
+
+    template <class T>
+    MappedArray<T> read_array() {
+        uint64_t count = read_value<uint64_t>();
+        align(mapped_array_alignment);
+        if (count > std::numeric_limits<size_t>::max() / sizeof(T))
+            throw std::runtime_error("mapped file is corrupted");
+        check(size_t(count) * sizeof(T));
+        const T* data = (const T*)(mapping->data() + position);
+        position += count * sizeof(T);
+        return MappedArray<T>(data, count, mapping);
+    }
+
+    void align(size_t alignment) {
+        position += (alignment - position % alignment) % alignment;
+    }
+
+    const char* read_bytes(size_t size) {
+        check(size);
+        const char* data = mapping->data() + position;
+        position += size;
+        return data;
+    }
+
+private:
+    shared_ptr<const MemoryMap> mapping;
+    size_t position;
+
+    void check(size_t size) const {
+        // position may be past the end after align
+        if (position > mapping->size() || size > mapping->size() - position)
+            throw std::runtime_error("mapped file is truncated");
+    }
+};
+
+
+#endif //NGRAMSTORAGE_MEMORYMAP_H
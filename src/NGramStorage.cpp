@@ -4,240 +4,1031 @@
 
 #include "NGramStorage.h"
 
+#include <cmath>
+#include <limits>
 
-NGramStorage::NGramStorage() : max_ngram_size(0), cache(128) {}
+const char NGramStorage::stream_magic[8] = {'N', 'G', 'R', 'A', 'M', 'S', 'T', 'R'};
+// 2 holds arrays of CompressedArray version 2, 3 adds float log probabilities,
+// 4 stores them in LogProbabilityArray.
+const uint32_t NGramStorage::stream_version = 4;
+const char NGramStorage::mapped_magic[8] = {'N', 'G', 'R', 'A', 'M', 'M', 'A', 'P'};
+const uint32_t NGramStorage::mapped_version = 6;
+const uint32_t NGramStorage::batch_size = 256;
+const size_t NGramStorage::Builder::default_memory_budget = size_t(1) << 30;
+const uint8_t NGramStorage::State::max_size;
 
-NGramStorage::NGramStorage(vector<pair<vector<uint32_t>, uint32_t>> &ngrams): cache(128) {
-    init(ngrams);
+NGramStorage::NGramStorage() : max_ngram_size(0), unknown_word_log_prob(0), empty_ngram_count(0),
+                               empty_ngram_continuations_count(0), empty_ngram_unique_continuations_count(0) {}
+
+NGramStorage::NGramStorage(vector<pair<vector<uint32_t>, uint32_t>> &ngrams, const Options& options) {
+    init(ngrams, options);
+}
+
+NGramStorage::NGramStorage(FlatNGrams& ngrams, const Options& options) {
+    init(ngrams, options);
+}
+
+NGramStorage::NGramStorage(string filename, const Options& options) {
+    init(filename, options);
+}
+
+void NGramStorage::init(vector<pair<vector<uint32_t>, uint32_t>>& ngrams, const Options& options) {
+    FlatNGrams flat_ngrams(ngrams);
+    init(flat_ngrams, options);
 }
 
-NGramStorage::NGramStorage(string filename): cache(128) {
+void NGramStorage::init(FlatNGrams& ngrams, const Options& options) {
+    assert(ngrams.size() < (~uint32_t(0)));
+    this->options = options;
+    storage.clear();
+    log_probabilities.clear();
+    cache.clear();
+    max_ngram_size = uint8_t(ngrams.max_ngram_size());
+    ngrams.sort(options.threads_count);
+    build_storage(ngrams, ngrams.merge());
+    store_empty_ngram_values(ngrams);
+    reset_block_cache();
+    if (options.log_probabilities)
+        compute_log_probabilities(options.delta, options.eps, options.probability_bits);
+}
+
+void NGramStorage::init(const string& filename, const Options& options) {
     ifstream fin(filename, std::ios::in | std::ios::binary);
-    vector<pair<vector<uint32_t>, uint32_t>> ngrams;
     uint64_t ngrams_count;
     fin.read((char*)&ngrams_count, sizeof(ngrams_count));
-    ngrams.resize(ngrams_count);
+    if (options.memory_budget > 0) {
+        Builder builder(options);
+        vector<uint32_t> ngram;
+        for (uint64_t i = 0; i < ngrams_count; i++) {
+            uint32_t count;
+            fin.read((char*)&count, sizeof(count));
+            uint8_t ngram_size;
+            fin.read((char*)&ngram_size, sizeof(ngram_size));
+            ngram.resize(ngram_size);
+            fin.read((char*)ngram.data(), ngram_size * sizeof(uint32_t));
+            builder.add(ngram.data(), ngram_size, count);
+        }
+        builder.build(*this);
+        return;
+    }
+
+    FlatNGrams ngrams;
+    uint32_t ngram[256];
     for (uint64_t i = 0; i < ngrams_count; i++) {
-        fin.read((char*)&ngrams[i].second, sizeof(ngrams[i].second));
+        uint32_t count;
+        fin.read((char*)&count, sizeof(count));
         uint8_t ngram_size;
         fin.read((char*)&ngram_size, sizeof(ngram_size));
-        ngrams[i].first.resize(ngram_size);
-        for (uint8_t j = 0; j < ngram_size; j++)
-            fin.read((char*)&ngrams[i].first[j], sizeof(ngrams[i].first[j]));
+        fin.read((char*)ngram, ngram_size * sizeof(uint32_t));
+        ngrams.add(ngram, ngram_size, count);
     }
-    init(ngrams);
-}
-
-void NGramStorage::init(vector<pair<vector<uint32_t>, uint32_t>>& ngrams) {
-    assert(ngrams.size() < (~uint32_t(0)));
-    store_empty_ngram_values(ngrams);
-    store_max_ngram_size(ngrams);
-    sort_ngrams(ngrams);
-    build_storage(ngrams);
+    init(ngrams, options);
 }
 
 void NGramStorage::load(istream& in) {
-    in.read((char*)(&empty_ngram_count), sizeof(empty_ngram_count));
-    in.read((char*)(&empty_ngram_continuations_count), sizeof(empty_ngram_continuations_count));
+    // Dumps without the magic start with empty_ngram_count and
+    // empty_ngram_continuations_count, which are always equal,
+    // so they cannot be mistaken for the magic.
+    char magic[sizeof(stream_magic)];
+    in.read(magic, sizeof(magic));
+    uint32_t version = 1;
+    if (memcmp(magic, stream_magic, sizeof(stream_magic)) == 0) {
+        in.read((char*)(&version), sizeof(version));
+        if (version > stream_version)
+            throw std::runtime_error("unsupported ngram storage version");
+        in.read((char*)(&empty_ngram_count), sizeof(empty_ngram_count));
+        in.read((char*)(&empty_ngram_continuations_count), sizeof(empty_ngram_continuations_count));
+    } else {
+        memcpy(&empty_ngram_count, magic, sizeof(empty_ngram_count));
+        memcpy(&empty_ngram_continuations_count, magic + sizeof(empty_ngram_count),
+               sizeof(empty_ngram_continuations_count));
+    }
     in.read((char*)(&empty_ngram_unique_continuations_count), sizeof(empty_ngram_unique_continuations_count));
 
     in.read((char*)(&max_ngram_size), sizeof(max_ngram_size));
+    // the arrays of every later stream are those of version 2
+    uint32_t array_version = min(version, uint32_t(2));
     storage.resize(max_ngram_size);
     for (uint32_t i = 0; i < max_ngram_size; i++)
-        storage[i].load(in);
+        storage[i].load_body(in, array_version);
+
+    log_probabilities.clear();
+    // streams before version 3 have no log probabilities
+    uint8_t has_log_probabilities = 0;
+    if (version >= 3)
+        in.read((char*)(&has_log_probabilities), sizeof(has_log_probabilities));
+    if (has_log_probabilities && version == 3) {
+        // stream version 3 kept floats of every record, only ARPA files had them
+        unknown_word_log_prob = -std::numeric_limits<float>::infinity();
+        for (uint32_t i = 0; i < max_ngram_size; i++) {
+            vector<LogProbability> level(storage[i].size());
+            in.read((char*)level.data(), level.size() * sizeof(LogProbability));
+            log_probabilities.push_back(LogProbabilityArray(level));
+        }
+    } else if (has_log_probabilities) {
+        in.read((char*)(&unknown_word_log_prob), sizeof(unknown_word_log_prob));
+        log_probabilities.resize(max_ngram_size);
+        for (uint32_t i = 0; i < max_ngram_size; i++)
+            log_probabilities[i].load(in);
+    }
+    cache.clear();
+    reset_block_cache();
 }
 
 void NGramStorage::dump(ostream& out) const {
+    out.write(stream_magic, sizeof(stream_magic));
+    out.write((char*)(&stream_version), sizeof(stream_version));
     out.write((char*)(&empty_ngram_count), sizeof(empty_ngram_count));
     out.write((char*)(&empty_ngram_continuations_count), sizeof(empty_ngram_continuations_count));
     out.write((char*)(&empty_ngram_unique_continuations_count), sizeof(empty_ngram_unique_continuations_count));
 
     out.write((char*)(&max_ngram_size), sizeof(max_ngram_size));
     for (uint32_t i = 0; i < max_ngram_size; i++)
-        storage[i].dump(out);
+        storage[i].dump_body(out);
+
+    uint8_t has_log_probabilities = this->has_log_probabilities();
+    out.write((char*)(&has_log_probabilities), sizeof(has_log_probabilities));
+    if (has_log_probabilities)
+        out.write((char*)(&unknown_word_log_prob), sizeof(unknown_word_log_prob));
+    for (const LogProbabilityArray& level : log_probabilities)
+        level.dump(out);
 }
 
-Record NGramStorage::find_record(const vector<uint32_t>& ngram) {
-    if (ngram.size() == 0)
-        throw NotFoundException("empty ngram");
+void NGramStorage::load_mapped(const string& filename) {
+    shared_ptr<const MemoryMap> mapping = std::make_shared<MemoryMap>(filename);
+    MappedReader in(mapping);
+
+    if (memcmp(in.read_bytes(sizeof(mapped_magic)), mapped_magic, sizeof(mapped_magic)) != 0)
+        throw std::runtime_error(filename + " is not a mapped ngram storage");
+    if (in.read_value<uint32_t>() != mapped_version)
+        throw std::runtime_error(filename + " has unsupported version");
 
-    vector<uint32_t> context(ngram);
-    context.pop_back();
+    empty_ngram_count = in.read_value<uint32_t>();
+    empty_ngram_continuations_count = in.read_value<uint32_t>();
+    empty_ngram_unique_continuations_count = in.read_value<uint32_t>();
 
-    uint32_t context_index = get_context_index(context);
+    max_ngram_size = in.read_value<uint8_t>();
+    storage.assign(max_ngram_size, CompressedArray());
+    for (uint32_t i = 0; i < max_ngram_size; i++) {
+        in.align(mapped_page_size);
+        storage[i].load_mapped(in);
+    }
+
+    log_probabilities.clear();
+    if (in.read_value<uint8_t>()) {
+        unknown_word_log_prob = in.read_value<float>();
+        log_probabilities.resize(max_ngram_size);
+        for (uint32_t i = 0; i < max_ngram_size; i++) {
+            log_probabilities[i].load_mapped(in);
+            if (log_probabilities[i].size() != storage[i].size())
+                throw std::runtime_error("mapped file is corrupted");
+        }
+    }
+    cache.clear();
+    reset_block_cache();
+}
+
+void NGramStorage::dump_mapped(const string& filename) const {
+    ofstream out(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    out.write(mapped_magic, sizeof(mapped_magic));
+    write_mapped_value(out, mapped_version);
+
+    write_mapped_value(out, empty_ngram_count);
+    write_mapped_value(out, empty_ngram_continuations_count);
+    write_mapped_value(out, empty_ngram_unique_continuations_count);
+
+    write_mapped_value(out, max_ngram_size);
+    for (uint32_t i = 0; i < max_ngram_size; i++) {
+        write_padding(out, mapped_page_size);
+        storage[i].dump_mapped(out);
+    }
+
+    write_mapped_value(out, uint8_t(has_log_probabilities()));
+    if (has_log_probabilities())
+        write_mapped_value(out, unknown_word_log_prob);
+    for (const LogProbabilityArray& level : log_probabilities)
+        level.dump_mapped(out);
+    if (!out)
+        throw std::runtime_error("cannot write " + filename);
+}
+
+bool NGramStorage::find_record(const vector<uint32_t>& ngram, ContextCache& cache,
+                               Record& record) const {
+    if (ngram.size() == 0 || ngram.size() > max_ngram_size)
+        return false;
+
+    uint32_t context_size = uint32_t(ngram.size() - 1);
+    uint32_t context_index;
+    if (!get_context_index(ngram.data(), context_size, cache, context_index))
+        return false;
     uint32_t word_index = ngram.back();
-    auto it = storage[context.size()].find(Key(word_index, context_index));
-    if (it == storage[context.size()].end())
-        throw NotFoundException("ngram");
-    return *it;
+    auto it = storage[context_size].find(Key(word_index, context_index));
+    if (it == storage[context_size].end())
+        return false;
+    record = *it;
+    return true;
 }
 
-uint32_t NGramStorage::get_ngram_count(const vector<uint32_t>& ngram) {
+Value NGramStorage::get_value(const vector<uint32_t>& ngram, ContextCache& cache) const {
     if (ngram.size() == 0)
-        return empty_ngram_count;
-    else {
-        try {
-            return find_record(ngram).value.ngram_count;
-        } catch (NotFoundException exception) {
-            return 0;
-        }
+        return Value(empty_ngram_count, empty_ngram_continuations_count,
+                     empty_ngram_unique_continuations_count);
+
+    Record record;
+    if (!find_record(ngram, cache, record))
+        return Value(0, 0, 0);
+    return record.value;
+}
+
+Value NGramStorage::get_value(const vector<uint32_t>& ngram) const {
+    return get_value(ngram, cache);
+}
+
+uint32_t NGramStorage::get_ngram_count(const vector<uint32_t>& ngram) const {
+    return get_value(ngram).ngram_count;
+}
+
+uint32_t NGramStorage::get_continuations_count(const vector<uint32_t>& ngram) const {
+    return get_value(ngram).continuations_count;
+}
+
+uint32_t NGramStorage::get_unique_continuations_count(const vector<uint32_t>& ngram) const {
+    return get_value(ngram).unique_continuations_count;
+}
+
+bool NGramStorage::find_record(const uint32_t* ngram, uint32_t size, Record& record) const {
+    if (size == 0 || size > max_ngram_size)
+        return false;
+
+    uint32_t context_index;
+    if (!get_context_index(ngram, size - 1, context_index))
+        return false;
+    auto it = storage[size - 1].find(Key(ngram[size - 1], context_index));
+    if (it == storage[size - 1].end())
+        return false;
+    record = *it;
+    return true;
+}
+
+Value NGramStorage::get_value(const uint32_t* ngram, uint32_t size) const {
+    if (size == 0)
+        return Value(empty_ngram_count, empty_ngram_continuations_count,
+                     empty_ngram_unique_continuations_count);
+
+    Record record;
+    if (!find_record(ngram, size, record))
+        return Value(0, 0, 0);
+    return record.value;
+}
+
+void NGramStorage::get_values(const uint32_t* ngrams, uint32_t ngram_size, uint32_t count,
+                              Value* values) const {
+    if (ngram_size == 0 || ngram_size > max_ngram_size) {
+        for (uint32_t i = 0; i < count; i++)
+            values[i] = get_value(ngrams + i * ngram_size, ngram_size);
+        return;
     }
+    find_batch(ngrams, ngram_size, count, nullptr, values);
 }
 
-uint32_t NGramStorage::get_continuations_count(const vector<uint32_t>& ngram) {
-    if (ngram.size() == 0)
-        return empty_ngram_continuations_count;
-    else {
-        try {
-            return find_record(ngram).value.continuations_count;
-        } catch (NotFoundException exception) {
-            return 0;
-        }
+void NGramStorage::find_indices(const uint32_t* ngrams, uint32_t ngram_size, uint32_t count,
+                                uint32_t* indices) const {
+    if (ngram_size == 0 || ngram_size > max_ngram_size) {
+        std::fill(indices, indices + count, CompressedArray::not_found);
+        return;
     }
+    find_batch(ngrams, ngram_size, count, indices, nullptr);
 }
 
-uint32_t NGramStorage::get_unique_continuations_count(const vector<uint32_t>& ngram) {
-    if (ngram.size() == 0)
-        return empty_ngram_unique_continuations_count;
-    else {
-        try {
-            return find_record(ngram).value.unique_continuations_count;
-        } catch (NotFoundException exception) {
-            return 0;
+void NGramStorage::find_batch(const uint32_t* ngrams, uint32_t ngram_size, uint32_t count,
+                              uint32_t* indices, Value* values) const {
+    uint32_t positions[batch_size];
+    uint32_t context_indices[batch_size];
+    Key keys[batch_size];
+    uint32_t found_indices[batch_size];
+    Value found_values[batch_size];
+
+    for (uint32_t first = 0; first < count; first += batch_size) {
+        uint32_t size = min(batch_size, count - first);
+        for (uint32_t i = 0; i < size; i++) {
+            positions[i] = first + i;
+            context_indices[i] = 0;
+            if (indices != nullptr)
+                indices[first + i] = CompressedArray::not_found;
+            if (values != nullptr)
+                values[first + i] = Value(0, 0, 0);
+        }
+
+        for (uint32_t level = 0; level < ngram_size && size > 0; level++) {
+            for (uint32_t i = 0; i < size; i++)
+                keys[i] = Key(ngrams[positions[i] * ngram_size + level], context_indices[i]);
+
+            bool last_level = level + 1 == ngram_size;
+            storage[level].find_batch(keys, size, found_indices,
+                                      last_level && values != nullptr ? found_values : nullptr);
+
+            uint32_t found_count = 0;
+            for (uint32_t i = 0; i < size; i++) {
+                if (found_indices[i] == CompressedArray::not_found)
+                    continue;
+                if (last_level && indices != nullptr)
+                    indices[positions[i]] = found_indices[i];
+                if (last_level && values != nullptr)
+                    values[positions[i]] = found_values[i];
+                positions[found_count] = positions[i];
+                context_indices[found_count] = found_indices[i];
+                found_count++;
+            }
+            size = found_count;
         }
     }
 }
 
+uint32_t NGramStorage::get_ngram_count(const uint32_t* ngram, uint32_t size) const {
+    return get_value(ngram, size).ngram_count;
+}
+
+uint32_t NGramStorage::get_continuations_count(const uint32_t* ngram, uint32_t size) const {
+    return get_value(ngram, size).continuations_count;
+}
+
+uint32_t NGramStorage::get_unique_continuations_count(const uint32_t* ngram, uint32_t size) const {
+    return get_value(ngram, size).unique_continuations_count;
+}
+
 uint8_t NGramStorage::get_max_ngram_size() const {
     return max_ngram_size;
 }
 
-uint32_t NGramStorage::get_context_index(const vector<uint32_t>& ngram) {
-    uint32_t context_index = 0;
-    uint32_t i = 0;
+uint32_t NGramStorage::get_ngrams_count(uint8_t ngram_size) const {
+    return ngram_size > 0 && ngram_size <= max_ngram_size ? storage[ngram_size - 1].size() : 0;
+}
+
+const CompressedArray& NGramStorage::get_level(uint8_t ngram_size) const {
+    return storage[ngram_size - 1];
+}
 
-    vector<uint32_t> ngram_copy(ngram);
-    while (ngram_copy.size() > 0) {
-        if (cache.exist(ngram_copy)) {
-            context_index = cache.get(ngram_copy);
-            i = uint32_t(ngram_copy.size());
-            break;
+bool NGramStorage::find_index(const uint32_t* ngram, uint32_t size, uint32_t& index) const {
+    if (size == 0 || size > max_ngram_size)
+        return false;
+    return get_context_index(ngram, size, index);
+}
+
+bool NGramStorage::has_log_probabilities() const {
+    return !log_probabilities.empty();
+}
+
+void NGramStorage::set_log_probabilities(vector<vector<LogProbability>> log_probabilities,
+                                         float unknown_word_log_prob, uint32_t bits_count) {
+    assert(log_probabilities.size() == max_ngram_size);
+    this->unknown_word_log_prob = unknown_word_log_prob;
+    this->log_probabilities.assign(max_ngram_size, LogProbabilityArray());
+    parallel_for(max<uint32_t>(options.threads_count, 1), max_ngram_size, [&] (size_t begin, size_t end, uint32_t) {
+        for (size_t i = begin; i < end; i++) {
+            assert(log_probabilities[i].size() == storage[i].size());
+            this->log_probabilities[i] = LogProbabilityArray(log_probabilities[i], bits_count);
+            vector<LogProbability>().swap(log_probabilities[i]);
+        }
+    });
+}
+
+void NGramStorage::set_log_probabilities(uint8_t ngram_size, const vector<LogProbability>& log_probabilities,
+                                         float unknown_word_log_prob, uint32_t bits_count) {
+    assert(ngram_size >= 1 && ngram_size <= max_ngram_size);
+    assert(log_probabilities.size() == storage[ngram_size - 1].size());
+    this->unknown_word_log_prob = unknown_word_log_prob;
+    this->log_probabilities.resize(max_ngram_size);
+    this->log_probabilities[ngram_size - 1] = LogProbabilityArray(log_probabilities, bits_count);
+}
+
+LogProbability NGramStorage::get_log_probability(uint8_t ngram_size, uint32_t index) const {
+    return log_probabilities[ngram_size - 1][index];
+}
+
+bool NGramStorage::get_log_probability(const uint32_t* ngram, uint32_t size,
+                                       LogProbability& probability) const {
+    uint32_t index;
+    if (!has_log_probabilities() || !find_index(ngram, size, index))
+        return false;
+    probability = log_probabilities[size - 1][index];
+    return !std::isnan(probability.log_prob);
+}
+
+// Every suffix is found in one walk, which passes its context on the way.
+float NGramStorage::get_word_log_prob(const uint32_t* ngram, uint32_t size) const {
+    assert(has_log_probabilities());
+    float backoff = 0;
+    for (uint32_t start = size > max_ngram_size ? size - max_ngram_size : 0; start < size; start++) {
+        uint32_t index = 0;
+        uint32_t level = 0;
+        while (start + level < size) {
+            auto it = storage[level].find(Key(ngram[start + level], index));
+            if (it == storage[level].end())
+                break;
+            index = it.index();
+            level++;
+        }
+        if (start + level == size) {
+            float log_prob = log_probabilities[level - 1][index].log_prob;
+            if (!std::isnan(log_prob))
+                return log_prob + backoff;
+            // an unlisted ngram is backed off from its context as well
+            if (level > 1 && get_context_index(ngram + start, level - 1, index))
+                backoff += log_probabilities[level - 2][index].backoff;
+        } else if (start + level + 1 == size && level > 0) {
+            backoff += log_probabilities[level - 1][index].backoff;
         }
-        ngram_copy.pop_back();
     }
+    return unknown_word_log_prob + backoff;
+}
+
+void NGramStorage::compute_log_probabilities(float delta, float eps, uint32_t bits_count) {
+    // Levels go one by one, as the probabilities of an ngram use the ones of its suffix.
+    // Words of an ngram are collected along the prefixes from the keys of the previous levels,
+    // contexts are the records of the previous level.
+    uint32_t threads_count = max<uint32_t>(options.threads_count, 1);
+    vector<vector<Key>> keys(max_ngram_size);
+    vector<Value> context_values;
+    vector<vector<LogProbability>> values(max_ngram_size);
+    log_probabilities.clear();
+    unknown_word_log_prob = empty_ngram_unique_continuations_count == 0 ? 0.0f :
+                            float(log10(double(delta) * eps / max<uint32_t>(empty_ngram_continuations_count, 1)));
+
+    for (uint32_t level = 0; level < max_ngram_size; level++) {
+        vector<Value> level_values;
+        level_values.reserve(storage[level].size());
+        keys[level].reserve(storage[level].size());
+        for (auto it = storage[level].begin(); it != storage[level].end(); ++it) {
+            keys[level].push_back(it->key);
+            level_values.push_back(it->value);
+        }
+
+        values[level].resize(storage[level].size());
+        parallel_for(threads_count, storage[level].size(), [&] (size_t begin, size_t end, uint32_t) {
+            uint32_t ngram[256];
+            for (size_t index = begin; index < end; index++) {
+                Key key = keys[level][index];
+                for (uint32_t i = level + 1; i-- > 0; ) {
+                    ngram[i] = key.word_index;
+                    if (i > 0)
+                        key = keys[i - 1][key.context_index];
+                }
+
+                Value context = level == 0 ?
+                                Value(empty_ngram_count, empty_ngram_continuations_count,
+                                      empty_ngram_unique_continuations_count) :
+                                context_values[keys[level][index].context_index];
+                double all_continuations = max<uint32_t>(context.continuations_count, 1);
+                double suffix_prob = level == 0 ? double(eps) / context.unique_continuations_count :
+                                     pow(10.0, get_word_log_prob(ngram + 1, level));
+                double prob = suffix_prob;
+                if (level == 0 || context.continuations_count >= 10) {
+                    double ngram_count = level_values[index].ngram_count;
+                    prob = max(0.0, ngram_count - delta) / all_continuations +
+                           delta * context.unique_continuations_count / all_continuations * suffix_prob;
+                }
+
+                const Value& value = level_values[index];
+                double backoff = 0;
+                if (value.unique_continuations_count > 0 && value.continuations_count >= 10)
+                    backoff = log10(double(delta) * value.unique_continuations_count /
+                                    value.continuations_count);
+                values[level][index] = LogProbability(float(log10(prob)), float(backoff));
+            }
+        });
+
+        // get_word_log_prob of the next level reads the exact probabilities of this one
+        log_probabilities.push_back(LogProbabilityArray(values[level]));
+        context_values.swap(level_values);
+        if (level + 1 == max_ngram_size)
+            vector<Key>().swap(keys[level]);
+    }
+    vector<vector<Key>>().swap(keys);
+    vector<Value>().swap(context_values);
 
-    while (i < ngram.size()) {
-        uint32_t word_index = ngram[i];
+    if (bits_count > 0)
+        set_log_probabilities(move(values), unknown_word_log_prob, bits_count);
+}
+
+void NGramStorage::set_block_cache_capacity(size_t capacity) {
+    block_cache.reset(capacity > 0 ? new BlockCache(capacity) : nullptr);
+    for (uint32_t i = 0; i < storage.size(); i++)
+        storage[i].set_block_cache(block_cache, i);
+}
+
+const BlockCache* NGramStorage::get_block_cache() const {
+    return block_cache.get();
+}
+
+NGramStorage::MemoryReport NGramStorage::memory_report() const {
+    MemoryReport report;
+    for (const CompressedArray& level : storage)
+        report.levels.push_back(level.memory_report());
+    for (const LogProbabilityArray& level : log_probabilities)
+        report.log_probabilities_bytes.push_back(level.memory_size());
+    return report;
+}
+
+uint64_t NGramStorage::MemoryReport::ngrams_count() const {
+    uint64_t count = 0;
+    for (const CompressedArray::MemoryReport& level : levels)
+        count += level.records_count;
+    return count;
+}
+
+size_t NGramStorage::MemoryReport::total_bytes() const {
+    size_t bytes = 0;
+    for (const CompressedArray::MemoryReport& level : levels)
+        bytes += level.total_bytes();
+    for (size_t level_bytes : log_probabilities_bytes)
+        bytes += level_bytes;
+    return bytes;
+}
+
+double NGramStorage::MemoryReport::bytes_per_ngram() const {
+    uint64_t count = ngrams_count();
+    return count > 0 ? double(total_bytes()) / count : 0.0;
+}
+
+void NGramStorage::set_context_cache_capacity(size_t capacity) {
+    cache = ContextCache(capacity);
+}
+
+const ContextCache& NGramStorage::get_context_cache() const {
+    return cache;
+}
+
+// Copies of a storage share its cache until one of them changes and gets a new one.
+void NGramStorage::reset_block_cache() {
+    set_block_cache_capacity(block_cache ? block_cache->get_capacity() : 0);
+}
+
+NGramStorage::State NGramStorage::get_empty_state() const {
+    if (max_ngram_size > State::max_size)
+        throw std::runtime_error("states of ngrams longer than " + std::to_string(State::max_size) + " words");
+    State state;
+    state.size = 0;
+    return state;
+}
+
+NGramStorage::State NGramStorage::get_state(const vector<uint32_t>& context) const {
+    State state = get_empty_state();
+    for (uint32_t word_index : context) {
+        State next_state;
+        advance(state, word_index, next_state);
+        state = next_state;
+    }
+    return state;
+}
+
+void NGramStorage::advance(const State& state, uint32_t word_index, State& next_state) const {
+    uint32_t size = min(uint32_t(state.size) + 1, uint32_t(max_ngram_size));
+    next_state.size = uint8_t(size);
+    // every order on its own, the storage is closed under prefixes only
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t context_index = (i == 0) ? 0 : state.indices[i - 1];
+        next_state.indices[i] = CompressedArray::not_found;
+        next_state.values[i] = Value(0, 0, 0);
+        if (context_index == CompressedArray::not_found)
+            continue;
         auto it = storage[i].find(Key(word_index, context_index));
         if (it == storage[i].end())
-            throw NotFoundException("context");
-        context_index = uint32_t(it - storage[i].begin());
-        ngram_copy.push_back(ngram[i]);
-        cache.put(ngram_copy, context_index);
-        i++;
+            continue;
+        next_state.indices[i] = it.index();
+        next_state.values[i] = it->value;
     }
+}
 
-    return context_index;
+// Starts from the longest cached prefix of the context.
+bool NGramStorage::get_context_index(const uint32_t* ngram, uint32_t size, ContextCache& cache,
+                                     uint32_t& context_index) const {
+    // hashes[i] is the hash of the first i + 1 words, size < max_ngram_size
+    uint64_t hashes[255];
+    uint64_t hash = ContextCache::empty_hash;
+    for (uint32_t i = 0; i < size; i++) {
+        hash = ContextCache::extend_hash(hash, ngram[i]);
+        hashes[i] = hash;
+    }
+
+    context_index = 0;
+    uint32_t i = size;
+    while (i > 0 && !cache.get(hashes[i - 1], context_index)) {
+        NGRAMSTORAGE_COUNT(context_cache_misses, i - 1, 1);
+        i--;
+    }
+    if (i > 0)
+        NGRAMSTORAGE_COUNT(context_cache_hits, i - 1, 1);
+
+    for (; i < size; i++) {
+        auto it = storage[i].find(Key(ngram[i], context_index));
+        if (it == storage[i].end())
+            return false;
+        context_index = it.index();
+        cache.put(hashes[i], context_index);
+    }
+    return true;
 }
 
-void NGramStorage::store_empty_ngram_values(const vector<pair<vector<uint32_t>, uint32_t>> &ngrams) {
-    set<uint32_t> continuations;
-    empty_ngram_count = 0;
-    empty_ngram_continuations_count = 0;
-    for (const auto& ngram : ngrams) {
-        empty_ngram_count += ngram.second;
-        empty_ngram_continuations_count += ngram.second;
-        continuations.insert(ngram.first[0]);
+bool NGramStorage::get_context_index(const uint32_t* ngram, uint32_t size,
+                                     uint32_t& context_index) const {
+    context_index = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        auto it = storage[i].find(Key(ngram[i], context_index));
+        if (it == storage[i].end())
+            return false;
+        context_index = it.index();
     }
-    empty_ngram_unique_continuations_count = uint32_t(continuations.size());
+    return true;
 }
 
-void NGramStorage::store_max_ngram_size(const vector<pair<vector<uint32_t>, uint32_t>> &ngrams) {
-    max_ngram_size = 0;
-    for (const auto& ngram : ngrams)
-        max_ngram_size = max(max_ngram_size, uint8_t(ngram.first.size()));
+// Counts of the empty ngram follow from the ngrams and the first level,
+// whose records are the distinct first words.
+void NGramStorage::store_empty_ngram_values(const FlatNGrams& ngrams) {
+    empty_ngram_count = 0;
+    for (uint32_t ngram_size = 1; ngram_size <= ngrams.max_ngram_size(); ngram_size++)
+        for (uint32_t count : ngrams.counts(ngram_size))
+            empty_ngram_count += count;
+    empty_ngram_continuations_count = empty_ngram_count;
+    empty_ngram_unique_continuations_count = storage.empty() ? 0 : storage[0].size();
 }
 
-void NGramStorage::sort_ngrams(vector<pair<vector<uint32_t>, uint32_t>> &ngrams) const {
-    sort(ngrams.begin(), ngrams.end(), [] (const pair<vector<uint32_t>, uint32_t>& ngram1,
-                                           const pair<vector<uint32_t>, uint32_t>& ngram2)  {
-             for (size_t i = 0; i < min(ngram1.first.size(), ngram2.first.size()); i++)
-                 if (ngram1.first[i] < ngram2.first[i])
-                     return true;
-                 else if (ngram1.first[i] > ngram2.first[i])
-                     return false;
-             return ngram1.first.size() < ngram2.first.size();
-         });
+uint32_t NGramStorage::find_group_start(const FlatNGrams& ngrams, const vector<uint64_t>& sorted_ngrams,
+                                        const vector<uint32_t>& contexts, uint32_t level, uint32_t index) const {
+    uint32_t prev_index = index;
+    while (prev_index > 0 && FlatNGrams::position_size(sorted_ngrams[prev_index - 1]) <= level)
+        prev_index--;
+    if (prev_index == 0)
+        return index;
+
+    Key prev_key(ngrams.ngram(sorted_ngrams[prev_index - 1])[level], contexts[prev_index - 1]);
+    while (index < sorted_ngrams.size() &&
+           (FlatNGrams::position_size(sorted_ngrams[index]) <= level ||
+            Key(ngrams.ngram(sorted_ngrams[index])[level], contexts[index]) == prev_key))
+        index++;
+    return index;
 }
 
-void NGramStorage::build_storage(const vector<pair<vector<uint32_t>, uint32_t>> &sorted_ngrams) {
-    vector<uint32_t> contexts(sorted_ngrams.size(), 0);
-    for (uint32_t i = 0; i < max_ngram_size; i++) {
-        vector<Record> records;
-
-        uint32_t prev_word_index = ~uint32_t(0);
-        uint32_t prev_context_index = ~uint32_t(0);
-        uint32_t prev_continuation_index = ~uint32_t(0);
-        uint32_t ngram_count = 0;
-        uint32_t continuations_count = 0;
-        uint32_t unique_continuations_count = 0;
-
-        for (uint32_t j = 0; j < sorted_ngrams.size(); j++) {
-            if (i < sorted_ngrams[j].first.size()) {
-                uint32_t word_index = sorted_ngrams[j].first[i];
-                uint32_t context_index = contexts[j];
-                if (prev_word_index == ~uint32_t(0)) {
-                    prev_word_index = word_index;
-                    prev_context_index = context_index;
-                }
-                if (word_index != prev_word_index || context_index != prev_context_index) {
-                    Key key(prev_word_index, prev_context_index);
-                    Value value(ngram_count, continuations_count, unique_continuations_count);
-                    Record record(key, value);
-                    records.push_back(record);
-                    prev_word_index = word_index;
-                    prev_context_index = context_index;
-                    prev_continuation_index = ~uint32_t(0);
-                    ngram_count = 0;
-                    continuations_count = 0;
-                    unique_continuations_count = 0;
+// Besides, contexts[j] is replaced by the number of the record of ngram j in records.
+void NGramStorage::aggregate_records(const FlatNGrams& ngrams, const vector<uint64_t>& sorted_ngrams,
+                                     vector<uint32_t>& contexts, uint32_t i,
+                                     uint32_t begin, uint32_t end, vector<Record>& records) const {
+    uint32_t prev_word_index = ~uint32_t(0);
+    uint32_t prev_context_index = ~uint32_t(0);
+    uint32_t prev_continuation_index = ~uint32_t(0);
+    uint32_t ngram_count = 0;
+    uint32_t continuations_count = 0;
+    uint32_t unique_continuations_count = 0;
+
+    for (uint32_t j = begin; j < end; j++) {
+        uint32_t ngram_size = FlatNGrams::position_size(sorted_ngrams[j]);
+        const uint32_t* ngram = ngrams.ngram(sorted_ngrams[j]);
+        uint32_t count = ngrams.count(sorted_ngrams[j]);
+        if (i < ngram_size) {
+            uint32_t word_index = ngram[i];
+            uint32_t context_index = contexts[j];
+            if (prev_word_index == ~uint32_t(0)) {
+                prev_word_index = word_index;
+                prev_context_index = context_index;
+            }
+            if (word_index != prev_word_index || context_index != prev_context_index) {
+                Key key(prev_word_index, prev_context_index);
+                Value value(ngram_count, continuations_count, unique_continuations_count);
+                Record record(key, value);
+                records.push_back(record);
+                prev_word_index = word_index;
+                prev_context_index = context_index;
+                prev_continuation_index = ~uint32_t(0);
+                ngram_count = 0;
+                continuations_count = 0;
+                unique_continuations_count = 0;
+            }
+            contexts[j] = uint32_t(records.size());
+            ngram_count += count;
+            if (i + 1 < ngram_size) {
+                continuations_count += count;
+                uint32_t continuation_index = ngram[i + 1];
+                if (continuation_index != prev_continuation_index) {
+                    unique_continuations_count += 1;
+                    prev_continuation_index = continuation_index;
                 }
-                ngram_count += sorted_ngrams[j].second;
-                if (i + 1 < sorted_ngrams[j].first.size()) {
-                    continuations_count += sorted_ngrams[j].second;
-                    uint32_t continuation_index = sorted_ngrams[j].first[i + 1];
-                    if (continuation_index != prev_continuation_index) {
-                        unique_continuations_count += 1;
-                        prev_continuation_index = continuation_index;
-                    }
+            }
+        }
+    }
+
+    if (prev_word_index != ~uint32_t(0)) {
+        Key key(prev_word_index, prev_context_index);
+        Value value(ngram_count, continuations_count, unique_continuations_count);
+        Record record(key, value);
+        records.push_back(record);
+    }
+}
+
+void NGramStorage::build_storage(const FlatNGrams& ngrams, const vector<uint64_t>& sorted_ngrams) {
+    uint32_t threads_count = max<uint32_t>(options.threads_count, 1);
+    uint32_t ngrams_count = uint32_t(sorted_ngrams.size());
+    vector<uint32_t> contexts(ngrams_count, 0);
+    for (uint32_t i = 0; i < max_ngram_size; i++) {
+        // every part of the ngrams starts with a new (word, context) pair,
+        // so the parts are aggregated independently
+        vector<uint32_t> bounds(threads_count + 1, ngrams_count);
+        for (uint32_t t = 0; t < threads_count; t++)
+            bounds[t] = find_group_start(ngrams, sorted_ngrams, contexts, i,
+                                         uint32_t(uint64_t(ngrams_count) * t / threads_count));
+        vector<vector<Record>> parts(threads_count);
+        parallel_run(threads_count, [&] (uint32_t t) {
+            if (bounds[t] < bounds[t + 1])
+                aggregate_records(ngrams, sorted_ngrams, contexts, i, bounds[t], bounds[t + 1], parts[t]);
+        });
+
+        vector<uint32_t> part_offsets(threads_count + 1, 0);
+        for (uint32_t t = 0; t < threads_count; t++)
+            part_offsets[t + 1] = part_offsets[t] + uint32_t(parts[t].size());
+        vector<pair<Record, uint32_t>> records(part_offsets[threads_count]);
+        parallel_run(threads_count, [&] (uint32_t t) {
+            for (uint32_t k = 0; k < parts[t].size(); k++)
+                records[part_offsets[t] + k] = make_pair(parts[t][k], part_offsets[t] + k);
+            vector<Record>().swap(parts[t]);
+        });
+        parallel_sort(records.begin(), records.end(), [] (const pair<Record, uint32_t>& record1,
+                                                          const pair<Record, uint32_t>& record2) {
+            return record1.first < record2.first;
+        }, threads_count);
+
+        // The records are sorted once, so the context index of the next level
+        // is the position of the record in the sorted order.
+        vector<Record> sorted_records(records.size());
+        vector<uint32_t> positions(i + 1 < max_ngram_size ? records.size() : 0);
+        parallel_for(threads_count, records.size(), [&] (size_t begin, size_t end, uint32_t) {
+            for (size_t k = begin; k < end; k++) {
+                sorted_records[k] = records[k].first;
+                if (!positions.empty())
+                    positions[records[k].second] = uint32_t(k);
+            }
+        });
+        vector<pair<Record, uint32_t>>().swap(records);
+        storage.push_back(CompressedArray(move(sorted_records), options.skip_interval, threads_count));
+
+        if (i + 1 < max_ngram_size)
+            parallel_run(threads_count, [&] (uint32_t t) {
+                for (uint32_t j = bounds[t]; j < bounds[t + 1]; j++)
+                    if (i < FlatNGrams::position_size(sorted_ngrams[j]))
+                        contexts[j] = positions[part_offsets[t] + contexts[j]];
+            });
+    }
+}
+
+NGramStorage::Builder::Builder(const Options& options): options(options) {
+    if (this->options.memory_budget == 0)
+        this->options.memory_budget = default_memory_budget;
+    // words take most of the chunk, ngrams are about four words long
+    chunk.reserve(this->options.memory_budget / 4 * 3 / sizeof(uint32_t));
+    chunk_ngrams.reserve(this->options.memory_budget / 4 / sizeof(size_t));
+}
+
+void NGramStorage::Builder::add(const uint32_t* ngram, uint32_t size, uint32_t count) {
+    assert(size > 0);
+    if (!chunk_ngrams.empty() && (chunk.size() + size + 2 > chunk.capacity() ||
+                                  chunk_ngrams.size() == chunk_ngrams.capacity()))
+        write_run();
+    chunk_ngrams.push_back(chunk.size());
+    chunk.push_back(size);
+    chunk.push_back(count);
+    chunk.insert(chunk.end(), ngram, ngram + size);
+}
+
+size_t NGramStorage::Builder::buffer_size() const {
+    return max<size_t>(min<size_t>(options.memory_budget / 16, 1 << 20), 4096);
+}
+
+void NGramStorage::Builder::sort_chunk() {
+    const vector<uint32_t>& chunk = this->chunk;
+    parallel_sort(chunk_ngrams.begin(), chunk_ngrams.end(), [&chunk] (size_t offset1, size_t offset2) {
+        uint32_t size = min(chunk[offset1], chunk[offset2]);
+        for (uint32_t i = 2; i < size + 2; i++)
+            if (chunk[offset1 + i] != chunk[offset2 + i])
+                return chunk[offset1 + i] < chunk[offset2 + i];
+        return chunk[offset1] < chunk[offset2];
+    }, options.threads_count);
+}
+
+void NGramStorage::Builder::write_run() {
+    sort_chunk();
+    runs.emplace_back(new TempFile<uint32_t>(options.temp_directory, buffer_size()));
+    for (size_t offset : chunk_ngrams)
+        for (uint32_t i = 0; i < chunk[offset] + 2; i++)
+            runs.back()->push_back(chunk[offset + i]);
+    chunk.clear();
+    chunk_ngrams.clear();
+}
+
+vector<unique_ptr<TempFile<NGramStorage::Builder::PrefixRecord>>>
+NGramStorage::Builder::build_prefixes(NGramStorage& storage) {
+    // ngrams in lexicographic order, either from the chunk or merged from the runs
+    if (!runs.empty()) {
+        if (!chunk_ngrams.empty())
+            write_run();
+        vector<uint32_t>().swap(chunk);
+        vector<size_t>().swap(chunk_ngrams);
+    } else {
+        sort_chunk();
+    }
+
+    vector<vector<uint32_t>> heads(runs.size());
+    vector<uint32_t> head_counts(runs.size());
+    vector<uint32_t> heap;
+    auto read_head = [&] (uint32_t run) {
+        uint32_t size;
+        if (!runs[run]->next(size))
+            return false;
+        runs[run]->next(head_counts[run]);
+        heads[run].resize(size);
+        for (uint32_t i = 0; i < size; i++)
+            runs[run]->next(heads[run][i]);
+        return true;
+    };
+    auto heap_less = [&] (uint32_t run1, uint32_t run2) {
+        return IntegerVectorComparator()(heads[run2], heads[run1]);
+    };
+    for (uint32_t run = 0; run < runs.size(); run++) {
+        runs[run]->set_buffer_size(options.memory_budget / runs.size());
+        runs[run]->rewind();
+        if (read_head(run)) {
+            heap.push_back(run);
+            push_heap(heap.begin(), heap.end(), heap_less);
+        }
+    }
+
+    size_t chunk_position = 0;
+    vector<uint32_t> ngram;
+    uint32_t count = 0;
+    auto next_ngram = [&] () {
+        if (runs.empty()) {
+            if (chunk_position == chunk_ngrams.size())
+                return false;
+            size_t offset = chunk_ngrams[chunk_position++];
+            ngram.assign(chunk.begin() + offset + 2, chunk.begin() + offset + 2 + chunk[offset]);
+            count = chunk[offset + 1];
+            return true;
+        }
+        if (heap.empty())
+            return false;
+        pop_heap(heap.begin(), heap.end(), heap_less);
+        uint32_t run = heap.back();
+        heap.pop_back();
+        ngram.swap(heads[run]);
+        count = head_counts[run];
+        if (read_head(run)) {
+            heap.push_back(run);
+            push_heap(heap.begin(), heap.end(), heap_less);
+        }
+        return true;
+    };
+
+    // Prefixes of every size are aggregated while they are open, i.e. are
+    // prefixes of the current ngram, and are written to their level once closed.
+    vector<unique_ptr<TempFile<PrefixRecord>>> prefixes;
+    vector<PrefixRecord> open_prefixes;
+    vector<uint32_t> prefix_counts;
+    vector<uint32_t> prev_continuations;
+    vector<uint32_t> prev_ngram;
+    uint32_t total_count = 0;
+    while (next_ngram()) {
+        uint32_t size = uint32_t(ngram.size());
+        uint32_t common = 0;
+        while (common < prev_ngram.size() && common < size && prev_ngram[common] == ngram[common])
+            common++;
+        for (uint32_t i = common; i < prev_ngram.size(); i++)
+            prefixes[i]->push_back(open_prefixes[i]);
+
+        while (prefixes.size() < size) {
+            prefixes.emplace_back(new TempFile<PrefixRecord>(options.temp_directory, buffer_size()));
+            open_prefixes.push_back(PrefixRecord());
+            prefix_counts.push_back(0);
+            prev_continuations.push_back(0);
+        }
+        for (uint32_t i = common; i < size; i++) {
+            open_prefixes[i].word_index = ngram[i];
+            open_prefixes[i].parent = i > 0 ? prefix_counts[i - 1] - 1 : 0;
+            open_prefixes[i].value = Value(0, 0, 0);
+            prev_continuations[i] = ~uint32_t(0);
+            prefix_counts[i]++;
+        }
+
+        for (uint32_t i = 0; i < size; i++) {
+            Value& value = open_prefixes[i].value;
+            value.ngram_count += count;
+            if (i + 1 < size) {
+                value.continuations_count += count;
+                if (ngram[i + 1] != prev_continuations[i]) {
+                    value.unique_continuations_count += 1;
+                    prev_continuations[i] = ngram[i + 1];
                 }
             }
         }
+        total_count += count;
+        prev_ngram = ngram;
+    }
+    for (uint32_t i = 0; i < prev_ngram.size(); i++)
+        prefixes[i]->push_back(open_prefixes[i]);
+    runs.clear();
+    vector<uint32_t>().swap(chunk);
+    vector<size_t>().swap(chunk_ngrams);
+
+    storage.empty_ngram_count = total_count;
+    storage.empty_ngram_continuations_count = total_count;
+    storage.empty_ngram_unique_continuations_count = prefixes.empty() ? 0 : prefix_counts[0];
+    storage.max_ngram_size = uint8_t(prefixes.size());
+    return prefixes;
+}
 
-        if (prev_word_index != ~uint32_t(0)) {
-            Key key(prev_word_index, prev_context_index);
-            Value value(ngram_count, continuations_count, unique_continuations_count);
-            Record record(key, value);
+void NGramStorage::Builder::build(NGramStorage& storage) {
+    storage.options = options;
+    storage.storage.clear();
+    storage.log_probabilities.clear();
+    storage.cache.clear();
+    vector<unique_ptr<TempFile<PrefixRecord>>> prefixes = build_prefixes(storage);
+
+    // record index of every prefix of the previous level, in the order of prefixes
+    unique_ptr<TempFile<uint32_t>> parent_records;
+    for (uint32_t i = 0; i < storage.max_ngram_size; i++) {
+        ExternalSorter<LevelRecord, std::less<LevelRecord>> records(options.temp_directory,
+                                                                    options.memory_budget / 2);
+        prefixes[i]->rewind();
+        if (parent_records)
+            parent_records->rewind();
+        PrefixRecord prefix;
+        uint32_t prefix_index = 0;
+        uint32_t parent = ~uint32_t(0);
+        uint32_t context_index = 0;
+        while (prefixes[i]->next(prefix)) {
+            while (i > 0 && parent != prefix.parent) {
+                parent_records->next(context_index);
+                parent++;
+            }
+            LevelRecord record;
+            record.record = Record(Key(prefix.word_index, context_index), prefix.value);
+            record.prefix = prefix_index++;
             records.push_back(record);
         }
+        prefixes[i].reset();
+        parent_records.reset();
+        records.sort();
 
-        sort(records.begin(), records.end());
-        storage.push_back(CompressedArray(move(records)));
-
-        if (i + 1 < max_ngram_size) {
-            Key prev_key = Key(~uint32_t(0), ~uint32_t(0));
-            uint32_t prev_key_index = ~uint32_t(0);
-            for (uint32_t j = 0; j < sorted_ngrams.size(); j++)
-                if (i < sorted_ngrams[j].first.size()) {
-                    Key key(sorted_ngrams[j].first[i], contexts[j]);
-                    if (prev_key != key) {
-                        prev_key = key;
-                        prev_key_index = uint32_t(storage[i].find(key) - storage[i].begin());
-                    }
-                    contexts[j] = prev_key_index;
-                }
+        TempFile<Record> sorted_records(options.temp_directory, buffer_size());
+        ExternalSorter<PrefixPosition, std::less<PrefixPosition>> positions(options.temp_directory,
+                                                                            options.memory_budget / 2);
+        LevelRecord record;
+        uint32_t record_index = 0;
+        while (records.next(record)) {
+            sorted_records.push_back(record.record);
+            if (i + 1 < storage.max_ngram_size) {
+                PrefixPosition position;
+                position.prefix = record.prefix;
+                position.record_index = record_index;
+                positions.push_back(position);
+            }
+            record_index++;
+        }
+        storage.storage.push_back(CompressedArray(sorted_records, options.skip_interval));
+
+        if (i + 1 < storage.max_ngram_size) {
+            positions.sort();
+            parent_records.reset(new TempFile<uint32_t>(options.temp_directory, buffer_size()));
+            PrefixPosition position;
+            while (positions.next(position))
+                parent_records->push_back(position.record_index);
         }
     }
+    storage.reset_block_cache();
+    if (options.log_probabilities)
+        storage.compute_log_probabilities(options.delta, options.eps, options.probability_bits);
+}
+
+NGramStorage::Reader::Reader(const NGramStorage* storage, size_t cache_size):
+        storage(storage), cache(cache_size) {}
+
+Value NGramStorage::Reader::get_value(const vector<uint32_t>& ngram) {
+    return storage->get_value(ngram, cache);
+}
+
+uint32_t NGramStorage::Reader::get_ngram_count(const vector<uint32_t>& ngram) {
+    return get_value(ngram).ngram_count;
+}
+
+uint32_t NGramStorage::Reader::get_continuations_count(const vector<uint32_t>& ngram) {
+    return get_value(ngram).continuations_count;
+}
+
+uint32_t NGramStorage::Reader::get_unique_continuations_count(const vector<uint32_t>& ngram) {
+    return get_value(ngram).unique_continuations_count;
+}
+
+const ContextCache& NGramStorage::Reader::get_cache() const {
+    return cache;
+}
+
+NGramStorage::Reader NGramStorage::get_reader(size_t cache_size) const {
+    return Reader(this, cache_size);
 }
 
 NGramStorage::const_iterator::const_iterator(const NGramStorage* storage, uint8_t ngram_size):
@@ -253,11 +1044,11 @@ NGramStorage::const_iterator::const_iterator(const NGramStorage* storage, uint8_
     }
 }
 
-NGramStorage::const_iterator NGramStorage::begin(uint8_t ngram_size) {
+NGramStorage::const_iterator NGramStorage::begin(uint8_t ngram_size) const {
     return const_iterator(this, ngram_size);
 }
 
-NGramStorage::const_iterator NGramStorage::end(uint8_t ngram_size) {
+NGramStorage::const_iterator NGramStorage::end(uint8_t ngram_size) const {
     const_iterator res(this, ngram_size);
     res.cursor.clear();
     res.cursor.push_back(storage[ngram_size - 1].end());
@@ -300,3 +1091,7 @@ bool NGramStorage::const_iterator::operator==(const NGramStorage::const_iterator
 bool NGramStorage::const_iterator::operator!=(const NGramStorage::const_iterator& other) const {
     return ngram_size != other.ngram_size || cursor[0] != other.cursor[0];
 }
+
+uint32_t NGramStorage::const_iterator::index() const {
+    return cursor[0].index();
+}
@@ -10,8 +10,11 @@
 #include <fstream>
 #include <sstream>
 #include <queue>
+#include <array>
 
 #include "CompressedArray.h"
+#include "LogProbabilityArray.h"
+#include "FlatNGrams.h"
 #include "Cache.h"
 
 using std::set;
@@ -47,25 +50,225 @@ public:
 
 class NGramStorage: public Serializable {
 public:
+    struct Options {
+        Options(): skip_interval(0), threads_count(1), memory_budget(0), temp_directory("/tmp"),
+                   log_probabilities(false), delta(0.75f), eps(1.0f), probability_bits(0),
+                   frequency_word_order(false) {}
+
+        // sampling interval inside blocks, see CompressedArray
+        uint32_t skip_interval;
+        // threads used by init, the built storage does not depend on it
+        uint32_t threads_count;
+        // bytes of ngrams the file constructor keeps in memory, see Builder.
+        // 0 loads the whole file, Builder then uses its default budget.
+        size_t memory_budget;
+        string temp_directory;
+        // precompute log probabilities of the model with delta and eps, see compute_log_probabilities
+        bool log_probabilities;
+        float delta;
+        float eps;
+        // bits of a quantized log probability and backoff, see LogProbabilityArray. 0 keeps floats
+        uint32_t probability_bits;
+        // load_text_counts and load_arpa number words by descending unigram count (log probability
+        // for ARPA), so that frequent words get short keys. The vocabulary then keeps a table of indices
+        bool frequency_word_order;
+    };
+
+    // Builds a storage from ngrams added one by one. About options.memory_budget
+    // bytes of them are kept in memory, sorted runs of the rest are written to
+    // options.temp_directory and merged, and every level is encoded from a file.
+    // The result is the same as init with all the ngrams.
+    class Builder {
+    public:
+        Builder(const Options& options);
+
+        void add(const uint32_t* ngram, uint32_t size, uint32_t count);
+        void build(NGramStorage& storage);
+
+    private:
+        // prefix of an ngram, parent is the number of its own prefix in the previous level
+        struct PrefixRecord {
+            uint32_t word_index;
+            uint32_t parent;
+            Value value;
+        };
+
+        // record of a level with the number of its prefix
+        struct LevelRecord {
+            Record record;
+            uint32_t prefix;
+
+            bool operator<(const LevelRecord& other) const {
+                return record < other.record;
+            }
+        };
+
+        struct PrefixPosition {
+            uint32_t prefix;
+            uint32_t record_index;
+
+            bool operator<(const PrefixPosition& other) const {
+                return prefix < other.prefix;
+            }
+        };
+
+        static const size_t default_memory_budget;
+
+        Options options;
+        // size, count and words of every ngram in memory
+        vector<uint32_t> chunk;
+        vector<size_t> chunk_ngrams;
+        vector<unique_ptr<TempFile<uint32_t>>> runs;
+
+        size_t buffer_size() const;
+        void sort_chunk();
+        void write_run();
+        vector<unique_ptr<TempFile<PrefixRecord>>> build_prefixes(NGramStorage& storage);
+    };
+
     NGramStorage();
-    NGramStorage(vector<pair<vector<uint32_t>, uint32_t>>& ngrams);
-    NGramStorage(string filename);
+    NGramStorage(vector<pair<vector<uint32_t>, uint32_t>>& ngrams, const Options& options = Options());
+    NGramStorage(FlatNGrams& ngrams, const Options& options = Options());
+    NGramStorage(string filename, const Options& options = Options());
 
-    void init(vector<pair<vector<uint32_t>, uint32_t>>& ngrams);
+    void init(vector<pair<vector<uint32_t>, uint32_t>>& ngrams, const Options& options = Options());
+    // Same as above without a heap allocation per ngram. The arrays of ngrams get sorted.
+    void init(FlatNGrams& ngrams, const Options& options = Options());
+    void init(const string& filename, const Options& options = Options());
 
     void load(istream& in) override;
     void dump(ostream& out) const override;
 
-    uint32_t get_ngram_count(const vector<uint32_t>& ngram);
-    uint32_t get_continuations_count(const vector<uint32_t>& ngram);
-    uint32_t get_unique_continuations_count(const vector<uint32_t>& ngram);
+    void load_mapped(const string& filename);
+    void dump_mapped(const string& filename) const;
+
+    // Record indices of the contexts are kept in the context cache, so that ngrams
+    // sharing a context are found with one lookup in the last level.
+    Value get_value(const vector<uint32_t>& ngram) const;
+    uint32_t get_ngram_count(const vector<uint32_t>& ngram) const;
+    uint32_t get_continuations_count(const vector<uint32_t>& ngram) const;
+    uint32_t get_unique_continuations_count(const vector<uint32_t>& ngram) const;
+
+    // Same queries without heap allocations. They bypass the context cache.
+    Value get_value(const uint32_t* ngram, uint32_t size) const;
+    uint32_t get_ngram_count(const uint32_t* ngram, uint32_t size) const;
+    uint32_t get_continuations_count(const uint32_t* ngram, uint32_t size) const;
+    uint32_t get_unique_continuations_count(const uint32_t* ngram, uint32_t size) const;
+
+    template <size_t size>
+    Value get_value(const std::array<uint32_t, size>& ngram) const {
+        return get_value(ngram.data(), uint32_t(size));
+    }
+
+    // Values of count ngrams of the same size stored one after another in ngrams.
+    // Lookups of different ngrams are interleaved with CompressedArray::find_batch.
+    void get_values(const uint32_t* ngrams, uint32_t ngram_size, uint32_t count, Value* values) const;
 
     uint8_t get_max_ngram_size() const;
+    // number of stored ngrams of the size, including prefixes of the longer ones
+    uint32_t get_ngrams_count(uint8_t ngram_size) const;
+    // records of the ngrams of the size, keyed by the last word and the record index of the prefix
+    const CompressedArray& get_level(uint8_t ngram_size) const;
+
+    // Record index of an ngram in the level of its size, see const_iterator::index.
+    bool find_index(const uint32_t* ngram, uint32_t size, uint32_t& index) const;
+    // Record indices of count ngrams stored like in get_values, CompressedArray::not_found
+    // for the missing ones.
+    void find_indices(const uint32_t* ngrams, uint32_t ngram_size, uint32_t count, uint32_t* indices) const;
+
+    // Storages built from ARPA files or with options.log_probabilities keep a log probability
+    // and a backoff for every record, records of ngrams missing from an ARPA file have a NaN log_prob.
+    bool has_log_probabilities() const;
+    void set_log_probabilities(vector<vector<LogProbability>> log_probabilities,
+                               float unknown_word_log_prob, uint32_t bits_count = 0);
+    // Same for one level, so that the floats of the other levels need not be kept meanwhile.
+    // Levels that are not set yet are empty.
+    void set_log_probabilities(uint8_t ngram_size, const vector<LogProbability>& log_probabilities,
+                               float unknown_word_log_prob, uint32_t bits_count = 0);
+    LogProbability get_log_probability(uint8_t ngram_size, uint32_t index) const;
+    bool get_log_probability(const uint32_t* ngram, uint32_t size, LogProbability& probability) const;
+
+    // Stores log probabilities of the model of language_model.py, which interpolates
+    // discounted counts of an ngram with the probability of its shorter suffix:
+    // P(w | c) = max(0, count(c w) - delta) / C(c) + delta * U(c) / C(c) * P(w | c[1:]),
+    // where C and U are the continuation counts. Contexts with C(c) < 10 are skipped.
+    // For an unknown word P(w | ()) = delta * eps / C(()). The backoff of c is then
+    // delta * U(c) / C(c), so that get_word_log_prob gives the same probabilities.
+    void compute_log_probabilities(float delta, float eps, uint32_t bits_count = 0);
+
+    // Log10 probability of the last word of an ngram after the other words: the log probability
+    // of the longest stored suffix plus the backoffs of the longer contexts. Stored ngrams
+    // take one walk. Words may be unknown, e.g. ~0.
+    float get_word_log_prob(const uint32_t* ngram, uint32_t size) const;
+
+    // Keeps decoded blocks of all levels, up to about capacity bytes, for the lookups of all
+    // threads, see BlockCache. 0 turns the cache off. The cache starts empty whenever
+    // the storage is built or loaded. Copies of a storage share its cache until one of them
+    // is built or loaded again, their blocks are the same.
+    void set_block_cache_capacity(size_t capacity);
+    // nullptr when the cache is off
+    const BlockCache* get_block_cache() const;
+
+    struct MemoryReport {
+        // levels[i] describes the ngrams of size i + 1
+        vector<CompressedArray::MemoryReport> levels;
+        // bytes of the log probabilities of the levels, empty without them
+        vector<size_t> log_probabilities_bytes;
+
+        uint64_t ngrams_count() const;
+        size_t total_bytes() const;
+        double bytes_per_ngram() const;
+    };
+
+    // Bytes of the levels and of their parts, see CompressedArray::memory_report.
+    MemoryReport memory_report() const;
+
+    // Number of contexts in the cache of the vector queries, which all threads share,
+    // see ContextCache. 0 turns the cache off.
+    void set_context_cache_capacity(size_t capacity);
+    const ContextCache& get_context_cache() const;
+
+    // Suffix of a word sequence: indices[i] and values[i] describe the ngram made of
+    // the last i + 1 words, indices[i] is CompressedArray::not_found and values[i] is zero
+    // when it is not stored. A longer ngram may be stored while a shorter one is not.
+    // Only the first `size` entries are valid. States follow every order up to max_size,
+    // get_empty_state and get_state throw std::runtime_error for longer ngrams.
+    struct State {
+        static const uint8_t max_size = 16;
+
+        uint8_t size;
+        uint32_t indices[max_size];
+        Value values[max_size];
+    };
+
+    State get_empty_state() const;
+    State get_state(const vector<uint32_t>& context) const;
+    void advance(const State& state, uint32_t word_index, State& next_state) const;
+
+    // Query interface for one thread. Any number of readers may share a storage
+    // as long as nobody modifies it, each of them keeps its own context cache.
+    class Reader {
+    public:
+        Reader(const NGramStorage* storage, size_t cache_size = ContextCache::default_capacity);
+
+        Value get_value(const vector<uint32_t>& ngram);
+        uint32_t get_ngram_count(const vector<uint32_t>& ngram);
+        uint32_t get_continuations_count(const vector<uint32_t>& ngram);
+        uint32_t get_unique_continuations_count(const vector<uint32_t>& ngram);
+
+        const ContextCache& get_cache() const;
+
+    private:
+        const NGramStorage* storage;
+        ContextCache cache;
+    };
+
+    Reader get_reader(size_t cache_size = ContextCache::default_capacity) const;
 
     class const_iterator;
 
-    const_iterator begin(uint8_t ngram_size);
-    const_iterator end(uint8_t ngram_size);
+    const_iterator begin(uint8_t ngram_size) const;
+    const_iterator end(uint8_t ngram_size) const;
 
     class const_iterator {
     public:
@@ -78,6 +281,8 @@ public:
         const pair<vector<uint32_t>, uint32_t>* operator->() const;
         bool operator==(const const_iterator& other) const;
         bool operator!=(const const_iterator& other) const;
+        // record index of the current ngram in its level
+        uint32_t index() const;
 
         friend class NGramStorage;
 
@@ -89,21 +294,44 @@ public:
     };
 
 private:
+    static const char stream_magic[8];
+    static const uint32_t stream_version;
+    static const char mapped_magic[8];
+    static const uint32_t mapped_version;
+    static const uint32_t batch_size;
+
+    Options options;
     uint8_t max_ngram_size;
     vector<CompressedArray> storage;
-    LRUCache<vector<uint32_t>, uint32_t, IntegerVectorHasher> cache;
+    vector<LogProbabilityArray> log_probabilities;
+    float unknown_word_log_prob;
+    mutable ContextCache cache;
+    shared_ptr<BlockCache> block_cache;
     uint32_t empty_ngram_count;
     uint32_t empty_ngram_continuations_count;
     uint32_t empty_ngram_unique_continuations_count;
 
-    void store_empty_ngram_values(const vector<pair<vector<uint32_t>, uint32_t>>& ngrams);
-    void store_max_ngram_size(const vector<pair<vector<uint32_t>, uint32_t>>& ngrams);
-    void sort_ngrams(vector<pair<vector<uint32_t>, uint32_t>>& ngrams) const;
-    void build_storage(const vector<pair<vector<uint32_t>, uint32_t>>& sorted_ngrams);
+    void store_empty_ngram_values(const FlatNGrams& ngrams);
+    void reset_block_cache();
+    // sorted_ngrams are positions of all ngrams in lexicographic order, see FlatNGrams::merge
+    void build_storage(const FlatNGrams& ngrams, const vector<uint64_t>& sorted_ngrams);
+    uint32_t find_group_start(const FlatNGrams& ngrams, const vector<uint64_t>& sorted_ngrams,
+                              const vector<uint32_t>& contexts, uint32_t level, uint32_t index) const;
+    void aggregate_records(const FlatNGrams& ngrams, const vector<uint64_t>& sorted_ngrams,
+                           vector<uint32_t>& contexts, uint32_t level,
+                           uint32_t begin, uint32_t end, vector<Record>& records) const;
+
+    bool get_context_index(const uint32_t* ngram, uint32_t size, ContextCache& cache,
+                           uint32_t& context_index) const;
+    bool get_context_index(const uint32_t* ngram, uint32_t size, uint32_t& context_index) const;
 
-    uint32_t get_context_index(const vector<uint32_t>& ngram);
+    bool find_record(const vector<uint32_t>& ngram, ContextCache& cache, Record& record) const;
+    bool find_record(const uint32_t* ngram, uint32_t size, Record& record) const;
 
-    Record find_record(const vector<uint32_t>& ngram);
+    Value get_value(const vector<uint32_t>& ngram, ContextCache& cache) const;
+    // indices or values may be nullptr
+    void find_batch(const uint32_t* ngrams, uint32_t ngram_size, uint32_t count,
+                    uint32_t* indices, Value* values) const;
 };
 
 
@@ -0,0 +1,86 @@
+#ifndef NGRAMSTORAGE_PARALLEL_H
+#define NGRAMSTORAGE_PARALLEL_H
+
+#include <cstdint>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+using std::vector;
+using std::thread;
+
+
+// Calls function(thread_index) for every thread_index < threads_count,
+// the first one on the calling thread. An exception of any of the calls
+// is rethrown after all of them finish.
+template <class Function>
+void parallel_run(uint32_t threads_count, Function function) {
+    vector<std::exception_ptr> errors(std::max<uint32_t>(threads_count, 1));
+    auto run = [&] (uint32_t t) {
+        try {
+            function(t);
+        } catch (...) {
+            errors[t] = std::current_exception();
+        }
+    };
+    vector<thread> threads;
+    for (uint32_t t = 1; t < threads_count; t++)
+        threads.push_back(thread(run, t));
+    run(0);
+    for (thread& t : threads)
+        t.join();
+    for (const std::exception_ptr& error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+// Splits [0, size) into threads_count consecutive ranges and calls
+// function(begin, end, thread_index) for each of them in parallel.
+template <class Function>
+void parallel_for(uint32_t threads_count, size_t size, Function function) {
+    threads_count = std::max<uint32_t>(1, uint32_t(std::min<size_t>(threads_count, size)));
+    parallel_run(threads_count, [&] (uint32_t t) {
+        function(size * t / threads_count, size * (t + 1) / threads_count, t);
+    });
+}
+
+// Sorts the ranges of parallel_for and merges them pairwise.
+template <class Iterator, class Compare>
+void parallel_sort(Iterator first, Iterator last, Compare compare, uint32_t threads_count) {
+    size_t size = size_t(last - first);
+    if (threads_count <= 1 || size < 2 * threads_count) {
+        std::sort(first, last, compare);
+        return;
+    }
+
+    vector<size_t> bounds(threads_count + 1);
+    for (uint32_t t = 0; t <= threads_count; t++)
+        bounds[t] = size * t / threads_count;
+    parallel_run(threads_count, [&] (uint32_t t) {
+        std::sort(first + bounds[t], first + bounds[t + 1], compare);
+    });
+
+    for (size_t step = 1; step < threads_count; step *= 2) {
+        uint32_t merges_count = uint32_t((threads_count + 2 * step - 1) / (2 * step));
+        parallel_run(merges_count, [&] (uint32_t m) {
+            size_t begin = 2 * step * m;
+            size_t middle = std::min<size_t>(begin + step, threads_count);
+            size_t end = std::min<size_t>(begin + 2 * step, threads_count);
+            if (middle < end)
+                std::inplace_merge(first + bounds[begin], first + bounds[middle],
+                                   first + bounds[end], compare);
+        });
+    }
+}
+
+template <class Iterator>
+void parallel_sort(Iterator first, Iterator last, uint32_t threads_count) {
+    parallel_sort(first, last, std::less<typename std::iterator_traits<Iterator>::value_type>(),
+                  threads_count);
+}
+
+
+#endif //NGRAMSTORAGE_PARALLEL_H
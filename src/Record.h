@@ -43,6 +43,17 @@ struct Value {
 };
 
 
+// Log10 probability of an ngram and log10 backoff weight of the ngram as a context,
+// as in ARPA files.
+struct LogProbability {
+    LogProbability() {}
+    LogProbability(float log_prob, float backoff): log_prob(log_prob), backoff(backoff) {}
+
+    float log_prob;
+    float backoff;
+};
+
+
 struct Record {
     Record() {}
     Record(Key key, Value value): key(key), value(value) {}
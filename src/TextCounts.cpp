@@ -0,0 +1,137 @@
+#include "TextCounts.h"
+#include "Parallel.h"
+
+#include <cstring>
+
+typedef pair<const char*, uint32_t> Token;
+
+static bool is_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Calls function(count, words, ngram_size) for every non-empty line of [begin, end).
+template <class Function>
+static void parse_lines(const char* begin, const char* end, Function function) {
+    vector<Token> tokens;
+    while (begin < end) {
+        const char* line_end = (const char*)memchr(begin, '\n', size_t(end - begin));
+        if (line_end == nullptr)
+            line_end = end;
+
+        tokens.clear();
+        for (const char* position = begin; position < line_end; ) {
+            while (position < line_end && is_separator(*position))
+                position++;
+            const char* token = position;
+            while (position < line_end && !is_separator(*position))
+                position++;
+            if (position > token)
+                tokens.push_back(Token(token, uint32_t(position - token)));
+        }
+
+        if (!tokens.empty()) {
+            uint64_t count = 0;
+            for (uint32_t i = 0; i < tokens[0].second; i++) {
+                char digit = tokens[0].first[i];
+                if (digit < '0' || digit > '9' || (count = count * 10 + uint64_t(digit - '0')) > ~uint32_t(0))
+                    throw std::runtime_error("bad count in line \"" + string(begin, line_end) + "\"");
+            }
+            if (tokens.size() < 2 || tokens.size() > 256)
+                throw std::runtime_error("bad ngram size in line \"" + string(begin, line_end) + "\"");
+            function(uint32_t(count), tokens.data() + 1, uint32_t(tokens.size() - 1));
+        }
+        begin = line_end + 1;
+    }
+}
+
+void load_text_counts(const string& filename, Vocabulary<string>& vocabulary, NGramStorage& storage,
+                      const NGramStorage::Options& options) {
+    MemoryMap file(filename);
+    const char* data = file.data();
+    uint32_t threads_count = std::max<uint32_t>(options.threads_count, 1);
+
+    vector<const char*> bounds(threads_count + 1, data);
+    for (uint32_t t = 1; t <= threads_count; t++) {
+        size_t position = std::max<size_t>(file.size() * t / threads_count, size_t(bounds[t - 1] - data));
+        while (position > 0 && position < file.size() && data[position - 1] != '\n')
+            position++;
+        bounds[t] = data + position;
+    }
+
+    // distinct words with the counts of the ngrams they start and number of ngrams of every size in every part
+    vector<unordered_map<string, uint64_t>> words(threads_count);
+    vector<vector<size_t>> sizes(threads_count);
+    parallel_run(threads_count, [&] (uint32_t t) {
+        string word;
+        parse_lines(bounds[t], bounds[t + 1], [&] (uint32_t count, const Token* ngram, uint32_t ngram_size) {
+            if (sizes[t].size() < ngram_size)
+                sizes[t].resize(ngram_size, 0);
+            sizes[t][ngram_size - 1]++;
+            for (uint32_t i = 0; i < ngram_size; i++) {
+                word.assign(ngram[i].first, ngram[i].second);
+                uint64_t& word_count = words[t][word];
+                if (i == 0)
+                    word_count += count;
+            }
+        });
+    });
+
+    for (uint32_t t = 1; t < threads_count; t++) {
+        for (auto& word : words[t])
+            words[0][word.first] += word.second;
+        unordered_map<string, uint64_t>().swap(words[t]);
+    }
+    vector<pair<uint64_t, string>> counted_words;
+    counted_words.reserve(words[0].size());
+    for (auto& word : words[0])
+        counted_words.push_back(make_pair(word.second, word.first));
+    unordered_map<string, uint64_t>().swap(words[0]);
+    if (options.frequency_word_order)
+        sort(counted_words.begin(), counted_words.end(), [] (const pair<uint64_t, string>& a,
+                                                             const pair<uint64_t, string>& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+    vector<string> all_words;
+    all_words.reserve(counted_words.size());
+    for (auto& word : counted_words)
+        all_words.push_back(std::move(word.second));
+    vector<pair<uint64_t, string>>().swap(counted_words);
+    vocabulary = Vocabulary<string>(all_words, options.frequency_word_order);
+    vector<string>().swap(all_words);
+
+    // every part writes its ngrams right after the ngrams of the same size of the previous parts
+    size_t max_ngram_size = 0;
+    for (const vector<size_t>& part_sizes : sizes)
+        max_ngram_size = std::max(max_ngram_size, part_sizes.size());
+    FlatNGrams ngrams;
+    vector<uint32_t*> word_tables(max_ngram_size);
+    vector<uint32_t*> count_tables(max_ngram_size);
+    vector<vector<size_t>> offsets(threads_count, vector<size_t>(max_ngram_size, 0));
+    for (uint32_t ngram_size = 1; ngram_size <= max_ngram_size; ngram_size++) {
+        size_t total = 0;
+        for (uint32_t t = 0; t < threads_count; t++) {
+            offsets[t][ngram_size - 1] = total;
+            if (ngram_size <= sizes[t].size())
+                total += sizes[t][ngram_size - 1];
+        }
+        ngrams.words(ngram_size).resize(total * ngram_size);
+        ngrams.counts(ngram_size).resize(total);
+        word_tables[ngram_size - 1] = ngrams.words(ngram_size).data();
+        count_tables[ngram_size - 1] = ngrams.counts(ngram_size).data();
+    }
+
+    parallel_run(threads_count, [&] (uint32_t t) {
+        string word;
+        parse_lines(bounds[t], bounds[t + 1], [&] (uint32_t count, const Token* ngram, uint32_t ngram_size) {
+            size_t row = offsets[t][ngram_size - 1]++;
+            uint32_t* encoded_ngram = word_tables[ngram_size - 1] + row * ngram_size;
+            for (uint32_t i = 0; i < ngram_size; i++) {
+                word.assign(ngram[i].first, ngram[i].second);
+                encoded_ngram[i] = vocabulary.get_index(word);
+            }
+            count_tables[ngram_size - 1][row] = count;
+        });
+    });
+
+    storage.init(ngrams, options);
+}
@@ -0,0 +1,16 @@
+#ifndef NGRAMSTORAGE_TEXTCOUNTS_H
+#define NGRAMSTORAGE_TEXTCOUNTS_H
+
+#include "NGramStorage.h"
+#include "Vocabulary.h"
+
+
+// Builds vocabulary and storage from a text file with a line "count word1 word2 ..."
+// per ngram, words are separated by spaces or tabs. The file is mapped to memory,
+// split into options.threads_count parts at line ends, and the parts are
+// tokenized and encoded in parallel. Throws std::runtime_error on a bad line.
+void load_text_counts(const string& filename, Vocabulary<string>& vocabulary, NGramStorage& storage,
+                      const NGramStorage::Options& options = NGramStorage::Options());
+
+
+#endif //NGRAMSTORAGE_TEXTCOUNTS_H
@@ -6,6 +6,7 @@
 #define VOCABULARY_H
 
 #include "Serializable.h"
+#include "MemoryMap.h"
 #include "BBHash/BooPHF.h"
 
 #include <algorithm>
@@ -14,6 +15,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <assert.h>
+#include <stdexcept>
 #include <iostream>
 
 using std::string;
@@ -54,11 +56,12 @@ class Vocabulary: public Serializable {
 public:
     Vocabulary() {}
 
-    Vocabulary(const vector<PrimitiveType>& words): words(words) {
+    Vocabulary(const vector<PrimitiveType>& words) {
         assert(words.size() < (~uint32_t(0)));
-        sort(this->words.begin(), this->words.end());
-        auto words_end = unique(this->words.begin(), this->words.end());
-        vector<PrimitiveType>(this->words.begin(), words_end).swap(this->words);
+        vector<PrimitiveType> unique_words(words);
+        sort(unique_words.begin(), unique_words.end());
+        auto words_end = unique(unique_words.begin(), unique_words.end());
+        this->words = MappedArray<PrimitiveType>(vector<PrimitiveType>(unique_words.begin(), words_end));
     }
 
     void dump(ostream& out) const override {
@@ -76,6 +79,14 @@ public:
             in.read((char*)(&words[i]), sizeof(words[i]));
     }
 
+    void dump_mapped(ostream& out) const {
+        write_mapped_array(out, words.data(), words.size());
+    }
+
+    void load_mapped(MappedReader& in) {
+        words = in.read_array<PrimitiveType>();
+    }
+
     uint32_t get_index(const PrimitiveType& word) const {
         auto it = lower_bound(words.begin(), words.end(), word);
         if (it == words.end() || *it != word)
@@ -91,19 +102,23 @@ public:
         return words.size();
     }
 
+    size_t memory_size() const {
+        return words.size() * sizeof(PrimitiveType);
+    }
+
     const PrimitiveType& operator [] (uint32_t index) const {
         return get_word(index);
     }
 
-    typename vector<PrimitiveType>::const_iterator begin() const {
+    const PrimitiveType* begin() const {
         return words.begin();
     }
 
-    typename vector<PrimitiveType>::const_iterator end() const {
+    const PrimitiveType* end() const {
         return words.end();
     }
 
-    typename vector<PrimitiveType>::const_iterator find(const PrimitiveType& word) const {
+    const PrimitiveType* find(const PrimitiveType& word) const {
         auto it = lower_bound(begin(), end(), word);
         if (it != end() && *it == word)
             return it;
@@ -112,7 +127,7 @@ public:
     }
 
 private:
-    vector<PrimitiveType> words;
+    MappedArray<PrimitiveType> words;
 };
 
 
@@ -121,11 +136,21 @@ class Vocabulary<string>: public Serializable {
 public:
     Vocabulary() {}
 
-    Vocabulary(const vector<string> &words) {
+    // Indices follow the order of the perfect hash function. With keep_order the words must be
+    // distinct and get their positions in words as indices, which costs a table of indices.
+    // Throws std::invalid_argument if keep_order is set and a word repeats.
+    Vocabulary(const vector<string> &words, bool keep_order = false) {
         vector<string> unique_words(words);
         sort(unique_words.begin(), unique_words.end());
-        auto it = unique(unique_words.begin(), unique_words.end());
-        unique_words.resize(size_t(it - unique_words.begin()));
+        if (keep_order) {
+            auto it = std::adjacent_find(unique_words.begin(), unique_words.end());
+            if (it != unique_words.end())
+                throw std::invalid_argument("word \"" + *it + "\" repeats in a vocabulary that keeps the order");
+            unique_words = words;
+        } else {
+            auto it = unique(unique_words.begin(), unique_words.end());
+            unique_words.resize(size_t(it - unique_words.begin()));
+        }
 
         assert(unique_words.size() < (~uint32_t(0)));
 
@@ -138,11 +163,19 @@ public:
         mphf = BooPHF(hashes.size(), hashes, 8, 2.0, true, false);
 
         uint64_t data_size = 0;
-        vector<string> reordered_words(unique_words.size());
-        for (size_t i = 0; i < unique_words.size(); i++) {
-            reordered_words[mphf.lookup(hashes[i])] = unique_words[i];
-            data_size += unique_words[i].length();
+        vector<string> reordered_words;
+        if (keep_order) {
+            indices.resize(unique_words.size());
+            for (size_t i = 0; i < unique_words.size(); i++)
+                indices[mphf.lookup(hashes[i])] = uint32_t(i);
+            reordered_words.swap(unique_words);
+        } else {
+            reordered_words.resize(unique_words.size());
+            for (size_t i = 0; i < unique_words.size(); i++)
+                reordered_words[mphf.lookup(hashes[i])] = unique_words[i];
         }
+        for (const string& word : reordered_words)
+            data_size += word.length();
         unique_words.clear();
         hashes.clear();
 
@@ -159,6 +192,11 @@ public:
     }
 
     void dump(ostream &out) const override {
+        uint32_t marker = format_marker;
+        uint32_t version = format_version;
+        out.write((char *) (&marker), sizeof(marker));
+        out.write((char *) (&version), sizeof(version));
+
         uint32_t data_size = uint32_t(data.length());
         out.write((char *) (&data_size), sizeof(data_size));
         out.write(data.data(), data_size);
@@ -168,11 +206,28 @@ public:
         out.write((char *) (offsets.data()), offsets_size * sizeof(decltype(*offsets.begin())));
 
         mphf.save(out);
+
+        uint8_t has_indices = !indices.empty();
+        out.write((char *) (&has_indices), sizeof(has_indices));
+        if (has_indices) {
+            uint32_t indices_size = uint32_t(indices.size());
+            out.write((char *) (&indices_size), sizeof(indices_size));
+            out.write((char *) (indices.data()), indices_size * sizeof(uint32_t));
+        }
     }
 
     void load(istream &in) override {
+        // Untagged dumps start with data_size, which is always below format_marker.
+        // They come from before keep_order and have no table of indices.
         uint32_t data_size;
+        uint32_t version = 1;
         in.read((char *) (&data_size), sizeof(data_size));
+        if (data_size == format_marker) {
+            in.read((char *) (&version), sizeof(version));
+            if (version > format_version)
+                throw std::runtime_error("unsupported vocabulary version");
+            in.read((char *) (&data_size), sizeof(data_size));
+        }
         char *data_buffer = new char[data_size];
         in.read(data_buffer, data_size);
         data = string(data_buffer, data_size);
@@ -187,6 +242,17 @@ public:
         offsets.shrink_to_fit();
 
         mphf.load(in);
+
+        indices.clear();
+        uint8_t has_indices = 0;
+        if (version >= 2)
+            in.read((char *) (&has_indices), sizeof(has_indices));
+        if (has_indices) {
+            uint32_t indices_size;
+            in.read((char *) (&indices_size), sizeof(indices_size));
+            indices.resize(indices_size);
+            in.read((char *) (indices.data()), indices_size * sizeof(uint32_t));
+        }
     }
 
     uint32_t get_index(const string &word) {
@@ -225,7 +291,9 @@ public:
 
         if (index == ULLONG_MAX)
             return end();
-        if (string(data.data() + offsets[index], offsets[index + 1] - offsets[index]) != word)
+        if (!indices.empty())
+            index = indices[index];
+        if (data.compare(offsets[index], offsets[index + 1] - offsets[index], word) != 0)
             return end();
 
         return begin() + index;
@@ -327,9 +395,15 @@ public:
     };
 
 private:
+    static const uint32_t format_marker = ~uint32_t(0);
+    // 2: a flag of the table of indices after mphf
+    static const uint32_t format_version = 2;
+
     string data;
     vector<uint32_t> offsets;
     BooPHF mphf;
+    // index of the word of every value of mphf, empty when they are the same
+    vector<uint32_t> indices;
 };
 
 
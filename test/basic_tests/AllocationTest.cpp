@@ -0,0 +1,90 @@
+#include "gtest/gtest.h"
+#include "NGramStorage.h"
+
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+uint64_t allocations_count = 0;
+
+void* operator new(size_t size) {
+    allocations_count++;
+    void* ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr)
+        throw bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+uint64_t seed = 0;
+uint64_t prng() {
+    seed = (seed * 123456789 + 12345);
+    return seed;
+}
+
+vector<pair<vector<uint32_t>, uint32_t>> create_ngrams() {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams;
+    for (int i = 0; i < 10000; i++) {
+        vector<uint32_t> ngram;
+        for (int j = 0; j < 3; j++)
+            ngram.push_back(uint32_t(prng() % 26));
+        ngrams.push_back(make_pair(ngram, prng() % 10 + 1));
+    }
+    return ngrams;
+}
+
+TEST(allocation_check, pointer_query_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = create_ngrams();
+    NGramStorage storage(ngrams);
+
+    vector<uint32_t> queries;
+    for (int i = 0; i < 3 * 100000; i++)
+        queries.push_back(uint32_t(prng() % 30));
+
+    uint64_t found = 0;
+    uint64_t allocations_before = allocations_count;
+    for (uint32_t i = 0; i + 3 <= queries.size(); i += 3)
+        for (uint32_t size = 1; size <= 4; size++) {
+            Value value = storage.get_value(queries.data() + i, size);
+            found += value.ngram_count > 0;
+            found += storage.get_ngram_count(queries.data() + i, size) > 0;
+        }
+    array<uint32_t, 3> ngram = {{1, 2, 3}};
+    found += storage.get_value(ngram).ngram_count;
+    Value values[1000];
+    storage.get_values(queries.data(), 3, 1000, values);
+    found += values[0].ngram_count;
+
+    ASSERT_EQ(allocations_count - allocations_before, 0u);
+    ASSERT_GT(found, 0u);
+
+    allocations_before = allocations_count;
+    storage.get_value(vector<uint32_t>(queries.begin(), queries.begin() + 3));
+    ASSERT_GT(allocations_count - allocations_before, 0u);
+}
+
+TEST(allocation_check, state_query_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = create_ngrams();
+    NGramStorage storage(ngrams);
+
+    uint64_t found = 0;
+    uint64_t allocations_before = allocations_count;
+    NGramStorage::State state = storage.get_empty_state();
+    for (int i = 0; i < 100000; i++) {
+        NGramStorage::State next_state;
+        storage.advance(state, uint32_t(prng() % 30), next_state);
+        state = next_state;
+        found += state.size;
+    }
+
+    ASSERT_EQ(allocations_count - allocations_before, 0u);
+    ASSERT_GT(found, 0u);
+}
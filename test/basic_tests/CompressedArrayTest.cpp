@@ -6,6 +6,7 @@
 #include "CompressedArray.h"
 
 #include <sstream>
+#include <thread>
 
 using namespace std;
 
@@ -33,6 +34,32 @@ bool search(const vector<Record>& records, const CompressedArray& array) {
     return found;
 }
 
+bool search_batch(const vector<Record>& records, const CompressedArray& array) {
+    vector<Key> keys;
+    for (uint32_t i = 0; i < records.size(); i++) {
+        keys.push_back(records[i].key);
+        keys.push_back(Key(records[i].key.word_index, records[i].key.context_index + 1));
+        keys.push_back(Key(records[i].key.word_index + 1, records[i].key.context_index));
+    }
+
+    vector<uint32_t> indices(keys.size());
+    vector<Value> values(keys.size());
+    array.find_batch(keys.data(), uint32_t(keys.size()), indices.data(), values.data());
+
+    bool found = true;
+    for (uint32_t i = 0; i < keys.size(); i++) {
+        auto it = array.find(keys[i]);
+        if (it == array.end()) {
+            found &= indices[i] == CompressedArray::not_found;
+        } else {
+            found &= indices[i] == it.index();
+            found &= values[i].ngram_count == it->value.ngram_count;
+            found &= values[i].continuations_count == it->value.continuations_count;
+        }
+    }
+    return found;
+}
+
 vector<Record> create_records_1() {
     vector<Record> records;
     for (uint32_t i = 0; i < 2000; i += 2)
@@ -55,6 +82,24 @@ vector<Record> create_records_3() {
     return records;
 }
 
+vector<Record> create_records_4() {
+    vector<Record> records;
+    uint64_t seed = 0;
+    uint32_t word_index = 0;
+    for (uint32_t i = 0; i < 200; i++) {
+        seed = seed * 123456789 + 12345;
+        word_index += uint32_t(seed >> 40);
+        uint32_t context_index = 0;
+        for (uint32_t j = 0; j < 20; j++) {
+            seed = seed * 123456789 + 12345;
+            context_index += 1 + uint32_t(seed >> 36);
+            records.push_back(Record(Key(word_index, context_index),
+                                     Value(uint32_t(seed >> 8), uint32_t(seed >> 16), j)));
+        }
+    }
+    return records;
+}
+
 TEST(compressed_array_check, size_check) {
     vector<Record> records;
 
@@ -66,6 +111,9 @@ TEST(compressed_array_check, size_check) {
 
     records = create_records_3();
     ASSERT_EQ(records.size(), CompressedArray(records).size());
+
+    records = create_records_4();
+    ASSERT_EQ(records.size(), CompressedArray(records).size());
 }
 
 TEST(compressed_array_check, content_check) {
@@ -79,6 +127,9 @@ TEST(compressed_array_check, content_check) {
 
     records = create_records_3();
     ASSERT_TRUE(check_same(records, CompressedArray(records)));
+
+    records = create_records_4();
+    ASSERT_TRUE(check_same(records, CompressedArray(records)));
 }
 
 TEST(compressed_array_check, find_check) {
@@ -122,6 +173,75 @@ TEST(compressed_array_check, find_check) {
     ASSERT_TRUE(array3.find(Key(1, 0)) == array3.end());
     ASSERT_TRUE(array3.find(Key(1001, 0)) == array3.end());
     ASSERT_TRUE(array3.find(Key(1999, 0)) == array3.end());
+
+    records = create_records_4();
+    CompressedArray array4(records);
+    ASSERT_TRUE(search(records, array4));
+    ASSERT_TRUE(array4.find(Key(1, 1)) == array4.end());
+    ASSERT_TRUE(array4.find(Key(records.back().key.word_index + 1, 0)) == array4.end());
+}
+
+TEST(compressed_array_check, skip_samples_check) {
+    vector<vector<Record>> records_list = {create_records_1(), create_records_2(),
+                                           create_records_3(), create_records_4()};
+    for (const vector<Record>& records : records_list)
+        for (uint32_t skip_interval : {1, 2, 5, 16}) {
+            CompressedArray array(records, skip_interval);
+            ASSERT_TRUE(check_same(records, array));
+            ASSERT_TRUE(search(records, array));
+            ASSERT_TRUE(search_batch(records, array));
+            for (uint32_t i = 0; i < records.size(); i++)
+                ASSERT_TRUE(check_same(records[i], array.begin() + i));
+            ASSERT_TRUE(array.begin() + uint32_t(records.size()) == array.end());
+            ASSERT_TRUE(check_same(records[3], array.begin() + 10 - 7));
+
+            CompressedArray array2;
+            array2.loads(array.dumps());
+            ASSERT_TRUE(search(records, array2));
+            ASSERT_TRUE(array2.find(Key(1, 1)) == array2.end());
+        }
+}
+
+TEST(compressed_array_check, threads_check) {
+    vector<vector<Record>> records_list = {create_records_1(), create_records_2(),
+                                           create_records_3(), create_records_4()};
+    for (const vector<Record>& records : records_list)
+        for (uint32_t threads_count : {2, 3, 8}) {
+            ASSERT_EQ(CompressedArray(records).dumps(), CompressedArray(records, 0, threads_count).dumps());
+            ASSERT_EQ(CompressedArray(records, 3).dumps(), CompressedArray(records, 3, threads_count).dumps());
+        }
+}
+
+TEST(compressed_array_check, temp_file_check) {
+    vector<vector<Record>> records_list = {create_records_1(), create_records_2(),
+                                           create_records_3(), create_records_4()};
+    for (const vector<Record>& records : records_list)
+        for (uint32_t skip_interval : {0, 3}) {
+            TempFile<Record> file("/tmp", 64);
+            for (const Record& record : records)
+                file.push_back(record);
+            CompressedArray array(file, skip_interval);
+            ASSERT_EQ(CompressedArray(records, skip_interval).dumps(), array.dumps());
+        }
+}
+
+TEST(compressed_array_check, find_batch_check) {
+    vector<Record> records;
+
+    records = create_records_1();
+    ASSERT_TRUE(search_batch(records, CompressedArray(records)));
+
+    records = create_records_2();
+    ASSERT_TRUE(search_batch(records, CompressedArray(records)));
+
+    records = create_records_3();
+    ASSERT_TRUE(search_batch(records, CompressedArray(records)));
+
+    records = create_records_4();
+    ASSERT_TRUE(search_batch(records, CompressedArray(records)));
+
+    records.clear();
+    ASSERT_TRUE(search_batch(records, CompressedArray(records)));
 }
 
 TEST(compressed_array_check, save_load_check) {
@@ -141,6 +261,56 @@ TEST(compressed_array_check, save_load_check) {
     CompressedArray array3(records);
     array3.loads(array3.dumps());
     ASSERT_TRUE(check_same(records, array3));
+
+    records = create_records_4();
+    CompressedArray array4(records);
+    array4.loads(array4.dumps());
+    ASSERT_TRUE(check_same(records, array4));
+    ASSERT_TRUE(search(records, array4));
+
+    // untagged dumps of version 1 have no skip samples
+    ostringstream body;
+    array4.dump_body(body);
+    CompressedArray untagged_array;
+    untagged_array.loads(body.str().substr(0, body.str().size() - 2 * sizeof(uint32_t)));
+    ASSERT_TRUE(check_same(records, untagged_array));
+
+    string state = array4.dumps();
+    uint32_t version = CompressedArray::format_version + 1;
+    state.replace(8, sizeof(version), (const char*)(&version), sizeof(version));
+    ASSERT_THROW(untagged_array.loads(state), runtime_error);
+}
+
+TEST(compressed_array_check, memory_report_check) {
+    vector<vector<Record>> records_list = {create_records_1(), create_records_2(),
+                                           create_records_3(), create_records_4()};
+    for (const vector<Record>& records : records_list) {
+        CompressedArray array(records, 4);
+        CompressedArray::MemoryReport report = array.memory_report();
+        ASSERT_EQ(report.records_count, records.size());
+        ASSERT_GT(report.blocks_count, 0u);
+        ASSERT_EQ(report.samples_bytes > 0, report.samples_count > 0);
+        // the encoded bits fill the data but its last words
+        uint64_t encoded_bits = report.key_bits + report.value_bits;
+        ASSERT_LE(encoded_bits, 8 * report.data_bytes);
+        ASSERT_GT(encoded_bits + 128, 8 * report.data_bytes);
+        ASSERT_GT(report.key_bits, report.blocks_count);
+        ASSERT_GT(report.ngram_count_values_bytes, 0u);
+        ASSERT_GT(report.context_index_log_radix, 0u);
+        ASSERT_GE(report.bits_per_record(), report.key_bits_per_record() + report.value_bits_per_record());
+
+        CompressedArray loaded;
+        loaded.loads(array.dumps());
+        CompressedArray::MemoryReport loaded_report = loaded.memory_report();
+        ASSERT_EQ(loaded_report.total_bytes(), report.total_bytes());
+        ASSERT_EQ(loaded_report.key_bits, report.key_bits);
+        ASSERT_EQ(loaded_report.value_bits, report.value_bits);
+    }
+
+    CompressedArray::MemoryReport report = CompressedArray().memory_report();
+    ASSERT_EQ(report.records_count, 0u);
+    ASSERT_EQ(report.key_bits + report.value_bits, 0u);
+    ASSERT_EQ(report.bits_per_record(), 0.0);
 }
 
 TEST(compressed_array_check, random_access_check) {
@@ -160,4 +330,78 @@ TEST(compressed_array_check, random_access_check) {
     CompressedArray array3(records);
     for (uint32_t i = 0; i < records.size(); i++)
         ASSERT_TRUE(check_same(records[i], array3.begin() + i));
-}
\ No newline at end of file
+
+    records = create_records_4();
+    CompressedArray array4(records);
+    for (uint32_t i = 0; i < records.size(); i++)
+        ASSERT_TRUE(check_same(records[i], array4.begin() + i));
+}
+
+TEST(compressed_array_check, block_cache_check) {
+    vector<vector<Record>> records_list = {create_records_1(), create_records_2(),
+                                           create_records_3(), create_records_4()};
+    for (const vector<Record>& records : records_list)
+        for (size_t capacity : {size_t(1) << 12, size_t(1) << 20}) {
+            shared_ptr<BlockCache> shared_cache(new BlockCache(capacity, 2));
+            BlockCache& cache = *shared_cache;
+            CompressedArray array(records, 3);
+            array.set_block_cache(shared_cache, 1);
+            ASSERT_TRUE(search(records, array));
+            ASSERT_TRUE(search_batch(records, array));
+            for (uint32_t i = 0; i < records.size(); i++) {
+                ASSERT_TRUE(check_same(records[i], array.begin() + i));
+                // iterators from the cache continue decoding the block
+                auto it = array.find(records[i].key);
+                ++it;
+                if (i + 1 < records.size())
+                    ASSERT_TRUE(check_same(records[i + 1], it));
+                else
+                    ASSERT_TRUE(it == array.end());
+            }
+            ASSERT_TRUE(array.find(Key(1, 1)) == array.end());
+
+            ASSERT_GT(cache.get_hits_count(), 0u);
+            ASSERT_GT(cache.get_misses_count(), 0u);
+            ASSERT_LE(cache.get_memory_size(), capacity);
+            cache.clear();
+            ASSERT_EQ(cache.get_memory_size(), 0u);
+        }
+}
+
+TEST(compressed_array_check, lookup_statistics_check) {
+    vector<Record> records = create_records_4();
+    CompressedArray array(records, 3);
+    array.set_block_cache(nullptr, 2);
+    vector<Key> keys;
+    uint64_t missing_count = 0;
+    for (const Record& record : records) {
+        Key key(record.key.word_index, record.key.context_index + 1);
+        keys.push_back(record.key);
+        keys.push_back(key);
+        missing_count += !std::binary_search(records.begin(), records.end(), Record(key, Value(0, 0, 0)));
+    }
+
+    LookupStatistics::reset();
+    // counters of a finished thread are kept
+    std::thread thread([&] () {
+        for (uint32_t i = 0; i < keys.size() / 2; i++)
+            array.find(keys[i]);
+    });
+    thread.join();
+    for (uint32_t i = uint32_t(keys.size() / 2); i < keys.size(); i++)
+        array.find(keys[i]);
+    LookupStatistics statistics = LookupStatistics::collect();
+
+    if (!LookupStatistics::enabled()) {
+        for (uint32_t counter = 0; counter < LookupStatistics::counters_count; counter++)
+            ASSERT_EQ(statistics.get(LookupStatistics::Counter(counter)), 0u);
+        return;
+    }
+    ASSERT_EQ(statistics.get(LookupStatistics::lookups, 2), keys.size());
+    ASSERT_EQ(statistics.get(LookupStatistics::lookups), keys.size());
+    ASSERT_EQ(statistics.get(LookupStatistics::misses, 2), missing_count);
+    ASSERT_GE(statistics.get(LookupStatistics::records_decoded, 2), keys.size() - missing_count);
+    ASSERT_GT(statistics.get(LookupStatistics::bits_read, 2), 0u);
+    ASSERT_GT(statistics.get(LookupStatistics::blocks_switched, 2), 0u);
+    ASSERT_EQ(statistics.get(LookupStatistics::block_cache_hits), 0u);
+}
@@ -0,0 +1,97 @@
+#include "gtest/gtest.h"
+#include "LanguageModel.h"
+
+#include <cmath>
+
+using namespace std;
+
+// get_word_prob of language_model.py
+double get_word_prob(NGramStorage& storage, vector<uint32_t> ngram, double delta, double eps) {
+    vector<uint32_t> context(ngram.begin(), ngram.end() - 1);
+    Value value = storage.get_value(context);
+    double all_continuations = max<uint32_t>(1, value.continuations_count);
+    vector<uint32_t> suffix(ngram.begin() + 1, ngram.end());
+    if (value.unique_continuations_count == 0)
+        return context.empty() ? 1.0 : get_word_prob(storage, suffix, delta, eps);
+    if (all_continuations < 10 && !context.empty())
+        return get_word_prob(storage, suffix, delta, eps);
+
+    double prob = max(0.0, storage.get_ngram_count(ngram) - delta) / all_continuations;
+    double coef = delta * value.unique_continuations_count / all_continuations;
+    if (context.empty())
+        return prob + coef * eps / value.unique_continuations_count;
+    return prob + coef * get_word_prob(storage, suffix, delta, eps);
+}
+
+uint64_t seed = 0;
+uint64_t prng() {
+    seed = (seed * 123456789 + 12345);
+    return seed;
+}
+
+vector<pair<vector<uint32_t>, uint32_t>> generate_ngrams(uint32_t count, uint32_t ngram_size, uint32_t words_count) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams;
+    for (uint32_t i = 0; i < count; i++) {
+        vector<uint32_t> ngram;
+        for (uint32_t j = 0; j < ngram_size; j++)
+            ngram.push_back(uint32_t(prng() % words_count));
+        ngrams.push_back(make_pair(ngram, prng() % 10 + 1));
+    }
+    return ngrams;
+}
+
+
+TEST(language_model_check, word_prob_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = generate_ngrams(10000, 4, 20);
+    NGramStorage storage(ngrams);
+    LanguageModel model(storage, 0.6, 0.5);
+
+    for (int i = 0; i < 3000; i++) {
+        // contexts longer than the ngrams and unknown words included
+        vector<uint32_t> ngram;
+        uint32_t size = uint32_t(prng() % 7 + 1);
+        for (uint32_t j = 0; j < size; j++)
+            ngram.push_back(uint32_t(prng() % 23));
+        double expected = get_word_prob(storage, ngram, 0.6, 0.5);
+        ASSERT_NEAR(model.get_word_prob(ngram.data(), size), expected, 1e-12);
+    }
+}
+
+TEST(language_model_check, sentence_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = generate_ngrams(20000, 3, 30);
+    NGramStorage storage(ngrams);
+    LanguageModel model(storage);
+
+    vector<vector<uint32_t>> sentences;
+    vector<double> expected_log_probs;
+    for (int i = 0; i < 300; i++) {
+        vector<uint32_t> sentence;
+        vector<double> expected_word_log_probs;
+        double expected = 0;
+        uint32_t size = uint32_t(prng() % 20);
+        for (uint32_t j = 0; j < size; j++) {
+            sentence.push_back(uint32_t(prng() % 32));
+            expected_word_log_probs.push_back(log10(get_word_prob(storage, sentence, 0.75, 1.0)));
+            expected += expected_word_log_probs.back();
+        }
+
+        vector<double> word_log_probs(sentence.size());
+        double log_prob = model.score_sentence(sentence.data(), uint32_t(sentence.size()), word_log_probs.data());
+        ASSERT_NEAR(log_prob, expected, 1e-9);
+        for (uint32_t j = 0; j < sentence.size(); j++)
+            ASSERT_NEAR(word_log_probs[j], expected_word_log_probs[j], 1e-12);
+
+        sentences.push_back(sentence);
+        expected_log_probs.push_back(log_prob);
+    }
+
+    vector<double> log_probs = model.score_sentences(sentences, 4);
+    ASSERT_EQ(log_probs, expected_log_probs);
+}
+
+TEST(language_model_check, empty_storage_check) {
+    NGramStorage storage;
+    LanguageModel model(storage);
+    uint32_t sentence[] = {1, 2, 3};
+    ASSERT_EQ(model.score_sentence(sentence, 3), 0.0);
+}
@@ -4,8 +4,12 @@
 
 #include "gtest/gtest.h"
 #include "NGramStorage.h"
+#include "TextCounts.h"
+#include "Arpa.h"
 
+#include <cmath>
 #include <sstream>
+#include <thread>
 
 using namespace std;
 
@@ -57,12 +61,45 @@ uint32_t get_unique_continuations_count(vector<pair<vector<uint32_t>, uint32_t>>
     return uint32_t(continuations.size());
 }
 
+// get_word_prob of language_model.py
+double get_word_prob(NGramStorage& storage, vector<uint32_t> ngram, double delta, double eps) {
+    vector<uint32_t> context(ngram.begin(), ngram.end() - 1);
+    Value value = storage.get_value(context);
+    double all_continuations = max<uint32_t>(1, value.continuations_count);
+    vector<uint32_t> suffix(ngram.begin() + 1, ngram.end());
+    if (value.unique_continuations_count == 0)
+        return context.empty() ? 1.0 : get_word_prob(storage, suffix, delta, eps);
+    if (all_continuations < 10 && !context.empty())
+        return get_word_prob(storage, suffix, delta, eps);
+
+    double prob = max(0.0, storage.get_ngram_count(ngram) - delta) / all_continuations;
+    double coef = delta * value.unique_continuations_count / all_continuations;
+    if (context.empty())
+        return prob + coef * eps / value.unique_continuations_count;
+    return prob + coef * get_word_prob(storage, suffix, delta, eps);
+}
+
 uint64_t seed = 0;
 uint64_t prng() {
     seed = (seed * 123456789 + 12345);
     return seed;
 }
 
+// count ngrams of size words, or of 1 to size words with random_size, taken from
+// the first alphabet_size words and counted from 1 to 10 times
+vector<pair<vector<uint32_t>, uint32_t>> random_ngrams(uint32_t count, uint32_t size, uint32_t alphabet_size,
+                                                      bool random_size = false) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams;
+    for (uint32_t i = 0; i < count; i++) {
+        vector<uint32_t> ngram;
+        uint32_t ngram_size = random_size ? uint32_t(prng() % size + 1) : size;
+        for (uint32_t j = 0; j < ngram_size; j++)
+            ngram.push_back(uint32_t(prng() % alphabet_size));
+        ngrams.push_back(make_pair(ngram, prng() % 10 + 1));
+    }
+    return ngrams;
+}
+
 
 TEST(ngram_storage_check, content_check) {
     vector<pair<vector<uint32_t>, uint32_t>> ngrams;
@@ -99,6 +136,707 @@ TEST(ngram_storage_check, content_check) {
     }
 }
 
+TEST(ngram_storage_check, value_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(10000, 3, 26);
+
+    NGramStorage storage(ngrams);
+    for (int i = 0; i < 10000; i++) {
+        vector<uint32_t> ngram;
+        for (int j = 0; j < 4; j++) {
+            ngram.push_back(uint32_t(prng() % 30));
+            Value value = storage.get_value(ngram);
+            ASSERT_EQ(value.ngram_count, get_ngram_count(ngrams, ngram));
+            ASSERT_EQ(value.continuations_count, get_continuations_count(ngrams, ngram));
+            ASSERT_EQ(value.unique_continuations_count, get_unique_continuations_count(ngrams, ngram));
+
+            Value pointer_value = storage.get_value(ngram.data(), uint32_t(ngram.size()));
+            ASSERT_EQ(pointer_value.ngram_count, value.ngram_count);
+            ASSERT_EQ(pointer_value.continuations_count, value.continuations_count);
+            ASSERT_EQ(pointer_value.unique_continuations_count, value.unique_continuations_count);
+        }
+    }
+
+    Value value = storage.get_value(vector<uint32_t>());
+    ASSERT_EQ(value.ngram_count, get_ngram_count(ngrams, vector<uint32_t>()));
+    ASSERT_EQ(value.continuations_count, get_continuations_count(ngrams, vector<uint32_t>()));
+    ASSERT_EQ(value.unique_continuations_count, get_unique_continuations_count(ngrams, vector<uint32_t>()));
+}
+
+TEST(ngram_storage_check, skip_interval_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(10000, 3, 26);
+
+    NGramStorage storage(ngrams);
+    NGramStorage::Options options;
+    options.skip_interval = 4;
+    NGramStorage sampled_storage(ngrams, options);
+    NGramStorage sampled_storage2;
+    sampled_storage2.loads(sampled_storage.dumps());
+
+    for (int i = 0; i < 10000; i++) {
+        vector<uint32_t> ngram;
+        for (int j = 0; j < 3; j++) {
+            ngram.push_back(uint32_t(prng() % 30));
+            Value value = storage.get_value(ngram);
+            Value sampled_value = sampled_storage2.get_value(ngram);
+            ASSERT_EQ(value.ngram_count, sampled_value.ngram_count);
+            ASSERT_EQ(value.continuations_count, sampled_value.continuations_count);
+            ASSERT_EQ(value.unique_continuations_count, sampled_value.unique_continuations_count);
+        }
+    }
+
+    auto it = storage.begin(3);
+    auto sampled_it = sampled_storage2.begin(3);
+    for (; it != storage.end(3); it++, sampled_it++) {
+        ASSERT_TRUE(sampled_it != sampled_storage2.end(3));
+        ASSERT_TRUE(it->first == sampled_it->first);
+        ASSERT_EQ(it->second, sampled_it->second);
+    }
+    ASSERT_TRUE(sampled_it == sampled_storage2.end(3));
+}
+
+TEST(ngram_storage_check, threads_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(20000, 4, 40, true);
+
+    NGramStorage::Options options;
+    options.skip_interval = 4;
+    NGramStorage storage(ngrams, options);
+    for (uint32_t threads_count : {2, 5, 16}) {
+        options.threads_count = threads_count;
+        NGramStorage parallel_storage(ngrams, options);
+        ASSERT_EQ(storage.dumps(), parallel_storage.dumps());
+    }
+}
+
+TEST(ngram_storage_check, flat_ngrams_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams;
+    FlatNGrams flat_ngrams;
+    for (int i = 0; i < 20000; i++) {
+        vector<uint32_t> ngram;
+        uint32_t ngram_size = uint32_t(prng() % 4 + 1);
+        for (uint32_t j = 0; j < ngram_size; j++)
+            ngram.push_back(uint32_t(prng() % 40) * 1000003);
+        uint32_t count = prng() % 10 + 1;
+        ngrams.push_back(make_pair(ngram, count));
+        flat_ngrams.words(ngram_size).insert(flat_ngrams.words(ngram_size).end(), ngram.begin(), ngram.end());
+        flat_ngrams.counts(ngram_size).push_back(count);
+    }
+    ASSERT_EQ(flat_ngrams.size(), ngrams.size());
+
+    NGramStorage storage(ngrams);
+    NGramStorage flat_storage(flat_ngrams);
+    ASSERT_EQ(storage.dumps(), flat_storage.dumps());
+    ASSERT_EQ(flat_storage.get_ngram_count(ngrams[0].first), get_ngram_count(ngrams, ngrams[0].first));
+
+    vector<uint64_t> positions = flat_ngrams.merge();
+    for (size_t j = 1; j < positions.size(); j++) {
+        vector<uint32_t> prev_ngram(flat_ngrams.ngram(positions[j - 1]),
+                                    flat_ngrams.ngram(positions[j - 1]) + FlatNGrams::position_size(positions[j - 1]));
+        vector<uint32_t> ngram(flat_ngrams.ngram(positions[j]),
+                               flat_ngrams.ngram(positions[j]) + FlatNGrams::position_size(positions[j]));
+        ASSERT_FALSE(IntegerVectorComparator()(ngram, prev_ngram));
+    }
+}
+
+TEST(ngram_storage_check, memory_budget_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(20000, 4, 40, true);
+
+    string filename = temp_filename("/tmp");
+    ofstream fout(filename, std::ios::out | std::ios::binary);
+    uint64_t ngrams_count = ngrams.size();
+    fout.write((char*)&ngrams_count, sizeof(ngrams_count));
+    for (auto& ngram : ngrams) {
+        fout.write((char*)&ngram.second, sizeof(ngram.second));
+        uint8_t ngram_size = uint8_t(ngram.first.size());
+        fout.write((char*)&ngram_size, sizeof(ngram_size));
+        fout.write((char*)ngram.first.data(), ngram_size * sizeof(uint32_t));
+    }
+    fout.close();
+
+    NGramStorage::Options options;
+    options.skip_interval = 4;
+    NGramStorage storage(filename, options);
+    for (size_t memory_budget : {4096, 100000, 100000000}) {
+        options.memory_budget = memory_budget;
+        NGramStorage streamed_storage(filename, options);
+        ASSERT_EQ(storage.dumps(), streamed_storage.dumps());
+    }
+    remove(filename.c_str());
+}
+
+TEST(ngram_storage_check, text_counts_check) {
+    vector<string> words;
+    for (int i = 0; i < 50; i++)
+        words.push_back("w" + to_string(prng() % 1000));
+
+    string filename = temp_filename("/tmp");
+    ofstream fout(filename);
+    vector<pair<vector<string>, uint32_t>> text_ngrams;
+    for (int i = 0; i < 5000; i++) {
+        vector<string> ngram;
+        uint32_t ngram_size = uint32_t(prng() % 4 + 1);
+        for (uint32_t j = 0; j < ngram_size; j++)
+            ngram.push_back(words[prng() % words.size()]);
+        uint32_t count = prng() % 10 + 1;
+        fout << count;
+        for (const string& word : ngram)
+            fout << (prng() % 2 ? " " : " \t ") << word;
+        fout << (i % 7 == 0 ? "\r\n\n" : "\n");
+        text_ngrams.push_back(make_pair(ngram, count));
+    }
+    fout.close();
+
+    NGramStorage::Options options;
+    options.skip_interval = 4;
+    Vocabulary<string> vocabulary;
+    NGramStorage storage;
+    load_text_counts(filename, vocabulary, storage, options);
+
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams;
+    for (auto& text_ngram : text_ngrams) {
+        vector<uint32_t> ngram;
+        for (const string& word : text_ngram.first)
+            ngram.push_back(vocabulary.get_index(word));
+        ngrams.push_back(make_pair(ngram, text_ngram.second));
+    }
+    ASSERT_EQ(NGramStorage(ngrams, options).dumps(), storage.dumps());
+
+    for (uint32_t threads_count : {2, 3, 16}) {
+        options.threads_count = threads_count;
+        Vocabulary<string> threads_vocabulary;
+        NGramStorage threads_storage;
+        load_text_counts(filename, threads_vocabulary, threads_storage, options);
+        ASSERT_EQ(vocabulary.dumps(), threads_vocabulary.dumps());
+        ASSERT_EQ(storage.dumps(), threads_storage.dumps());
+    }
+
+    fout.open(filename);
+    fout << "3 a b\nx c\n";
+    fout.close();
+    ASSERT_THROW(load_text_counts(filename, vocabulary, storage, options), runtime_error);
+    remove(filename.c_str());
+}
+
+TEST(ngram_storage_check, frequency_word_order_check) {
+    string filename = temp_filename("/tmp");
+    ofstream fout(filename);
+    map<vector<string>, uint32_t> text_ngrams;
+    map<string, uint64_t> word_counts;
+    for (int i = 0; i < 3000; i++) {
+        vector<string> ngram;
+        uint32_t ngram_size = uint32_t(prng() % 3 + 1);
+        for (uint32_t j = 0; j < ngram_size; j++)
+            ngram.push_back("w" + to_string(prng() % 100 * (prng() % 100) / 100));
+        if (text_ngrams.count(ngram))
+            continue;
+        uint32_t count = prng() % 10 + 1;
+        text_ngrams[ngram] = count;
+        word_counts[ngram[0]] += count;
+        fout << count;
+        for (const string& word : ngram)
+            fout << " " << word;
+        fout << "\n";
+    }
+    fout.close();
+
+    NGramStorage::Options options;
+    Vocabulary<string> hash_vocabulary;
+    NGramStorage hash_storage;
+    load_text_counts(filename, hash_vocabulary, hash_storage, options);
+    options.frequency_word_order = true;
+    options.threads_count = 3;
+    Vocabulary<string> vocabulary;
+    NGramStorage storage;
+    load_text_counts(filename, vocabulary, storage, options);
+    ASSERT_EQ(vocabulary.size(), word_counts.size());
+    for (uint32_t i = 1; i < vocabulary.size(); i++)
+        ASSERT_GE(word_counts[vocabulary[i - 1]], word_counts[vocabulary[i]]);
+    for (auto& ngram : text_ngrams) {
+        vector<uint32_t> encoded_ngram, hash_encoded_ngram;
+        for (const string& word : ngram.first) {
+            encoded_ngram.push_back(vocabulary.get_index(word));
+            hash_encoded_ngram.push_back(hash_vocabulary.get_index(word));
+        }
+        Value value = storage.get_value(encoded_ngram);
+        Value hash_value = hash_storage.get_value(hash_encoded_ngram);
+        ASSERT_EQ(value.ngram_count, hash_value.ngram_count);
+        ASSERT_EQ(value.continuations_count, hash_value.continuations_count);
+        ASSERT_EQ(value.unique_continuations_count, hash_value.unique_continuations_count);
+    }
+
+    Vocabulary<string> loaded_vocabulary;
+    loaded_vocabulary.loads(vocabulary.dumps());
+    for (uint32_t i = 0; i < vocabulary.size(); i++)
+        ASSERT_EQ(loaded_vocabulary.get_index(vocabulary[i]), i);
+
+    options.log_probabilities = true;
+    load_text_counts(filename, vocabulary, storage, options);
+    string arpa_filename = temp_filename("/tmp");
+    dump_arpa(arpa_filename, vocabulary, storage, 1);
+    NGramStorage arpa_storage;
+    load_arpa(arpa_filename, loaded_vocabulary, arpa_storage, options);
+    for (uint32_t i = 1; i < loaded_vocabulary.size(); i++) {
+        vector<uint32_t> previous(1, i - 1), current(1, i);
+        LogProbability previous_probability, probability;
+        ASSERT_TRUE(arpa_storage.get_log_probability(previous.data(), 1, previous_probability));
+        ASSERT_TRUE(arpa_storage.get_log_probability(current.data(), 1, probability));
+        ASSERT_GE(previous_probability.log_prob, probability.log_prob);
+    }
+
+    // a repeated 1-gram is numbered once
+    fout.open(arpa_filename);
+    fout << "\\data\\\nngram 1=3\n\n\\1-grams:\n-2.0\ta\n-0.5\tb\n-1.0\ta\n\n\\end\\\n";
+    fout.close();
+    load_arpa(arpa_filename, loaded_vocabulary, arpa_storage, options);
+    ASSERT_EQ(loaded_vocabulary.size(), 2);
+    ASSERT_EQ(loaded_vocabulary.get_index("b"), 0);
+    ASSERT_EQ(loaded_vocabulary.get_index("a"), 1);
+    remove(filename.c_str());
+    remove(arpa_filename.c_str());
+}
+
+TEST(ngram_storage_check, arpa_check) {
+    // every listed ngram has its prefix listed
+    vector<map<vector<string>, pair<float, float>>> levels(3);
+    for (int i = 0; i < 30; i++)
+        levels[0][{"w" + to_string(i)}] = make_pair(-float(prng() % 1000) / 100, -float(prng() % 100) / 8);
+    for (uint32_t ngram_size = 2; ngram_size <= 3; ngram_size++)
+        for (int i = 0; i < 2000; i++) {
+            auto prefix = levels[ngram_size - 2].begin();
+            advance(prefix, prng() % levels[ngram_size - 2].size());
+            vector<string> ngram(prefix->first);
+            ngram.push_back("w" + to_string(prng() % 30));
+            float backoff = ngram_size < 3 && prng() % 3 ? -float(prng() % 100) / 8 : 0.0f;
+            levels[ngram_size - 1][ngram] = make_pair(-float(prng() % 1000) / 100, backoff);
+        }
+    levels[0][{"<s>"}] = make_pair(-99.0f, -0.5f);
+    levels[1][{"<s>", "w1"}] = make_pair(-numeric_limits<float>::infinity(), 0.0f);
+
+    string filename = temp_filename("/tmp");
+    ofstream fout(filename);
+    fout << "\\data\\\n";
+    for (uint32_t i = 0; i < levels.size(); i++)
+        fout << "ngram " << i + 1 << "=" << levels[i].size() << "\n";
+    for (uint32_t i = 0; i < levels.size(); i++) {
+        fout << "\n\\" << i + 1 << "-grams:\n";
+        for (auto& ngram : levels[i]) {
+            fout << ngram.second.first << "\t" << ngram.first[0];
+            for (uint32_t j = 1; j < ngram.first.size(); j++)
+                fout << " " << ngram.first[j];
+            if (ngram.second.second != 0.0f)
+                fout << "\t" << ngram.second.second;
+            fout << "\n";
+        }
+    }
+    fout << "\n\\end\\\n";
+    fout.close();
+
+    Vocabulary<string> vocabulary;
+    NGramStorage storage;
+    load_arpa(filename, vocabulary, storage);
+    ASSERT_EQ(storage.get_max_ngram_size(), 3);
+    for (uint32_t i = 0; i < levels.size(); i++) {
+        ASSERT_EQ(storage.get_ngrams_count(uint8_t(i + 1)), levels[i].size());
+        for (auto& ngram : levels[i]) {
+            vector<uint32_t> encoded_ngram;
+            for (const string& word : ngram.first)
+                encoded_ngram.push_back(vocabulary.get_index(word));
+            LogProbability probability;
+            ASSERT_TRUE(storage.get_log_probability(encoded_ngram.data(), i + 1, probability));
+            ASSERT_FLOAT_EQ(probability.log_prob, ngram.second.first);
+            ASSERT_FLOAT_EQ(probability.backoff, ngram.second.second);
+            uint32_t continuations = 0;
+            if (i + 1 < levels.size())
+                for (auto& next : levels[i + 1])
+                    continuations += equal(ngram.first.begin(), ngram.first.end(), next.first.begin());
+            ASSERT_EQ(storage.get_unique_continuations_count(encoded_ngram.data(), i + 1) > 0, continuations > 0);
+        }
+    }
+
+    string dumped_filename = temp_filename("/tmp");
+    dump_arpa(dumped_filename, vocabulary, storage, 3);
+    NGramStorage::Options options;
+    options.threads_count = 3;
+    options.memory_budget = 4096;
+    for (const string& arpa_filename : {filename, dumped_filename}) {
+        Vocabulary<string> loaded_vocabulary;
+        NGramStorage loaded_storage;
+        load_arpa(arpa_filename, loaded_vocabulary, loaded_storage, options);
+        ASSERT_EQ(vocabulary.dumps(), loaded_vocabulary.dumps());
+        ASSERT_EQ(storage.dumps(), loaded_storage.dumps());
+    }
+
+    NGramStorage loaded_storage;
+    loaded_storage.loads(storage.dumps());
+    ASSERT_TRUE(loaded_storage.has_log_probabilities());
+    storage.dump_mapped(dumped_filename);
+    NGramStorage mapped_storage;
+    mapped_storage.load_mapped(dumped_filename);
+    for (uint8_t ngram_size = 1; ngram_size <= 3; ngram_size++)
+        for (uint32_t index = 0; index < storage.get_ngrams_count(ngram_size); index++) {
+            ASSERT_EQ(storage.get_log_probability(ngram_size, index).log_prob,
+                      mapped_storage.get_log_probability(ngram_size, index).log_prob);
+            ASSERT_EQ(storage.get_log_probability(ngram_size, index).backoff,
+                      loaded_storage.get_log_probability(ngram_size, index).backoff);
+        }
+
+    // streams of version 3 keep the floats of every record after the arrays
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams;
+    for (auto& level : levels)
+        for (auto& ngram : level) {
+            vector<uint32_t> encoded_ngram;
+            for (const string& word : ngram.first)
+                encoded_ngram.push_back(vocabulary.get_index(word));
+            ngrams.push_back(make_pair(encoded_ngram, 1));
+        }
+    string stream = NGramStorage(ngrams).dumps();
+    ASSERT_EQ(stream.back(), 0);
+    uint32_t version = 3;
+    stream.replace(8, sizeof(version), (const char*)(&version), sizeof(version));
+    stream.back() = 1;
+    for (uint8_t ngram_size = 1; ngram_size <= 3; ngram_size++)
+        for (uint32_t index = 0; index < storage.get_ngrams_count(ngram_size); index++) {
+            LogProbability probability = storage.get_log_probability(ngram_size, index);
+            stream.append((const char*)(&probability), sizeof(probability));
+        }
+    loaded_storage.loads(stream);
+    for (uint8_t ngram_size = 1; ngram_size <= 3; ngram_size++)
+        for (uint32_t index = 0; index < storage.get_ngrams_count(ngram_size); index++) {
+            ASSERT_EQ(storage.get_log_probability(ngram_size, index).log_prob,
+                      loaded_storage.get_log_probability(ngram_size, index).log_prob);
+            ASSERT_EQ(storage.get_log_probability(ngram_size, index).backoff,
+                      loaded_storage.get_log_probability(ngram_size, index).backoff);
+        }
+
+    fout.open(filename);
+    fout << "\\data\\\nngram 1=1\n\n\\1-grams:\n-1.0\ta b\n\n\\end\\\n";
+    fout.close();
+    ASSERT_THROW(load_arpa(filename, vocabulary, storage), runtime_error);
+    remove(filename.c_str());
+    remove(dumped_filename.c_str());
+}
+
+TEST(ngram_storage_check, log_probabilities_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(20000, 4, 20, true);
+
+    NGramStorage::Options options;
+    options.log_probabilities = true;
+    options.delta = 0.5f;
+    options.eps = 2.0f;
+    NGramStorage storage(ngrams, options);
+    ASSERT_TRUE(storage.has_log_probabilities());
+    options.probability_bits = 8;
+    options.threads_count = 3;
+    NGramStorage quantized_storage(ngrams, options);
+    NGramStorage computed_storage(ngrams);
+    computed_storage.compute_log_probabilities(0.5f, 2.0f, 8);
+    ASSERT_EQ(quantized_storage.dumps(), computed_storage.dumps());
+
+    NGramStorage loaded_storage;
+    loaded_storage.loads(quantized_storage.dumps());
+    string filename = temp_filename("/tmp");
+    quantized_storage.dump_mapped(filename);
+    NGramStorage mapped_storage;
+    mapped_storage.load_mapped(filename);
+    remove(filename.c_str());
+
+    double max_error = 0;
+    for (int i = 0; i < 3000; i++) {
+        vector<uint32_t> ngram;
+        uint32_t ngram_size = uint32_t(prng() % 5 + 1);
+        for (uint32_t j = 0; j < ngram_size; j++)
+            ngram.push_back(uint32_t(prng() % 22));
+        double prob = get_word_prob(storage, ngram, 0.5, 2.0);
+        ASSERT_NEAR(log10(prob), storage.get_word_log_prob(ngram.data(), ngram_size), 1e-4);
+
+        float quantized_log_prob = quantized_storage.get_word_log_prob(ngram.data(), ngram_size);
+        max_error = max(max_error, fabs(log10(prob) - quantized_log_prob));
+        ASSERT_EQ(quantized_log_prob, loaded_storage.get_word_log_prob(ngram.data(), ngram_size));
+        ASSERT_EQ(quantized_log_prob, mapped_storage.get_word_log_prob(ngram.data(), ngram_size));
+    }
+    ASSERT_LT(max_error, 0.1);
+
+    // few distinct values are kept exactly
+    vector<LogProbability> values;
+    for (int i = 0; i < 1000; i++)
+        values.push_back(LogProbability(-float(prng() % 7), i % 5 ? 0.0f : NAN));
+    LogProbabilityArray array(values, 3);
+    for (uint32_t i = 0; i < values.size(); i++) {
+        ASSERT_EQ(array[i].log_prob, values[i].log_prob);
+        ASSERT_EQ(isnan(array[i].backoff), isnan(values[i].backoff));
+    }
+
+    // NaN and both infinities leave no bin of 1 bit for finite values
+    values.assign(4, LogProbability(-1.0f, 0.0f));
+    values[1].log_prob = NAN;
+    values[2].log_prob = -numeric_limits<float>::infinity();
+    values[3].log_prob = numeric_limits<float>::infinity();
+    ASSERT_THROW(LogProbabilityArray(values, 1), invalid_argument);
+    LogProbabilityArray special_array(values, 2);
+    ASSERT_EQ(special_array[0].log_prob, -1.0f);
+    ASSERT_TRUE(isnan(special_array[1].log_prob));
+    ASSERT_EQ(special_array[2].log_prob, values[2].log_prob);
+    ASSERT_EQ(special_array[3].log_prob, values[3].log_prob);
+}
+
+TEST(ngram_storage_check, batch_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(10000, 3, 26);
+
+    NGramStorage storage(ngrams);
+    for (uint32_t size = 0; size <= 4; size++) {
+        vector<uint32_t> queries;
+        for (int i = 0; i < 1000; i++)
+            for (uint32_t j = 0; j < size; j++)
+                queries.push_back(uint32_t(prng() % 30));
+
+        vector<Value> values(1000);
+        storage.get_values(queries.data(), size, 1000, values.data());
+        for (uint32_t i = 0; i < 1000; i++) {
+            Value value = storage.get_value(queries.data() + i * size, size);
+            ASSERT_EQ(values[i].ngram_count, value.ngram_count);
+            ASSERT_EQ(values[i].continuations_count, value.continuations_count);
+            ASSERT_EQ(values[i].unique_continuations_count, value.unique_continuations_count);
+        }
+    }
+}
+
+TEST(ngram_storage_check, state_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(10000, 3, 26);
+
+    NGramStorage storage(ngrams);
+    for (int i = 0; i < 1000; i++) {
+        vector<uint32_t> sentence;
+        NGramStorage::State state = storage.get_empty_state();
+        for (int j = 0; j < 10; j++) {
+            sentence.push_back(uint32_t(prng() % 30));
+            NGramStorage::State next_state;
+            storage.advance(state, sentence.back(), next_state);
+            state = next_state;
+
+            uint32_t max_size = min(uint32_t(sentence.size()), uint32_t(storage.get_max_ngram_size()));
+            ASSERT_EQ(state.size, max_size);
+            for (uint32_t k = 0; k < max_size; k++) {
+                vector<uint32_t> ngram(sentence.end() - k - 1, sentence.end());
+                Value value = storage.get_value(ngram);
+                ASSERT_EQ(state.indices[k] != CompressedArray::not_found, value.ngram_count > 0);
+                ASSERT_EQ(state.values[k].ngram_count, value.ngram_count);
+                ASSERT_EQ(state.values[k].continuations_count, value.continuations_count);
+                ASSERT_EQ(state.values[k].unique_continuations_count, value.unique_continuations_count);
+            }
+
+            NGramStorage::State context_state = storage.get_state(sentence);
+            ASSERT_EQ(context_state.size, state.size);
+        }
+    }
+
+    // only prefixes are added: (0 1 2) and (1 2) are stored while 2 is not, (1 2 3) while (2 3) is not
+    ngrams = {{{0, 1, 2}, 3}, {{1, 2, 3}, 5}};
+    NGramStorage gaps_storage(ngrams);
+    NGramStorage::State state = gaps_storage.get_state({3, 0, 1, 2});
+    ASSERT_EQ(state.size, 3);
+    ASSERT_EQ(state.indices[0], CompressedArray::not_found);
+    ASSERT_EQ(state.values[0].ngram_count, 0);
+    ASSERT_NE(state.indices[1], CompressedArray::not_found);
+    ASSERT_EQ(state.values[1].ngram_count, gaps_storage.get_ngram_count({1, 2}));
+    ASSERT_NE(state.indices[2], CompressedArray::not_found);
+    ASSERT_EQ(state.values[2].ngram_count, gaps_storage.get_ngram_count({0, 1, 2}));
+    NGramStorage::State next_state;
+    gaps_storage.advance(state, 3, next_state);
+    ASSERT_EQ(next_state.values[1].ngram_count, 0);
+    ASSERT_EQ(next_state.values[2].ngram_count, gaps_storage.get_ngram_count({1, 2, 3}));
+
+    // the longest ngrams of a state are followed, longer ones are refused
+    vector<uint32_t> sentence;
+    for (uint32_t i = 0; i <= NGramStorage::State::max_size; i++)
+        sentence.push_back(i);
+    ngrams = {{vector<uint32_t>(sentence.begin(), sentence.end() - 1), 1}};
+    NGramStorage long_storage(ngrams);
+    state = long_storage.get_state(vector<uint32_t>(sentence.begin(), sentence.end() - 1));
+    ASSERT_EQ(state.size, NGramStorage::State::max_size);
+    ASSERT_EQ(state.values[NGramStorage::State::max_size - 1].ngram_count, 1);
+    ngrams = {{sentence, 1}};
+    NGramStorage longer_storage(ngrams);
+    ASSERT_THROW(longer_storage.get_empty_state(), runtime_error);
+    ASSERT_THROW(longer_storage.get_state(sentence), runtime_error);
+}
+
+TEST(ngram_storage_check, concurrent_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(10000, 3, 26);
+
+    vector<vector<uint32_t>> queries;
+    vector<uint32_t> expected_counts;
+    for (int i = 0; i < 5000; i++) {
+        vector<uint32_t> ngram;
+        for (int j = 0; j < 3; j++) {
+            ngram.push_back(uint32_t(prng() % 30));
+            queries.push_back(ngram);
+            expected_counts.push_back(get_ngram_count(ngrams, ngram));
+        }
+    }
+
+    const NGramStorage storage(ngrams);
+    vector<uint32_t> mismatches(4, 0);
+    vector<std::thread> threads;
+    for (uint32_t t = 0; t < mismatches.size(); t++)
+        threads.push_back(std::thread([&, t]() {
+            NGramStorage::Reader reader = storage.get_reader();
+            for (uint32_t i = t; i < queries.size(); i++) {
+                mismatches[t] += reader.get_ngram_count(queries[i]) != expected_counts[i];
+                mismatches[t] += storage.get_ngram_count(queries[i].data(),
+                                                         uint32_t(queries[i].size())) != expected_counts[i];
+            }
+        }));
+    for (auto& thread : threads)
+        thread.join();
+
+    for (uint32_t t = 0; t < mismatches.size(); t++)
+        ASSERT_EQ(mismatches[t], 0);
+}
+
+TEST(ngram_storage_check, block_cache_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(10000, 3, 26);
+
+    vector<uint32_t> queries;
+    for (int i = 0; i < 3 * 5000; i++)
+        queries.push_back(uint32_t(prng() % 30));
+
+    NGramStorage storage(ngrams);
+    vector<Value> expected_values;
+    for (uint32_t i = 0; i < 5000; i++)
+        for (uint32_t size = 1; size <= 3; size++)
+            expected_values.push_back(storage.get_value(queries.data() + 3 * i, size));
+
+    storage.set_block_cache_capacity(1 << 14);
+    vector<uint32_t> mismatches(4, 0);
+    vector<std::thread> threads;
+    for (uint32_t t = 0; t < mismatches.size(); t++)
+        threads.push_back(std::thread([&, t]() {
+            for (uint32_t i = t; i < 5000; i++)
+                for (uint32_t size = 1; size <= 3; size++) {
+                    Value value = storage.get_value(queries.data() + 3 * i, size);
+                    const Value& expected = expected_values[3 * i + size - 1];
+                    mismatches[t] += value.ngram_count != expected.ngram_count ||
+                                     value.continuations_count != expected.continuations_count ||
+                                     value.unique_continuations_count != expected.unique_continuations_count;
+                }
+        }));
+    for (auto& thread : threads)
+        thread.join();
+
+    for (uint32_t t = 0; t < mismatches.size(); t++)
+        ASSERT_EQ(mismatches[t], 0);
+    ASSERT_GT(storage.get_block_cache()->get_hits_count(), 0u);
+    ASSERT_LE(storage.get_block_cache()->get_memory_size(), size_t(1 << 14));
+
+    // a loaded storage starts with an empty cache of the same capacity
+    storage.loads(storage.dumps());
+    ASSERT_EQ(storage.get_block_cache()->get_memory_size(), 0u);
+    ASSERT_EQ(storage.get_block_cache()->get_capacity(), size_t(1 << 14));
+    for (uint32_t i = 0; i < 5000; i++)
+        ASSERT_EQ(storage.get_value(queries.data() + 3 * i, 3).ngram_count, expected_values[3 * i + 2].ngram_count);
+
+    // copies share the cache and keep it alive
+    CompressedArray level;
+    {
+        NGramStorage copy(storage);
+        ASSERT_EQ(copy.get_block_cache(), storage.get_block_cache());
+        level = copy.get_level(3);
+    }
+    storage.loads(storage.dumps());
+    const CompressedArray& loaded_level = storage.get_level(3);
+    for (uint32_t i = 0; i < 5000; i++) {
+        Key key(queries[3 * i + 2], i % loaded_level.size());
+        ASSERT_EQ(level.find(key).index(), loaded_level.find(key).index());
+    }
+
+    storage.set_block_cache_capacity(0);
+    ASSERT_TRUE(storage.get_block_cache() == nullptr);
+}
+
+TEST(ngram_storage_check, context_cache_check) {
+    ContextCache cache(10);
+    ASSERT_EQ(cache.get_capacity(), 16u);
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < 1000; i++)
+        cache.put(ContextCache::extend_hash(ContextCache::empty_hash, i), i);
+    for (uint32_t i = 0; i < 1000; i++)
+        if (cache.get(ContextCache::extend_hash(ContextCache::empty_hash, i), value)) {
+            ASSERT_EQ(value, i);
+        }
+    ASSERT_EQ(cache.get_hits_count() + cache.get_misses_count(), 1000u);
+    ASSERT_LE(cache.get_hits_count(), 16u);
+    ASSERT_FALSE(ContextCache(0).get(ContextCache::extend_hash(ContextCache::empty_hash, 1), value));
+
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(10000, 4, 12);
+
+    vector<vector<uint32_t>> queries;
+    vector<uint32_t> expected_counts;
+    for (int i = 0; i < 3000; i++) {
+        vector<uint32_t> ngram;
+        for (int j = 0; j < 4; j++) {
+            ngram.push_back(uint32_t(prng() % 14));
+            queries.push_back(ngram);
+            expected_counts.push_back(get_ngram_count(ngrams, ngram));
+        }
+    }
+
+    // all threads share the cache of the storage, a small one keeps evicting
+    NGramStorage storage(ngrams);
+    storage.set_context_cache_capacity(64);
+    ASSERT_EQ(storage.get_context_cache().get_capacity(), 64u);
+    vector<uint32_t> mismatches(4, 0);
+    vector<std::thread> threads;
+    for (uint32_t t = 0; t < mismatches.size(); t++)
+        threads.push_back(std::thread([&, t]() {
+            for (uint32_t i = t; i < queries.size(); i++)
+                mismatches[t] += storage.get_ngram_count(queries[i]) != expected_counts[i];
+        }));
+    for (auto& thread : threads)
+        thread.join();
+
+    for (uint32_t t = 0; t < mismatches.size(); t++)
+        ASSERT_EQ(mismatches[t], 0);
+    ASSERT_GT(storage.get_context_cache().get_hits_count(), 0u);
+
+    NGramStorage::Reader reader = storage.get_reader(0);
+    for (uint32_t i = 0; i < queries.size(); i++)
+        ASSERT_EQ(reader.get_ngram_count(queries[i]), expected_counts[i]);
+    ASSERT_EQ(reader.get_cache().get_capacity(), 0u);
+
+    storage.loads(storage.dumps());
+    ASSERT_EQ(storage.get_context_cache().get_capacity(), 64u);
+    ASSERT_EQ(storage.get_context_cache().get_hits_count(), 0u);
+}
+
+TEST(ngram_storage_check, memory_report_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(10000, 3, 26);
+
+    NGramStorage::Options options;
+    options.log_probabilities = true;
+    options.probability_bits = 8;
+    NGramStorage storage(ngrams, options);
+    NGramStorage::MemoryReport report = storage.memory_report();
+    ASSERT_EQ(report.levels.size(), 3u);
+    ASSERT_EQ(report.log_probabilities_bytes.size(), 3u);
+    size_t total_bytes = 0;
+    for (uint8_t i = 0; i < 3; i++) {
+        ASSERT_EQ(report.levels[i].records_count, storage.get_ngrams_count(uint8_t(i + 1)));
+        // two 8-bit codes for every record and the tables
+        ASSERT_GE(report.log_probabilities_bytes[i], 2 * size_t(report.levels[i].records_count));
+        total_bytes += report.levels[i].total_bytes() + report.log_probabilities_bytes[i];
+    }
+    ASSERT_EQ(report.total_bytes(), total_bytes);
+    ASSERT_NEAR(report.bytes_per_ngram(), double(total_bytes) / report.ngrams_count(), 1e-12);
+
+    string filename = temp_filename("/tmp");
+    storage.dump_mapped(filename);
+    NGramStorage mapped;
+    mapped.load_mapped(filename);
+    ASSERT_EQ(mapped.memory_report().total_bytes(), total_bytes);
+    remove(filename.c_str());
+
+    ASSERT_EQ(NGramStorage().memory_report().total_bytes(), 0u);
+}
+
 TEST(ngram_storage_check, iterator_check) {
     vector<pair<vector<uint32_t>, uint32_t>> ngrams;
     unordered_set<vector<uint32_t>, IntegerVectorHasher> source_ngrams;
@@ -121,6 +859,29 @@ TEST(ngram_storage_check, iterator_check) {
     ASSERT_TRUE(source_ngrams == target_ngrams);
 }
 
+TEST(ngram_storage_check, mapped_check) {
+    vector<pair<vector<uint32_t>, uint32_t>> ngrams = random_ngrams(10000, 3, 26);
+
+    string filename = "ngram_storage_mapped_check.bin";
+    NGramStorage storage(ngrams);
+    storage.dump_mapped(filename);
+    NGramStorage mapped_storage;
+    mapped_storage.load_mapped(filename);
+    remove(filename.c_str());
+    NGramStorage storage2(mapped_storage);
+
+    ASSERT_EQ(storage.dumps(), storage2.dumps());
+    for (int i = 0; i < 10000; i++) {
+        vector<uint32_t> ngram;
+        for (int j = 0; j < 3; j++) {
+            ngram.push_back(uint32_t(prng() % 26));
+            ASSERT_EQ(storage2.get_ngram_count(ngram), storage.get_ngram_count(ngram));
+            ASSERT_EQ(storage2.get_continuations_count(ngram), storage.get_continuations_count(ngram));
+            ASSERT_EQ(storage2.get_unique_continuations_count(ngram), storage.get_unique_continuations_count(ngram));
+        }
+    }
+}
+
 
 
 
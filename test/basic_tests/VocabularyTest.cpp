@@ -78,8 +78,66 @@ TEST(vocabulary_test, serialization_test) {
     }
     ASSERT_TRUE(it2 == vocab2.end());
 
+    // a vocabulary followed by other data in a stream
+    stringstream stream;
+    vocab.dump(stream);
+    stream << "tail";
+    vocab2.load(stream);
+    ASSERT_EQ(vocab2.size(), vocab.size());
+    string tail;
+    stream >> tail;
+    ASSERT_EQ(tail, "tail");
+
+    // dumps before the version have no marker, version and flag of the table of indices
+    string dumped = vocab.dumps();
+    vocab2.loads(dumped.substr(2 * sizeof(uint32_t), dumped.size() - 2 * sizeof(uint32_t) - 1));
+    for (const string& word : words)
+        ASSERT_EQ(vocab2[vocab2.get_index(word)], word);
+
     words.clear();
     vocab = Vocabulary<string>(words);
     vocab2.loads(vocab.dumps());
     ASSERT_TRUE(vocab2.begin() == vocab2.end());
 };
+
+TEST(vocabulary_test, keep_order_check) {
+    vector<string> words;
+    unordered_set<string> source_words;
+    for (int i = 0; i < 10000; i++) {
+        string word;
+        for (int j = 0; j < 4; j++)
+            word.push_back(char('a' + prng() % 26));
+        if (source_words.insert(word).second)
+            words.push_back(word);
+    }
+
+    Vocabulary<string> vocab(words, true);
+    Vocabulary<string> vocab2;
+    vocab2.loads(vocab.dumps());
+    ASSERT_EQ(vocab2.size(), words.size());
+    for (uint32_t i = 0; i < words.size(); i++) {
+        ASSERT_EQ(vocab2[i], words[i]);
+        ASSERT_EQ(vocab2.get_index(words[i]), i);
+    }
+    ASSERT_TRUE(vocab2.find("zzzzz") == vocab2.end());
+
+    // the table of indices is found before the data that follows it
+    stringstream stream;
+    vocab.dump(stream);
+    stream << "tail";
+    vocab2.load(stream);
+    string tail;
+    stream >> tail;
+    ASSERT_EQ(tail, "tail");
+    for (uint32_t i = 0; i < words.size(); i++)
+        ASSERT_EQ(vocab2.get_index(words[i]), i);
+
+    vector<string> repeated_words(words);
+    repeated_words.push_back(words[0]);
+    ASSERT_THROW(Vocabulary<string>(repeated_words, true), invalid_argument);
+
+    // a vocabulary in the hash order loaded over one in the given order
+    vocab2.loads(Vocabulary<string>(words).dumps());
+    for (const string& word : words)
+        ASSERT_EQ(vocab2[vocab2.get_index(word)], word);
+};
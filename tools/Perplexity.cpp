@@ -0,0 +1,197 @@
+#include "NGramStorage.h"
+#include "Vocabulary.h"
+#include "LanguageModel.h"
+#include "TextCounts.h"
+#include "Arpa.h"
+#include "MemoryMap.h"
+#include "Parallel.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+using namespace std;
+
+// Scores a tokenized corpus, one sentence per line, and reports perplexity, OOV rate and throughput.
+// Usage: perplexity model corpus [threads] [delta] [eps]
+// A model is an ARPA file (*.arpa), a mapped storage (*.map, next to its *.map.vocab, see
+// CStorage.save_mapped) or a file of counts (see load_text_counts). Models with log probabilities
+// are scored with them, the others with LanguageModel, delta and eps. Unknown words get the
+// probability of an unknown word and are counted in both perplexities, with and without them.
+// When the vocabulary has <s> and </s>, every sentence is wrapped in them: <s> is only a context
+// and </s> is scored and counted in both perplexities, as standard tools do.
+
+struct Statistics {
+    Statistics(): sentences_count(0), words_count(0), unknown_words_count(0), end_markers_count(0),
+                  log_prob(0), known_words_log_prob(0) {}
+
+    uint64_t sentences_count;
+    // words of the corpus, end_markers_count </s> are scored besides them
+    uint64_t words_count;
+    uint64_t unknown_words_count;
+    uint64_t end_markers_count;
+    double log_prob;
+    double known_words_log_prob;
+};
+
+static bool ends_with(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool is_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static uint32_t find_word(Vocabulary<string>& vocabulary, const string& word) {
+    auto it = vocabulary.find(word);
+    // unknown words get an index that is not stored
+    return it != vocabulary.end() ? uint32_t(it - vocabulary.begin()) : ~uint32_t(0);
+}
+
+// Scores the lines of [begin, end) with the log probabilities of the storage or with model
+// if it is not nullptr.
+static Statistics score_lines(const char* begin, const char* end, Vocabulary<string>& vocabulary,
+                              const NGramStorage& storage, const LanguageModel* model) {
+    Statistics statistics;
+    uint32_t max_ngram_size = max<uint32_t>(storage.get_max_ngram_size(), 1);
+    uint32_t begin_marker = find_word(vocabulary, "<s>");
+    uint32_t end_marker = find_word(vocabulary, "</s>");
+    bool markers = begin_marker != ~uint32_t(0) && end_marker != ~uint32_t(0);
+    uint32_t first = markers ? 1 : 0;
+    vector<uint32_t> sentence;
+    vector<double> word_log_probs;
+    string word;
+    while (begin < end) {
+        const char* line_end = (const char*)memchr(begin, '\n', size_t(end - begin));
+        if (line_end == nullptr)
+            line_end = end;
+
+        sentence.clear();
+        if (markers)
+            sentence.push_back(begin_marker);
+        for (const char* position = begin; position < line_end; ) {
+            while (position < line_end && is_separator(*position))
+                position++;
+            const char* token = position;
+            while (position < line_end && !is_separator(*position))
+                position++;
+            if (position > token) {
+                word.assign(token, size_t(position - token));
+                sentence.push_back(find_word(vocabulary, word));
+            }
+        }
+        begin = line_end + 1;
+        if (sentence.size() == first)
+            continue;
+        if (markers)
+            sentence.push_back(end_marker);
+
+        word_log_probs.resize(sentence.size());
+        if (model == nullptr) {
+            for (uint32_t i = first; i < sentence.size(); i++) {
+                uint32_t size = min(i + 1, max_ngram_size);
+                word_log_probs[i] = storage.get_word_log_prob(sentence.data() + i + 1 - size, size);
+            }
+        } else {
+            model->score_sentence(sentence.data(), uint32_t(sentence.size()), word_log_probs.data());
+        }
+
+        statistics.sentences_count++;
+        statistics.words_count += sentence.size() - 2 * first;
+        statistics.end_markers_count += first;
+        for (uint32_t i = first; i < sentence.size(); i++) {
+            statistics.log_prob += word_log_probs[i];
+            if (sentence[i] == ~uint32_t(0))
+                statistics.unknown_words_count++;
+            else
+                statistics.known_words_log_prob += word_log_probs[i];
+        }
+    }
+    return statistics;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s model corpus [threads] [delta] [eps]\n", argv[0]);
+        return 1;
+    }
+    string model_filename = argv[1];
+    string corpus_filename = argv[2];
+    uint32_t threads_count = argc > 3 ? uint32_t(atoi(argv[3])) : max(1u, std::thread::hardware_concurrency());
+    double delta = argc > 4 ? atof(argv[4]) : 0.75;
+    double eps = argc > 5 ? atof(argv[5]) : 1.0;
+    threads_count = max<uint32_t>(threads_count, 1);
+
+    try {
+        auto start = chrono::steady_clock::now();
+        Vocabulary<string> vocabulary;
+        NGramStorage storage;
+        NGramStorage::Options options;
+        options.threads_count = threads_count;
+        if (ends_with(model_filename, ".arpa")) {
+            load_arpa(model_filename, vocabulary, storage, options);
+        } else if (ends_with(model_filename, ".map")) {
+            storage.load_mapped(model_filename);
+            vocabulary.loadf(model_filename + ".vocab");
+        } else {
+            load_text_counts(model_filename, vocabulary, storage, options);
+        }
+        // LanguageModel is limited in order, so it is made only for storages without log probabilities
+        unique_ptr<const LanguageModel> model;
+        if (!storage.has_log_probabilities())
+            model.reset(new LanguageModel(storage, delta, eps));
+        fprintf(stderr, "model loaded in %.2fs\n", seconds_since(start));
+
+        start = chrono::steady_clock::now();
+        MemoryMap corpus(corpus_filename);
+        const char* data = corpus.data();
+        vector<const char*> bounds(threads_count + 1, data);
+        for (uint32_t t = 1; t <= threads_count; t++) {
+            size_t position = max<size_t>(corpus.size() * t / threads_count, size_t(bounds[t - 1] - data));
+            while (position > 0 && position < corpus.size() && data[position - 1] != '\n')
+                position++;
+            bounds[t] = data + position;
+        }
+
+        vector<Statistics> part_statistics(threads_count);
+        parallel_run(threads_count, [&] (uint32_t t) {
+            part_statistics[t] = score_lines(bounds[t], bounds[t + 1], vocabulary, storage, model.get());
+        });
+        double seconds = seconds_since(start);
+
+        Statistics statistics;
+        for (const Statistics& part : part_statistics) {
+            statistics.sentences_count += part.sentences_count;
+            statistics.words_count += part.words_count;
+            statistics.unknown_words_count += part.unknown_words_count;
+            statistics.end_markers_count += part.end_markers_count;
+            statistics.log_prob += part.log_prob;
+            statistics.known_words_log_prob += part.known_words_log_prob;
+        }
+        uint64_t scored_count = statistics.words_count + statistics.end_markers_count;
+        uint64_t known_words_count = scored_count - statistics.unknown_words_count;
+        printf("sentences            %llu\n", (unsigned long long)statistics.sentences_count);
+        printf("words                %llu\n", (unsigned long long)statistics.words_count);
+        printf("unknown words        %llu (%.3f%%)\n", (unsigned long long)statistics.unknown_words_count,
+               100.0 * double(statistics.unknown_words_count) / double(max<uint64_t>(statistics.words_count, 1)));
+        printf("log10 prob           %.4f\n", statistics.log_prob);
+        printf("perplexity           %.4f\n",
+               pow(10.0, -statistics.log_prob / double(max<uint64_t>(scored_count, 1))));
+        printf("perplexity w/o oov   %.4f\n",
+               pow(10.0, -statistics.known_words_log_prob / double(max<uint64_t>(known_words_count, 1))));
+        printf("time                 %.2fs, %.0f words/s on %u threads\n", seconds,
+               double(statistics.words_count) / seconds, threads_count);
+    } catch (const exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}